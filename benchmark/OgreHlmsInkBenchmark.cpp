@@ -0,0 +1,556 @@
+/*
+-----------------------------------------------------------------------------
+This source file is part of OGRE
+    (Object-oriented Graphics Rendering Engine)
+For the latest info, see http://www.ogre3d.org/
+
+Copyright (c) 2000-2014 Torus Knot Software Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+-----------------------------------------------------------------------------
+*/
+
+/*
+    Headless micro-benchmark of the HlmsInk draw path.
+
+    Runs on the NULL render system. Synthetic renderables (no meshes, no shaders) are
+    fed straight to HlmsInk::preparePassHash & fillBuffersForV2, the same way the
+    RenderQueue does, and the time, buffer bytes and commands per draw are reported.
+    Only what HlmsInk adds to the command buffer is counted; the RenderQueue's own
+    VAO/PSO/draw commands are not part of the measurement.
+
+    The scene has a directional light and the workspace a shadow node with a single
+    shadow map, so receivers are recorded with shadows. With --caster, the shadow
+    map's caster pass is recorded too (before the receivers, as the compositor does)
+    using the shadow node's own pass & camera.
+
+    Usage:
+        OgreHlmsInkBenchmark [options]
+            --templates <folder>    Hlms Ink template folder (default: current folder).
+            --datablocks <N>        Number of datablocks (default 64).
+            --renderables <M>       Number of renderables (default 10000).
+            --skinned <percent>     Percentage of skinned renderables (default 10).
+            --bones <B>             Bones per skeleton (default 32).
+            --submeshes <S>         Consecutive skinned renderables sharing a skeleton (default 2).
+            --shared                Use one datablock for every renderable.
+            --caster                Also record the shadow caster pass every frame.
+            --casters <percent>     Percentage of renderables casting shadows (default 100).
+            --parallel              Enable HlmsInk parallel recording.
+            --frames <F>            Measured frames (default 100).
+*/
+
+#include "OgreRoot.h"
+#include "OgreRenderSystem.h"
+#include "OgreRenderWindow.h"
+#include "OgreSceneManager.h"
+#include "OgreCamera.h"
+#include "OgreArchiveManager.h"
+#include "OgreHlmsManager.h"
+#include "OgreTimer.h"
+#include "OgreStringConverter.h"
+#include "OgreOldSkeletonManager.h"
+#include "OgreSkeleton.h"
+#include "Animation/OgreSkeletonDef.h"
+#include "Animation/OgreSkeletonInstance.h"
+#include "Compositor/OgreCompositorManager2.h"
+#include "Compositor/OgreCompositorNodeDef.h"
+#include "Compositor/OgreCompositorShadowNodeDef.h"
+#include "Compositor/OgreCompositorShadowNode.h"
+#include "Compositor/OgreCompositorWorkspace.h"
+#include "Compositor/OgreCompositorWorkspaceDef.h"
+#include "Compositor/Pass/PassClear/OgreCompositorPassClearDef.h"
+#include "Compositor/Pass/PassScene/OgreCompositorPassScene.h"
+#include "Compositor/Pass/PassScene/OgreCompositorPassSceneDef.h"
+#include "CommandBuffer/OgreCommandBuffer.h"
+#include "CommandBuffer/OgreCbTexture.h"
+
+#include "OgreHlmsInk.h"
+#include "OgreHlmsInkDatablock.h"
+
+#include <iostream>
+
+using namespace Ogre;
+
+namespace
+{
+    struct BenchmarkSettings
+    {
+        String  templateFolder;
+        size_t  numDatablocks;
+        size_t  numRenderables;
+        size_t  skinnedPercent;
+        size_t  numBones;
+        size_t  numSubmeshes;
+        bool    sharedDatablock;
+        bool    casterPass;
+        size_t  castersPercent;
+        bool    parallelRecording;
+        size_t  numFrames;
+
+        BenchmarkSettings() :
+            templateFolder( "." ),
+            numDatablocks( 64 ),
+            numRenderables( 10000 ),
+            skinnedPercent( 10 ),
+            numBones( 32 ),
+            numSubmeshes( 2 ),
+            sharedDatablock( false ),
+            casterPass( false ),
+            castersPercent( 100 ),
+            parallelRecording( false ),
+            numFrames( 100 )
+        {
+        }
+    };
+
+    /// Just enough of a MovableObject to provide a node transform & a skeleton.
+    class BenchmarkObject : public MovableObject
+    {
+    public:
+        BenchmarkObject( SceneManager *sceneManager, SkeletonInstance *skeletonInstance ) :
+            MovableObject( Id::generateNewId<MovableObject>(),
+                           &sceneManager->_getEntityMemoryManager( SCENE_DYNAMIC ),
+                           sceneManager, 0 )
+        {
+            mSkeletonInstance = skeletonInstance;
+            //Never let the scene pass render it, we feed it to HlmsInk ourselves.
+            setVisible( false );
+        }
+
+        virtual ~BenchmarkObject()
+        {
+            mSkeletonInstance = 0;
+        }
+
+        virtual const String& getMovableType(void) const
+        {
+            static const String movableType( "HlmsInkBenchmarkObject" );
+            return movableType;
+        }
+    };
+
+    /// Renderable with no geometry. The datablock is assigned directly since there
+    /// is no vertex data to calculate the Hlms hash from.
+    class BenchmarkRenderable : public Renderable, public RenderableAnimated
+    {
+    public:
+        BenchmarkRenderable( HlmsDatablock *datablock, RenderableAnimated::IndexMap *indexMap )
+        {
+            mHlmsDatablock = datablock;
+            mHasSkeletonAnimation = indexMap != 0;
+            mBlendIndexToBoneIndexMap = indexMap;
+        }
+
+        virtual ~BenchmarkRenderable()
+        {
+            mHlmsDatablock = 0;
+            mBlendIndexToBoneIndexMap = 0;
+        }
+
+        virtual const LightList& getLights(void) const
+        {
+            static const LightList lightList;
+            return lightList;
+        }
+
+        virtual void getRenderOperation( v1::RenderOperation &op, bool casterPass ) {}
+        virtual void getWorldTransforms( Matrix4 *xform ) const     { *xform = Matrix4::IDENTITY; }
+        virtual bool getCastsShadows(void) const                    { return true; }
+    };
+    //-----------------------------------------------------------------------------------
+    bool parseSettings( int argc, char *argv[], BenchmarkSettings &outSettings )
+    {
+        for( int i=1; i<argc; ++i )
+        {
+            const String arg( argv[i] );
+            const bool hasValue = i + 1 < argc;
+
+            if( arg == "--shared" )
+                outSettings.sharedDatablock = true;
+            else if( arg == "--caster" )
+                outSettings.casterPass = true;
+            else if( arg == "--casters" && hasValue )
+                outSettings.castersPercent = StringConverter::parseUnsignedInt( argv[++i], 100 );
+            else if( arg == "--parallel" )
+                outSettings.parallelRecording = true;
+            else if( arg == "--templates" && hasValue )
+                outSettings.templateFolder = argv[++i];
+            else if( arg == "--datablocks" && hasValue )
+                outSettings.numDatablocks = StringConverter::parseUnsignedInt( argv[++i], 64 );
+            else if( arg == "--renderables" && hasValue )
+                outSettings.numRenderables = StringConverter::parseUnsignedInt( argv[++i], 10000 );
+            else if( arg == "--skinned" && hasValue )
+                outSettings.skinnedPercent = StringConverter::parseUnsignedInt( argv[++i], 10 );
+            else if( arg == "--bones" && hasValue )
+                outSettings.numBones = StringConverter::parseUnsignedInt( argv[++i], 32 );
+            else if( arg == "--submeshes" && hasValue )
+                outSettings.numSubmeshes = StringConverter::parseUnsignedInt( argv[++i], 2 );
+            else if( arg == "--frames" && hasValue )
+                outSettings.numFrames = StringConverter::parseUnsignedInt( argv[++i], 100 );
+            else
+                return false;
+        }
+
+        outSettings.numDatablocks   = std::max<size_t>( outSettings.numDatablocks, 1u );
+        outSettings.numBones        = Math::Clamp<size_t>( outSettings.numBones, 1u, 256u );
+        outSettings.numSubmeshes    = std::max<size_t>( outSettings.numSubmeshes, 1u );
+        outSettings.skinnedPercent  = std::min<size_t>( outSettings.skinnedPercent, 100u );
+        outSettings.castersPercent  = std::min<size_t>( outSettings.castersPercent, 100u );
+
+        return true;
+    }
+    //-----------------------------------------------------------------------------------
+    SkeletonDefPtr createSkeletonDef( size_t numBones )
+    {
+        v1::SkeletonPtr skeleton = v1::OldSkeletonManager::getSingleton().create(
+                    "HlmsInkBenchmarkSkeleton",
+                    ResourceGroupManager::INTERNAL_RESOURCE_GROUP_NAME, true ).
+                staticCast<v1::Skeleton>();
+
+        v1::OldBone *parent = skeleton->createBone( "Bone0" );
+        for( size_t i=1; i<numBones; ++i )
+        {
+            v1::OldBone *bone = skeleton->createBone( "Bone" + StringConverter::toString( i ) );
+            parent->addChild( bone );
+            parent = bone;
+        }
+
+        return SkeletonDefPtr( OGRE_NEW SkeletonDef( skeleton.get(), 1.0f ) );
+    }
+    //-----------------------------------------------------------------------------------
+    /// Same as CompositorManager2::createBasicWorkspaceDef, but the scene pass
+    /// uses a shadow node with one focused shadow map for the first light.
+    void createWorkspaceDef( CompositorManager2 *compositorManager, const String &workspaceName,
+                             const String &shadowNodeName )
+    {
+        CompositorShadowNodeDef *shadowNodeDef =
+                compositorManager->addShadowNodeDefinition( shadowNodeName );
+        shadowNodeDef->setDefaultTechnique( SHADOWMAP_FOCUSED );
+        shadowNodeDef->setNumLocalTextureDefinitions( 1 );
+        shadowNodeDef->setNumShadowTextureDefinitions( 1 );
+        {
+            TextureDefinitionBase::TextureDefinition *texDef =
+                    shadowNodeDef->addTextureDefinition( "HlmsInkBenchmarkShadowMap" );
+            texDef->width   = 1024;
+            texDef->height  = 1024;
+            texDef->formatList.push_back( PF_D32_FLOAT );
+
+            shadowNodeDef->addShadowTextureDefinition( 0, 0, "HlmsInkBenchmarkShadowMap",
+                                                       Vector2::ZERO, Vector2::UNIT_SCALE, 0 );
+        }
+        shadowNodeDef->setNumTargetPass( 1 );
+        {
+            CompositorTargetDef *targetDef = shadowNodeDef->addTargetPass(
+                        "HlmsInkBenchmarkShadowMap" );
+            targetDef->setNumPasses( 2 );
+            targetDef->addPass( PASS_CLEAR );
+            CompositorPassSceneDef *passScene =
+                    static_cast<CompositorPassSceneDef*>( targetDef->addPass( PASS_SCENE ) );
+            passScene->mShadowMapIdx = 0;
+            passScene->mIncludeOverlays = false;
+        }
+
+        const String nodeName = workspaceName + "/Node";
+        CompositorNodeDef *nodeDef = compositorManager->addNodeDefinition( nodeName );
+        nodeDef->addTextureSourceName( "WindowRT", 0, TextureDefinitionBase::TEXTURE_INPUT );
+        nodeDef->setNumTargetPass( 1 );
+        {
+            CompositorTargetDef *targetDef = nodeDef->addTargetPass( "WindowRT" );
+            targetDef->setNumPasses( 2 );
+            CompositorPassClearDef *passClear =
+                    static_cast<CompositorPassClearDef*>( targetDef->addPass( PASS_CLEAR ) );
+            passClear->mColourValue = ColourValue::Black;
+            CompositorPassSceneDef *passScene =
+                    static_cast<CompositorPassSceneDef*>( targetDef->addPass( PASS_SCENE ) );
+            passScene->mShadowNode = shadowNodeName;
+        }
+
+        CompositorWorkspaceDef *workspaceDef =
+                compositorManager->addWorkspaceDefinition( workspaceName );
+        workspaceDef->connectExternal( 0, nodeName, 0 );
+    }
+    //-----------------------------------------------------------------------------------
+    CompositorPassScene* findShadowMapPass( CompositorShadowNode *shadowNode )
+    {
+        const CompositorPassVec &passes = shadowNode->_getPasses();
+        CompositorPassVec::const_iterator itor = passes.begin();
+        CompositorPassVec::const_iterator end  = passes.end();
+        while( itor != end )
+        {
+            if( (*itor)->getType() == PASS_SCENE )
+                return static_cast<CompositorPassScene*>( *itor );
+            ++itor;
+        }
+
+        return 0;
+    }
+}
+
+int main( int argc, char *argv[] )
+{
+    BenchmarkSettings settings;
+    if( !parseSettings( argc, argv, settings ) )
+    {
+        std::cerr << "Invalid arguments. See the top of OgreHlmsInkBenchmark.cpp" << std::endl;
+        return 1;
+    }
+
+    Root *root = OGRE_NEW Root( "", "", "OgreHlmsInkBenchmark.log" );
+    root->loadPlugin( "RenderSystem_NULL" );
+    root->setRenderSystem( root->getRenderSystemByName( "NULL Rendering Subsystem" ) );
+    root->initialise( false );
+    RenderWindow *window = root->createRenderWindow( "HlmsInkBenchmark", 1, 1, false );
+
+    Archive *archive = ArchiveManager::getSingleton().load( settings.templateFolder,
+                                                              "FileSystem", true );
+    HlmsInk *hlmsInk = OGRE_NEW HlmsInk( archive, 0 );
+    HlmsManager *hlmsManager = root->getHlmsManager();
+    hlmsManager->registerHlms( hlmsInk );
+    hlmsInk->setParallelRecording( settings.parallelRecording );
+
+    SceneManager *sceneManager = root->createSceneManager( ST_GENERIC, 1,
+                                                           INSTANCING_CULLING_SINGLETHREAD );
+    Camera *camera = sceneManager->createCamera( "BenchmarkCamera" );
+    camera->setPosition( 0, 0, 100 );
+    camera->lookAt( 0, 0, 0 );
+
+    Light *light = sceneManager->createLight();
+    SceneNode *lightNode = sceneManager->getRootSceneNode()->createChildSceneNode();
+    lightNode->attachObject( light );
+    light->setType( Light::LT_DIRECTIONAL );
+    light->setDirection( Vector3( -1, -1, -1 ).normalisedCopy() );
+    light->setCastShadows( true );
+
+    //An empty scene pass: each frame sets up the viewport, camera, shadow node
+    //& frame boundaries our manually recorded passes rely on.
+    CompositorManager2 *compositorManager = root->getCompositorManager2();
+    createWorkspaceDef( compositorManager, "HlmsInkBenchmarkWorkspace",
+                        "HlmsInkBenchmarkShadowNode" );
+    CompositorWorkspace *workspace = compositorManager->addWorkspace(
+                sceneManager, window, camera, "HlmsInkBenchmarkWorkspace", true );
+
+    //Datablocks
+    const size_t numDatablocks = settings.sharedDatablock ? 1u : settings.numDatablocks;
+    vector<HlmsDatablock*>::type datablocks;
+    datablocks.reserve( numDatablocks );
+    for( size_t i=0; i<numDatablocks; ++i )
+    {
+        const String name = "HlmsInkBenchmark/" + StringConverter::toString( i );
+        HlmsInkDatablock *datablock = static_cast<HlmsInkDatablock*>(
+                    hlmsInk->createDatablock( name, name, HlmsMacroblock(),
+                                              HlmsBlendblock(), HlmsParamVec() ) );
+        datablock->setDiffuse( Vector3( Math::UnitRandom(), Math::UnitRandom(),
+                                        Math::UnitRandom() ) );
+        datablocks.push_back( datablock );
+    }
+
+    //Renderables
+    SkeletonDefPtr skeletonDef = createSkeletonDef( settings.numBones );
+    RenderableAnimated::IndexMap indexMap;
+    for( size_t i=0; i<settings.numBones; ++i )
+        indexMap.push_back( static_cast<uint16>( i ) );
+
+    vector<SkeletonInstance*>::type skeletons;
+    vector<BenchmarkObject*>::type objects;
+    vector<BenchmarkRenderable*>::type renderables;
+    vector<QueuedRenderable>::type queuedRenderables;
+    objects.reserve( settings.numRenderables );
+    renderables.reserve( settings.numRenderables );
+    queuedRenderables.reserve( settings.numRenderables );
+
+    const size_t numSkinned = (settings.numRenderables * settings.skinnedPercent) / 100u;
+    vector<QueuedRenderable>::type queuedCasters;
+    size_t numSkinnedDraws = 0;
+    BenchmarkObject *skinnedObject = 0;
+
+    for( size_t i=0; i<settings.numRenderables; ++i )
+    {
+        const bool skinned = i < numSkinned;
+        BenchmarkObject *object = 0;
+
+        if( skinned && (numSkinnedDraws % settings.numSubmeshes) != 0 )
+        {
+            //Another submesh of the same skinned object.
+            object = skinnedObject;
+        }
+        else
+        {
+            SkeletonInstance *skeletonInstance = 0;
+            if( skinned )
+            {
+                skeletonInstance = sceneManager->createSkeletonInstance( skeletonDef.get() );
+                skeletons.push_back( skeletonInstance );
+            }
+
+            object = OGRE_NEW BenchmarkObject( sceneManager, skeletonInstance );
+            SceneNode *sceneNode = sceneManager->getRootSceneNode()->createChildSceneNode();
+            sceneNode->setPosition( Math::RangeRandom( -50.0f, 50.0f ),
+                                    Math::RangeRandom( -50.0f, 50.0f ),
+                                    Math::RangeRandom( -50.0f, 50.0f ) );
+            sceneNode->attachObject( object );
+            objects.push_back( object );
+
+            if( skinned )
+                skinnedObject = object;
+        }
+
+        if( skinned )
+            ++numSkinnedDraws;
+
+        renderables.push_back( OGRE_NEW BenchmarkRenderable( datablocks[i % numDatablocks],
+                                                             skinned ? &indexMap : 0 ) );
+        queuedRenderables.push_back( QueuedRenderable( 0, renderables.back(), object ) );
+        //Casters are spread evenly, independently of being skinned or not.
+        if( ((i + 1u) * settings.castersPercent) / 100u > (i * settings.castersPercent) / 100u )
+            queuedCasters.push_back( queuedRenderables.back() );
+    }
+
+    //Updates the node transforms, the shadow node & frame boundaries.
+    root->renderOneFrame();
+
+    CompositorShadowNode *shadowNode = workspace->findShadowNode( "HlmsInkBenchmarkShadowNode" );
+    CompositorPassScene *shadowMapPass = shadowNode ? findShadowMapPass( shadowNode ) : 0;
+    if( !shadowMapPass )
+    {
+        std::cerr << "The shadow node wasn't created" << std::endl;
+        OGRE_DELETE root;
+        return 1;
+    }
+
+    const HlmsCache drawCache( (HLMS_USER0 << HlmsBits::HlmsTypeShift) | 1u, HLMS_USER0, HlmsPso() );
+
+    uint64 receiverMicroseconds = 0;
+    uint64 casterMicroseconds = 0;
+    size_t totalCommands = 0;
+    HlmsInk::PassStats totalStats;
+
+    Timer timer;
+
+    for( size_t frame=0; frame<settings.numFrames; ++frame )
+    {
+        CommandBuffer *commandBuffer = OGRE_NEW CommandBuffer();
+
+        if( settings.casterPass )
+        {
+            //What the shadow node's pass sets while it renders: the
+            //caster pass reads its light & depth range from them.
+            CompositorPass *mainPass = sceneManager->getCurrentCompositorPass();
+            sceneManager->_setCurrentCompositorPass( shadowMapPass );
+            sceneManager->_setCameraInProgress( shadowMapPass->getCamera() );
+
+            timer.reset();
+
+            hlmsInk->preparePassHash( shadowNode, true, false, sceneManager );
+
+            uint32 lastCacheHash = 0;
+            vector<QueuedRenderable>::type::const_iterator itor = queuedCasters.begin();
+            vector<QueuedRenderable>::type::const_iterator end  = queuedCasters.end();
+            while( itor != end )
+            {
+                hlmsInk->fillBuffersForV2( &drawCache, *itor, true,
+                                           lastCacheHash, commandBuffer );
+                lastCacheHash = drawCache.hash;
+                ++itor;
+            }
+
+            //With parallel recording, the caster's deferred writes
+            //are flushed (and timed) by the receiver's preparePassHash.
+            casterMicroseconds += timer.getMicroseconds();
+
+            sceneManager->_setCameraInProgress( camera );
+            sceneManager->_setCurrentCompositorPass( mainPass );
+        }
+
+        timer.reset();
+
+        hlmsInk->preparePassHash( shadowNode, false, false, sceneManager );
+
+        uint32 lastCacheHash = 0;
+        vector<QueuedRenderable>::type::const_iterator itor = queuedRenderables.begin();
+        vector<QueuedRenderable>::type::const_iterator end  = queuedRenderables.end();
+        while( itor != end )
+        {
+            hlmsInk->fillBuffersForV2( &drawCache, *itor, false,
+                                       lastCacheHash, commandBuffer );
+            lastCacheHash = drawCache.hash;
+            ++itor;
+        }
+
+        //Flushes deferred writes & unmaps, as the RenderQueue does before execution.
+        hlmsInk->preCommandBufferExecution( commandBuffer );
+
+        receiverMicroseconds += timer.getMicroseconds();
+
+        //The command buffer is never executed, a harmless marker tells how many commands
+        //HlmsInk added in total.
+        CbTextureDisableFrom *marker = commandBuffer->addCommand<CbTextureDisableFrom>();
+        *marker = CbTextureDisableFrom( OGRE_MAX_TEXTURE_LAYERS );
+        totalCommands += commandBuffer->getCommandOffset( marker ) / COMMAND_FIXED_SIZE;
+
+        hlmsInk->postCommandBufferExecution( commandBuffer );
+        OGRE_DELETE commandBuffer;
+
+        //Ends the frame, publishing the stats of the passes we just recorded.
+        root->renderOneFrame();
+        totalStats.accumulate( hlmsInk->getFrameStats().totals );
+    }
+
+    const size_t numCasterDraws = settings.casterPass ? queuedCasters.size() : 0u;
+    const double numReceiverDraws = static_cast<double>( settings.numFrames *
+                                                         settings.numRenderables );
+    const double numCasterFrameDraws = static_cast<double>( settings.numFrames * numCasterDraws );
+    const double numDraws = numReceiverDraws + numCasterFrameDraws;
+
+    std::cout << "HlmsInk draw path: " << settings.numRenderables << " renderables ("
+              << numSkinned << " skinned), " << numDatablocks << " datablocks, "
+              << "receiver pass" << (settings.casterPass ? " + caster pass (" : "")
+              << (settings.casterPass ? StringConverter::toString( numCasterDraws ) +
+                                        " casters)" : String())
+              << ", " << settings.numFrames << " frames" << std::endl;
+    std::cout << "  ns/draw:        "
+              << ((receiverMicroseconds + casterMicroseconds) * 1000.0) / numDraws << std::endl;
+    std::cout << "    receivers:    " << (receiverMicroseconds * 1000.0) / numReceiverDraws
+              << std::endl;
+    if( settings.casterPass && numCasterDraws )
+    {
+        std::cout << "    casters:      " << (casterMicroseconds * 1000.0) / numCasterFrameDraws
+                  << std::endl;
+    }
+    std::cout << "  bytes/draw:     "
+              << (totalStats.constBufferBytes + totalStats.texBufferBytes) / numDraws << std::endl;
+    std::cout << "  commands/draw:  " << totalCommands / numDraws << std::endl;
+    std::cout << "  elided binds:   " << totalStats.numElidedBindings / numDraws << " per draw"
+              << std::endl;
+
+    //Cleanup
+    for( size_t i=0; i<objects.size(); ++i )
+    {
+        objects[i]->detachFromParent();
+        OGRE_DELETE objects[i];
+    }
+    for( size_t i=0; i<renderables.size(); ++i )
+        OGRE_DELETE renderables[i];
+    for( size_t i=0; i<skeletons.size(); ++i )
+        sceneManager->destroySkeletonInstance( skeletons[i] );
+    skeletonDef.setNull();
+
+    OGRE_DELETE root;
+
+    return 0;
+}
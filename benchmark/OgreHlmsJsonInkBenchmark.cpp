@@ -0,0 +1,437 @@
+/*
+-----------------------------------------------------------------------------
+This source file is part of OGRE
+    (Object-oriented Graphics Rendering Engine)
+For the latest info, see http://www.ogre3d.org/
+
+Copyright (c) 2000-2014 Torus Knot Software Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+-----------------------------------------------------------------------------
+*/
+
+/*
+    Compares loading a large Ink JSON material library with HlmsJson::loadMaterials (DOM)
+    against HlmsJsonInkStream (SAX), both from memory and from a DataStream.
+
+    Runs on the NULL render system. Unless --file is given, a synthetic library without
+    textures is generated. Each run loads the whole library and destroys it again; the
+    best time of all runs is reported, along with the memory held by JSON values (the
+    whole document for the DOM path, the named blocks plus one entry for the stream).
+    Every datablock the SAX loader creates is compared field by field against the one
+    the DOM loader created; the benchmark fails if any differs.
+
+    Usage:
+        OgreHlmsJsonInkBenchmark [options]
+            --templates <folder>    Hlms Ink template folder (default: current folder).
+            --materials <N>         Materials in the synthetic library (default 20000).
+            --file <path>           Load this material file instead of a synthetic one.
+            --runs <R>              Runs of each loader (default 3).
+*/
+
+#include "OgreRoot.h"
+#include "OgreRenderSystem.h"
+#include "OgreRenderWindow.h"
+#include "OgreArchiveManager.h"
+#include "OgreHlmsManager.h"
+#include "OgreHlmsJson.h"
+#include "OgreTimer.h"
+#include "OgreStringConverter.h"
+#include "OgreDataStream.h"
+#include "OgreTexture.h"
+
+#include "OgreHlmsInk.h"
+#include "OgreHlmsInkDatablock.h"
+#include "OgreHlmsJsonInkStream.h"
+
+#include "rapidjson/document.h"
+
+#include <fstream>
+#include <limits>
+#include <map>
+#include <iostream>
+#include <sstream>
+
+using namespace Ogre;
+
+namespace
+{
+    struct BenchmarkSettings
+    {
+        String  templateFolder;
+        size_t  numMaterials;
+        String  file;
+        size_t  numRuns;
+
+        BenchmarkSettings() :
+            templateFolder( "." ),
+            numMaterials( 20000 ),
+            numRuns( 3 )
+        {
+        }
+    };
+    //-----------------------------------------------------------------------------------
+    bool parseSettings( int argc, char *argv[], BenchmarkSettings &outSettings )
+    {
+        for( int i=1; i<argc; ++i )
+        {
+            const String arg( argv[i] );
+            const bool hasValue = i + 1 < argc;
+
+            if( arg == "--templates" && hasValue )
+                outSettings.templateFolder = argv[++i];
+            else if( arg == "--materials" && hasValue )
+                outSettings.numMaterials = StringConverter::parseUnsignedInt( argv[++i], 20000 );
+            else if( arg == "--file" && hasValue )
+                outSettings.file = argv[++i];
+            else if( arg == "--runs" && hasValue )
+                outSettings.numRuns = StringConverter::parseUnsignedInt( argv[++i], 3 );
+            else
+                return false;
+        }
+
+        outSettings.numRuns = std::max<size_t>( outSettings.numRuns, 1u );
+
+        return true;
+    }
+    //-----------------------------------------------------------------------------------
+    String randomVector3(void)
+    {
+        return "[" + StringConverter::toString( Math::UnitRandom() ) + ", " +
+                StringConverter::toString( Math::UnitRandom() ) + ", " +
+                StringConverter::toString( Math::UnitRandom() ) + "]";
+    }
+    //-----------------------------------------------------------------------------------
+    String generateLibrary( size_t numMaterials )
+    {
+        String json;
+        json.reserve( numMaterials * 512u );
+
+        json += "{\n"
+                "\t\"samplers\" : { \"Sampler_wrap\" : { \"u\" : \"wrap\", \"v\" : \"wrap\" } },\n"
+                "\t\"macroblocks\" : {\n"
+                "\t\t\"Macroblock_0\" : { \"cull_mode\" : \"clockwise\" },\n"
+                "\t\t\"Macroblock_1\" : { \"cull_mode\" : \"none\" }\n"
+                "\t},\n"
+                "\t\"blendblocks\" : {\n"
+                "\t\t\"Blendblock_0\" : { \"blend_operation\" : \"add\" }\n"
+                "\t},\n"
+                "\t\"Ink\" : {\n";
+
+        for( size_t i=0; i<numMaterials; ++i )
+        {
+            json += "\t\t\"HlmsJsonInkBenchmark/" + StringConverter::toString( i ) + "\" : {\n";
+            json += "\t\t\t\"macroblock\" : \"Macroblock_" + StringConverter::toString( i & 1u ) +
+                    "\",\n";
+            json += "\t\t\t\"blendblock\" : \"Blendblock_0\",\n";
+            json += "\t\t\t\"workflow\" : \"specular_ogre\",\n";
+            json += "\t\t\t\"diffuse\" : { \"value\" : " + randomVector3() +
+                    ", \"background\" : [1, 1, 1, 1] },\n";
+            json += "\t\t\t\"specular\" : { \"value\" : " + randomVector3() + " },\n";
+            json += "\t\t\t\"roughness\" : { \"value\" : " +
+                    StringConverter::toString( Math::UnitRandom() ) + " },\n";
+            json += "\t\t\t\"fresnel\" : { \"mode\" : \"coeff\", \"value\" : 0.1 },\n";
+            json += "\t\t\t\"detail_diffuse0\" : { \"value\" : 0.5, \"mode\" : \"Multiply\", "
+                    "\"offset\" : [0, 0], \"scale\" : [4, 4] }\n";
+            json += (i + 1u == numMaterials) ? "\t\t}\n" : "\t\t},\n";
+        }
+
+        json += "\t}\n}\n";
+
+        return json;
+    }
+    //-----------------------------------------------------------------------------------
+    void describeSamplerblock( std::ostream &out, const HlmsSamplerblock *samplerblock )
+    {
+        if( !samplerblock )
+        {
+            out << " sampler(none)";
+            return;
+        }
+
+        out << " sampler(" << samplerblock->mMinFilter << " " << samplerblock->mMagFilter << " "
+            << samplerblock->mMipFilter << " " << samplerblock->mU << " " << samplerblock->mV
+            << " " << samplerblock->mW << " " << samplerblock->mMipLodBias << " "
+            << samplerblock->mMaxAnisotropy << " " << samplerblock->mCompareFunction << " "
+            << samplerblock->mBorderColour << " " << samplerblock->mMinLod << " "
+            << samplerblock->mMaxLod << ")";
+    }
+    //-----------------------------------------------------------------------------------
+    /// Every setting of the datablock a material file can change, as text.
+    String describeDatablock( const HlmsInkDatablock *datablock )
+    {
+        std::ostringstream out;
+
+        out << " diffuse " << datablock->getDiffuse()
+            << " background " << datablock->getBackgroundDiffuse()
+            << " specular " << datablock->getSpecular()
+            << " roughness " << datablock->getRoughness()
+            << " workflow " << datablock->getWorkflow()
+            << " metallness " << datablock->getMetallness()
+            << " fresnel " << datablock->getFresnel()
+            << " transparency " << datablock->getTransparency() << " "
+            << datablock->getTransparencyMode() << " " << datablock->getUseAlphaFromTextures()
+            << " normalWeight " << datablock->getNormalMapWeight()
+            << " dryness " << datablock->getDryness()
+            << " density " << datablock->getDensity()
+            << " twoSided " << datablock->getTwoSidedLighting()
+            << " brdf " << datablock->getBrdf()
+            << " alphaTest " << datablock->getAlphaTest() << " "
+            << datablock->getAlphaTestThreshold();
+
+        for( uint8 i=0; i<4; ++i )
+        {
+            out << " detail" << (int)i << " " << datablock->getDetailMapBlendMode( i ) << " "
+                << datablock->getDetailMapWeight( i ) << " "
+                << datablock->getDetailNormalWeight( i ) << " "
+                << datablock->getDetailMapOffsetScale( i );
+        }
+
+        for( size_t i=0; i<NUM_INK_TEXTURE_TYPES; ++i )
+        {
+            const InkTextureTypes texType = static_cast<InkTextureTypes>( i );
+            const TexturePtr texture = datablock->getTexture( texType );
+            out << " tex" << i << " " << (texture.isNull() ? BLANKSTRING : texture->getName())
+                << " uv " << (int)datablock->getTextureUvSource( texType );
+            describeSamplerblock( out, datablock->getSamplerblock( texType ) );
+        }
+
+        for( size_t i=0; i<2; ++i )
+        {
+            const HlmsMacroblock *macroblock = datablock->getMacroblock( i != 0 );
+            out << " macroblock(" << macroblock->mScissorTestEnabled << " "
+                << macroblock->mDepthCheck << " " << macroblock->mDepthWrite << " "
+                << macroblock->mDepthFunc << " " << macroblock->mDepthBiasConstant << " "
+                << macroblock->mDepthBiasSlopeScale << " " << macroblock->mCullMode << " "
+                << macroblock->mPolygonMode << ")";
+
+            const HlmsBlendblock *blendblock = datablock->getBlendblock( i != 0 );
+            out << " blendblock(" << blendblock->mAlphaToCoverageEnabled << " "
+                << (int)blendblock->mBlendChannelMask << " " << blendblock->mIsTransparent << " "
+                << blendblock->mSeparateBlend << " " << blendblock->mSourceBlendFactor << " "
+                << blendblock->mDestBlendFactor << " " << blendblock->mSourceBlendFactorAlpha
+                << " " << blendblock->mDestBlendFactorAlpha << " "
+                << blendblock->mBlendOperation << " " << blendblock->mBlendOperationAlpha << ")";
+        }
+
+        return out.str();
+    }
+    //-----------------------------------------------------------------------------------
+    typedef std::map<IdString, String> DatablockDescriptions;
+
+    void describeLoadedDatablocks( Hlms *hlms, HlmsDatablock *defaultDatablock,
+                                   DatablockDescriptions &outDescriptions )
+    {
+        outDescriptions.clear();
+
+        const Hlms::HlmsDatablockMap &datablocks = hlms->getDatablockMap();
+        Hlms::HlmsDatablockMap::const_iterator itor = datablocks.begin();
+        Hlms::HlmsDatablockMap::const_iterator end  = datablocks.end();
+        while( itor != end )
+        {
+            if( itor->second.datablock != defaultDatablock )
+            {
+                outDescriptions[itor->first] = describeDatablock(
+                            static_cast<const HlmsInkDatablock*>( itor->second.datablock ) );
+            }
+            ++itor;
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    /// Prints the first difference. Returns false if there's any.
+    bool compareDatablocks( const DatablockDescriptions &dom, const DatablockDescriptions &sax,
+                            const char *saxLoaderName )
+    {
+        if( dom.size() != sax.size() )
+        {
+            std::cerr << saxLoaderName << " created " << sax.size() << " datablocks, the DOM "
+                      << "loader " << dom.size() << std::endl;
+            return false;
+        }
+
+        DatablockDescriptions::const_iterator itDom = dom.begin();
+        DatablockDescriptions::const_iterator itSax = sax.begin();
+        while( itDom != dom.end() )
+        {
+            if( itDom->first != itSax->first )
+            {
+                std::cerr << saxLoaderName << " created " << itSax->first.getFriendlyText()
+                          << ", which the DOM loader didn't" << std::endl;
+                return false;
+            }
+
+            if( itDom->second != itSax->second )
+            {
+                std::cerr << saxLoaderName << " loaded " << itDom->first.getFriendlyText()
+                          << " differently:\n  DOM:" << itDom->second
+                          << "\n  SAX:" << itSax->second << std::endl;
+                return false;
+            }
+
+            ++itDom;
+            ++itSax;
+        }
+
+        return true;
+    }
+    //-----------------------------------------------------------------------------------
+    void destroyLoadedDatablocks( Hlms *hlms, HlmsDatablock *defaultDatablock )
+    {
+        vector<IdString>::type names;
+
+        const Hlms::HlmsDatablockMap &datablocks = hlms->getDatablockMap();
+        Hlms::HlmsDatablockMap::const_iterator itor = datablocks.begin();
+        Hlms::HlmsDatablockMap::const_iterator end  = datablocks.end();
+        while( itor != end )
+        {
+            if( itor->second.datablock != defaultDatablock )
+                names.push_back( itor->first );
+            ++itor;
+        }
+
+        for( size_t i=0; i<names.size(); ++i )
+            hlms->destroyDatablock( names[i] );
+    }
+}
+
+int main( int argc, char *argv[] )
+{
+    BenchmarkSettings settings;
+    if( !parseSettings( argc, argv, settings ) )
+    {
+        std::cerr << "Invalid arguments. See the top of OgreHlmsJsonInkBenchmark.cpp" << std::endl;
+        return 1;
+    }
+
+    String json;
+    if( !settings.file.empty() )
+    {
+        std::ifstream file( settings.file.c_str(), std::ios::in | std::ios::binary );
+        if( !file.is_open() )
+        {
+            std::cerr << "Could not open " << settings.file << std::endl;
+            return 1;
+        }
+        std::stringstream contents;
+        contents << file.rdbuf();
+        json = contents.str();
+    }
+    else
+    {
+        json = generateLibrary( settings.numMaterials );
+    }
+
+    Root *root = OGRE_NEW Root( "", "", "OgreHlmsJsonInkBenchmark.log" );
+    root->loadPlugin( "RenderSystem_NULL" );
+    root->setRenderSystem( root->getRenderSystemByName( "NULL Rendering Subsystem" ) );
+    root->initialise( false );
+    root->createRenderWindow( "HlmsJsonInkBenchmark", 1, 1, false );
+
+    Archive *archive = ArchiveManager::getSingleton().load( settings.templateFolder,
+                                                              "FileSystem", true );
+    HlmsInk *hlmsInk = OGRE_NEW HlmsInk( archive, 0 );
+    HlmsManager *hlmsManager = root->getHlmsManager();
+    hlmsManager->registerHlms( hlmsInk );
+
+    HlmsDatablock *defaultDatablock = hlmsInk->getDefaultDatablock();
+    const String &resourceGroup = ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME;
+
+    uint64 domMicroseconds = std::numeric_limits<uint64>::max();
+    uint64 streamMicroseconds = std::numeric_limits<uint64>::max();
+    uint64 dataStreamMicroseconds = std::numeric_limits<uint64>::max();
+    size_t streamValueBytes = 0;
+
+    DatablockDescriptions domDatablocks;
+    DatablockDescriptions saxDatablocks;
+
+    Timer timer;
+
+    for( size_t run=0; run<settings.numRuns; ++run )
+    {
+        {
+            HlmsJson hlmsJson( hlmsManager );
+            timer.reset();
+            hlmsJson.loadMaterials( "HlmsJsonInkBenchmark", resourceGroup, json.c_str() );
+            domMicroseconds = std::min( domMicroseconds, timer.getMicroseconds() );
+        }
+
+        describeLoadedDatablocks( hlmsInk, defaultDatablock, domDatablocks );
+        destroyLoadedDatablocks( hlmsInk, defaultDatablock );
+
+        {
+            HlmsJsonInkStream hlmsJsonStream( hlmsManager );
+            timer.reset();
+            hlmsJsonStream.loadMaterials( "HlmsJsonInkBenchmark", resourceGroup, json.c_str() );
+            streamMicroseconds = std::min( streamMicroseconds, timer.getMicroseconds() );
+            streamValueBytes = hlmsJsonStream.getPeakValueBytes();
+        }
+
+        describeLoadedDatablocks( hlmsInk, defaultDatablock, saxDatablocks );
+        destroyLoadedDatablocks( hlmsInk, defaultDatablock );
+
+        if( !compareDatablocks( domDatablocks, saxDatablocks, "HlmsJsonInkStream (memory)" ) )
+        {
+            OGRE_DELETE root;
+            return 1;
+        }
+
+        {
+            //Wraps the library without copying it, as a file would be read in chunks.
+            DataStreamPtr dataStream( OGRE_NEW MemoryDataStream( &json[0], json.size(),
+                                                                 false, true ) );
+            HlmsJsonInkStream hlmsJsonStream( hlmsManager );
+            timer.reset();
+            hlmsJsonStream.loadMaterials( dataStream, resourceGroup, "HlmsJsonInkBenchmark" );
+            dataStreamMicroseconds = std::min( dataStreamMicroseconds, timer.getMicroseconds() );
+        }
+
+        describeLoadedDatablocks( hlmsInk, defaultDatablock, saxDatablocks );
+        destroyLoadedDatablocks( hlmsInk, defaultDatablock );
+
+        if( !compareDatablocks( domDatablocks, saxDatablocks, "HlmsJsonInkStream (DataStream)" ) )
+        {
+            OGRE_DELETE root;
+            return 1;
+        }
+    }
+
+    const size_t numLoaded = domDatablocks.size();
+
+    //Memory held by the DOM path: the whole document.
+    size_t domValueBytes = 0;
+    {
+        rapidjson::Document d;
+        d.Parse( json.c_str() );
+        domValueBytes = d.GetAllocator().Size();
+    }
+
+    std::cout << "Ink JSON library: " << numLoaded << " materials, " << json.size()
+              << " bytes, best of " << settings.numRuns << " runs" << std::endl;
+    std::cout << "  DOM (HlmsJson):             " << domMicroseconds / 1000.0 << " ms, "
+              << domValueBytes / 1024u << " KiB of JSON values" << std::endl;
+    std::cout << "  SAX (HlmsJsonInkStream):    " << streamMicroseconds / 1000.0 << " ms, "
+              << streamValueBytes / 1024u << " KiB of JSON values" << std::endl;
+    std::cout << "  SAX from a DataStream:      " << dataStreamMicroseconds / 1000.0 << " ms"
+              << std::endl;
+    std::cout << "  SAX datablocks match the DOM ones field by field" << std::endl;
+
+    OGRE_DELETE root;
+
+    return 0;
+}
@@ -31,12 +31,17 @@ THE SOFTWARE.
 #include "OgreHlmsInkPrerequisites.h"
 #include "OgreHlmsBufferManager.h"
 #include "OgreConstBufferPool.h"
+#include "OgreHlmsTextureManager.h"
+#include "OgreRenderQueue.h"
+#include "Threading/OgreUniformScalableTask.h"
+#include "OgreHlmsInkDiskCache.h"
 #include "OgreHeaderPrefix.h"
 
 namespace Ogre
 {
     class CompositorShadowNode;
     struct QueuedRenderable;
+    class RenderableAnimated;
 
     /** \addtogroup Component
     *  @{
@@ -50,7 +55,8 @@ namespace Ogre
     /** Physically based shading implementation specfically designed for
         OpenGL 3+, D3D11 and other RenderSystems which support uniform buffers.
     */
-    class _OgreHlmsInkExport HlmsInk : public HlmsBufferManager, public ConstBufferPool
+    class _OgreHlmsInkExport HlmsInk : public HlmsBufferManager, public ConstBufferPool,
+                                       public UniformScalableTask
     {
     public:
         enum ShadowFilter
@@ -86,6 +92,118 @@ namespace Ogre
             AmbientNone
         };
 
+        /// Material properties that can be folded into the material's const buffer values.
+        /// @see setPropertyFolding
+        enum PropertyFolding
+        {
+            /// Normal map weights (main & detail) always read from the material
+            /// whenever the normal map is present, instead of only when != 1.0
+            FoldNormalWeights   = 1u << 0u,
+            /// Detail weights always read from the material whenever any detail map is present.
+            FoldDetailWeights   = 1u << 1u,
+            /// Detail offset & scale always applied whenever its detail map is present,
+            /// instead of only when != (0, 0, 1, 1)
+            FoldDetailOffsets   = 1u << 2u,
+
+            FoldAll             = FoldNormalWeights|FoldDetailWeights|FoldDetailOffsets
+        };
+
+        struct PermutationSplit
+        {
+            IdString    property;
+            /// Number of renderable hashes that would disappear if this property
+            /// were removed (i.e. the shaders it alone is splitting).
+            size_t      numSplits;
+            /// Number of different values the property takes (absent counts as one).
+            size_t      numValues;
+        };
+
+        typedef vector<PermutationSplit>::type PermutationSplitVec;
+
+        struct PermutationReport
+        {
+            /// Distinct renderable hashes produced by calculateHashForPreCreate so far.
+            size_t              numRenderableHashes;
+            /// Shaders (renderable x pass combinations) created so far.
+            size_t              numShaders;
+            /// Properties splitting at least one permutation, worst offenders first.
+            PermutationSplitVec splits;
+        };
+
+        struct TextureConsolidationReport
+        {
+            /// Textures destroyed and reloaded into new array slices.
+            size_t  numTexturesReloaded;
+            /// Distinct texture arrays referenced by Ink datablocks.
+            size_t  numArraysBefore;
+            size_t  numArraysAfter;
+            /// Distinct mTextureHash among Ink datablocks; each change between
+            /// draws means rebinding textures.
+            size_t  numTextureHashesBefore;
+            size_t  numTextureHashesAfter;
+            /// Aliases left alone because HlmsInk didn't load them; other Hlms may use them.
+            StringVector    skippedAliases;
+        };
+
+        /// Renderable custom parameter indices used by setInstanceInkParameters.
+        enum InkCustomParameters
+        {
+            /// Vector4( dryness, density, 0, 0 )
+            CustomParamInkParams    = 0x494B,
+            /// Vector4( r, g, b, a )
+            CustomParamInkTint      = 0x494C
+        };
+
+        typedef vector<HlmsCache>::type HlmsPassCacheVec;
+
+        /// Pass & material combinations whose shaders should be created ahead of time.
+        struct WarmUpManifest
+        {
+            /// Pass caches as returned by preparePassHash, i.e. from getPreparedPassCaches.
+            /// They encode caster/receiver, shadow maps, PSSM splits, PCF mode, forward+, etc.
+            HlmsPassCacheVec        passes;
+            /// Renderables with their datablocks already assigned (which is when
+            /// calculateHashForPreCreate runs). Every one is paired with every pass.
+            QueuedRenderableArray   renderables;
+        };
+
+        struct PassStats
+        {
+            /// Bytes uploaded to the pass buffer.
+            /// 0 when an identical pass buffer from the same frame was reused.
+            size_t  passBufferBytes;
+            size_t  constBufferBytes;
+            size_t  texBufferBytes;
+            size_t  numConstBufferMaps;
+            size_t  numTexBufferMaps;
+            size_t  numTextureRebinds;
+            size_t  numPoolRebinds;
+            size_t  numElidedBindings;
+            size_t  numRenderables;
+            size_t  numSkinnedRenderables;
+            bool    casterPass;
+
+            PassStats() { memset( this, 0, sizeof( PassStats ) ); }
+
+            void accumulate( const PassStats &other );
+        };
+
+        typedef vector<PassStats>::type PassStatsVec;
+
+        struct FrameStats
+        {
+            /// Sum of all passes. casterPass is meaningless here.
+            PassStats       totals;
+            PassStatsVec    passes;
+            size_t          numPassBuffersAllocated;
+            /// A hit means the shader was already compiled for another renderable/pass hash.
+            size_t          numShaderCacheHits;
+            size_t          numShaderCacheMisses;
+
+            FrameStats() :
+                numPassBuffersAllocated( 0 ), numShaderCacheHits( 0 ), numShaderCacheMisses( 0 ) {}
+        };
+
     protected:
         typedef vector<ConstBufferPacked*>::type ConstBufferPackedVec;
         typedef vector<HlmsDatablock*>::type HlmsDatablockVec;
@@ -99,8 +217,111 @@ namespace Ogre
             Matrix4 viewMatrix;
         };
 
+        /// Deferred write of the world & worldView matrices of a non-skinned renderable.
+        struct InstanceWriteJob
+        {
+            Matrix4 const   *worldMat;
+            float           *texBufferPtr;
+            bool            casterPass;
+        };
+
+        /// Deferred write of the bone palette of a skinned (v2) renderable.
+        struct BonePaletteWriteJob
+        {
+            SkeletonInstance const      *skeleton;
+            RenderableAnimated const    *renderableAnimated;
+            float                       *texBufferPtr;
+        };
+
+        /// Large BT_DYNAMIC_PERSISTENT buffers from which smaller blocks are sub-allocated.
+        /// Resets every new frame.
+        struct BufferRing
+        {
+            typedef vector<BufferPacked*>::type BufferPackedVec;
+
+            BufferPackedVec buffers;
+            size_t          currentBuffer;
+            size_t          currentOffset;
+            /// Buffers [0; numAdvanced) were already advanced this frame. See advanceRing.
+            size_t          numAdvanced;
+
+            BufferRing() : currentBuffer( 0 ), currentOffset( 0 ), numAdvanced( 0 ) {}
+        };
+
+        /// A pass buffer block sub-allocated from mPassBufferRing, along
+        /// with what it was filled from this frame.
+        struct PassBufferBlock
+        {
+            ConstBufferPacked   *buffer;
+            uint32              offset;
+            uint32              sizeBytes;
+            uint32              hash;
+            /// False when the block holds data we can't compare (i.e. the listener's).
+            bool                shareable;
+            FastArray<uint32>   inputs;
+
+            PassBufferBlock() :
+                buffer( 0 ), offset( 0 ), sizeBytes( 0 ), hash( 0 ), shareable( false ) {}
+        };
+
+        typedef vector<PassBufferBlock>::type PassBufferBlockVec;
+
+        /// View-independent GPU data of a light. Only recalculated when the light changes;
+        /// checked the first time the light is used in a frame.
+        struct LightPacket
+        {
+            /// diffuse, specular, attenuation & spotParams; padded to vec4 each.
+            float   gpuData[16];
+            /// Values gpuData was derived from: diffuse & specular (rgb), power scale,
+            /// attenuation (range, linear, quadric), spot inner & outer angles & falloff.
+            float   source[13];
+            IdType  lightId;
+            uint32  lastFrameChecked;
+
+            LightPacket() :
+                lightId( std::numeric_limits<IdType>::max() ), lastFrameChecked( 0 ) {}
+        };
+
+        typedef vector<LightPacket>::type LightPacketVec;
+        typedef FastArray<Light const*> LightConstPtrArray;
+
+        /// A bone palette already uploaded to the currently bound tex buffer range.
+        struct BonePalette
+        {
+            /// v2: the RenderableAnimated's IndexMap. v1: the SubMesh's (or Mesh's shared) one.
+            void const  *indexMap;
+            uint32      numBones;
+            /// Value encoded in the upper bits of worldMaterialIdx.
+            uint32      distToWorldMatStart;
+        };
+
+        typedef vector<BonePalette>::type BonePaletteVec;
+        /// Key is the SkeletonInstance (v2) or the MovableObject (v1)
+        typedef map<void const*, BonePaletteVec>::type BonePaletteCache;
+
+        /// GPU binding as last set by a command in the command buffer.
+        struct BoundSlot
+        {
+            /// BufferPacked or Texture. Null when the slot was explicitly disabled.
+            void const              *object;
+            HlmsSamplerblock const  *samplerblock;
+            uint32                  offset;
+            uint32                  sizeBytes;
+            /// False when we can't tell what is bound (i.e. before the first command
+            /// we've seen, or after a command that may change arbitrary state).
+            bool                    known;
+        };
+
+        enum { NumTrackedSlots = 32u };
+
+        typedef FastArray<InstanceWriteJob>     InstanceWriteJobArray;
+        typedef FastArray<BonePaletteWriteJob>  BonePaletteWriteJobArray;
+
         PassData                mPreparedPass;
-        ConstBufferPackedVec    mPassBuffers;
+        BufferRing              mPassBufferRing;
+        PassBufferBlockVec      mPassBufferBlocks;  /// Only [0; mCurrentPassBuffer) are valid.
+        FastArray<uint32>       mPassInputsScratch;
+        size_t                  mPassBufferRingSize;
         HlmsSamplerblock const  *mShadowmapSamplerblock;    /// GL3+ only when not using depth textures
         HlmsSamplerblock const  *mShadowmapCmpSamplerblock; /// For depth textures & D3D11
         HlmsSamplerblock const  *mCurrentShadowmapSamplerblock;
@@ -108,6 +329,7 @@ namespace Ogre
         ParallaxCorrectedCubemap    *mParallaxCorrectedCubemap;
 
         uint32                  mCurrentPassBuffer;     /// Resets every to zero every new frame.
+        uint32                  mActivePassBuffer;      /// Pass buffer block used by the current pass.
 
         TexBufferPacked         *mGridBuffer;
         TexBufferPacked         *mGlobalLightListBuffer;
@@ -123,6 +345,149 @@ namespace Ogre
         ShadowFilter mShadowFilter;
         AmbientLightMode mAmbientLightMode;
 
+        /// Writes recorded by fillBuffersFor that haven't been executed yet.
+        /// They're always flushed before the buffers they point to get unmapped.
+        /// Instance writes are always deferred (so they can be batched), bone
+        /// palettes only when parallel recording is enabled.
+        InstanceWriteJobArray       mInstanceWriteJobs;
+        BonePaletteWriteJobArray    mBonePaletteWriteJobs;
+        SceneManager                *mRecordingSceneManager;
+        bool                        mParallelRecording;
+        size_t                      mParallelRecordingThreshold;
+
+        /// Palettes written since mStartMappedTexBuffer last changed. Submeshes
+        /// sharing a skeleton point to the same palette via worldMaterialIdx.
+        BonePaletteCache            mBonePaletteCache;
+        float const                 *mBonePaletteCacheTexStart;
+        size_t                      mBonePaletteCacheTexBuffer;
+
+        /// What each stage has bound, tracked from the command buffer so redundant
+        /// binding commands can be skipped. Textures & tex buffers share resource slots.
+        BoundSlot                   mBoundConstBuffers[NumShaderTypes][NumTrackedSlots];
+        BoundSlot                   mBoundResources[NumShaderTypes][NumTrackedSlots];
+        CommandBuffer const         *mTrackedCommandBuffer;
+        size_t                      mTrackedCommandOffset;  /// Commands before this were seen.
+        /// True when resource slots >= NumTrackedSlots are known to be disabled.
+        bool                        mUntrackedResourcesClean;
+        size_t                      mNumElidedBindings;
+
+        /// Stats of the pass being recorded; moved to mCurrentFrameStats when
+        /// the next pass starts or the frame ends.
+        PassStats                   mCurrentPassStats;
+        bool                        mPassStatsOpen;
+        FrameStats                  mCurrentFrameStats;
+        FrameStats                  mLastFrameStats;
+
+        /// Indexed like the SceneManager's global light list. Lights keep their
+        /// index while they stay visible, thus their packet rarely has to move.
+        LightPacketVec              mLightPackets;
+        uint32                      mLightPacketsFrame;
+        /// Lights sent by the current pass, in the order the shader expects them.
+        LightConstPtrArray          mPassLights;
+        /// Index in the global light list of each of mPassLights.
+        FastArray<uint32>           mPassLightIndices;
+
+        uint32                      mPropertyFolding;
+        bool                        mCompactMaterials;
+
+        typedef map<IdString, HlmsTextureManager::TextureMapType>::type TextureMapTypeMap;
+        /// Aliases the HlmsTextureManager loaded because of us, and the map type they were
+        /// loaded as. consolidateTextureArrays only touches these.
+        TextureMapTypeMap           mLoadedTextureMapTypes;
+
+        /// Renderables given per-instance ink parameters. While 0, fillBuffersFor skips the
+        /// custom parameter lookups. Renderables destroyed with their overrides still count.
+        static size_t               msNumInstanceInkOverrides;
+
+        typedef std::pair<const HlmsInkDatablock*, const HlmsInkDatablock*> DatablockPair;
+        /// Times two datablocks were drawn one right after the other. Keys may be dangling;
+        /// they're only compared against live datablocks, never dereferenced.
+        typedef map<DatablockPair, uint32>::type CoOccurrenceMap;
+
+        bool                        mTrackCoOccurrence;
+        CoOccurrenceMap             mCoOccurrence;
+        /// Last datablock drawn in the current pass, for mCoOccurrence.
+        const HlmsInkDatablock      *mLastDrawnDatablock;
+
+        enum { NumCasterProperties = 8 };
+
+        /// Caster property set shared by every renderable whose datablock doesn't alpha
+        /// test and whose kept properties (skeleton, bones per vertex, etc) match.
+        struct CasterPropertyMemo
+        {
+            int32           values[NumCasterProperties];
+            /// Bit i set if mCasterProperties[i] was present.
+            uint32          presentMask;
+            HlmsPropertyVec properties;
+        };
+
+        typedef vector<CasterPropertyMemo>::type CasterPropertyMemoVec;
+
+        /// Properties casters keep when not alpha testing. Sorted.
+        IdString                    mCasterProperties[NumCasterProperties];
+        /// Extra properties casters keep when alpha testing. Sorted.
+        vector<IdString>::type      mAlphaTestProperties;
+        CasterPropertyMemoVec       mCasterPropertyMemo;
+
+        struct SamplerSlot
+        {
+            String const    *name;
+            int32           texUnit;
+        };
+
+        typedef vector<SamplerSlot>::type SamplerSlotVec;
+
+        /// Texture units of every sampler for a given combination of features.
+        struct SamplerLayout
+        {
+            SamplerSlotVec      slots;
+            vector<int>::type   shadowMapUnits;
+        };
+
+        typedef map<uint32, SamplerLayout>::type SamplerLayoutMap;
+
+        /// What the PSO needs from the renderable's VAO (or v1 render operation).
+        struct VertexPsoData
+        {
+            OperationType           operationType;
+            VertexElement2VecVec    vertexElements;
+        };
+
+        /// A permutation whose creation was deferred by the async compilation mode.
+        /// Holds no pointer to the renderable, which may be gone by the time it's compiled.
+        struct PendingCompile
+        {
+            uint32              renderableHash;
+            uint32              finalHash;
+            HlmsCache           passCache;
+            VertexPsoData       vertexData;
+            /// Not dereferenced until it's been found again by name in mDatablocks.
+            HlmsDatablock       *datablock;
+            IdString            datablockName;
+        };
+
+        typedef deque<PendingCompile>::type PendingCompileDeque;
+
+        bool                        mAsyncCompilation;
+        uint64                      mAsyncCompileBudgetUs;
+        PendingCompileDeque         mPendingCompiles;
+        /// finalHash of every entry in mPendingCompiles.
+        set<uint32>::type           mPendingCompileHashes;
+        /// Renderable hash -> renderable hash of its fallback permutation.
+        map<uint32, uint32>::type   mFallbackRenderableHashes;
+        /// Material properties the fallback permutation doesn't have. Sorted.
+        vector<IdString>::type      mFallbackStrippedProperties;
+        /// Permutations from previous runs; consulted before generating a shader.
+        HlmsInkDiskCache            *mDiskCache;
+
+        /// Keyed by the packed features, see getSamplerLayout.
+        SamplerLayoutMap            mSamplerLayouts;
+        /// "textureMaps[0]", "textureMaps[1]", etc.
+        String                      mTextureMapNames[NUM_INK_TEXTURE_TYPES];
+
+        /// Every distinct pass preparePassHash has returned.
+        HlmsPassCacheVec            mPreparedPassCaches;
+
         virtual const HlmsCache* createShaderCacheEntry( uint32 renderableHash,
                                                          const HlmsCache &passCache,
                                                          uint32 finalHash,
@@ -133,6 +498,12 @@ namespace Ogre
                                                     const HlmsBlendblock *blendblock,
                                                     const HlmsParamVec &paramVec );
 
+        /// Pass properties of our own (PCF, ambient, etc) that go into the pass hash.
+        void setInkPassProperties( bool casterPass, bool receivesShadows, ShadowFilter shadowFilter,
+                                   AmbientLightMode ambientMode, bool envMapScale );
+        /// Pass properties that are not part of the pass hash (i.e. gamma).
+        void setInkPassPropertiesAfterHash( bool hwGammaWrite );
+
         void setDetailMapProperties( HlmsInkDatablock *datablock, PiecesMap *inOutPieces );
         void setTextureProperty( const char *propertyName, HlmsInkDatablock *datablock,
                                  InkTextureTypes texType );
@@ -142,19 +513,200 @@ namespace Ogre
         virtual void calculateHashForPreCreate( Renderable *renderable, PiecesMap *inOutPieces );
         virtual void calculateHashForPreCaster( Renderable *renderable, PiecesMap *inOutPieces );
 
-        static bool requiredPropertyByAlphaTest( IdString propertyName );
+        bool requiredPropertyByAlphaTest( IdString propertyName ) const;
+        bool isCasterProperty( IdString propertyName ) const;
+
+        /** Generates & compiles the permutation right away (or loads it from the disk cache).
+        @param deferredVertexData
+            When not null, the PSO's vertex data is taken from here instead of from the
+            renderable's VAOs, and the shaders are built from generated sources (as with
+            the disk cache) so the renderable is only handed to the listener.
+        */
+        const HlmsCache* compileShaderCacheEntry( uint32 renderableHash, const HlmsCache &passCache,
+                                                  uint32 finalHash,
+                                                  const QueuedRenderable &queuedRenderable,
+                                                  const VertexPsoData *deferredVertexData = 0 );
+
+        /// Queues the permutation for compilation and registers its fallback under finalHash.
+        const HlmsCache* deferShaderCacheEntry( uint32 renderableHash, const HlmsCache &passCache,
+                                                uint32 finalHash,
+                                                const QueuedRenderable &queuedRenderable );
+
+        /** Uploads every dirty datablock. Replaces (hides) ConstBufferPool's version:
+            writes go straight into one staging buffer per pool without mutating the
+            datablocks, and only contiguous runs of dirty slots are copied to the GPU.
+        */
+        void uploadDirtyDatablocks(void);
+
+        /// Counts distinct texture arrays and texture hashes among Ink datablocks.
+        void countTextureArrays( size_t &outNumArrays, size_t &outNumTextureHashes ) const;
+
+        /// Compiles queued permutations until the time budget runs out. Entries are
+        /// dropped when no live renderable of their datablock uses them anymore.
+        void compilePendingShaders(void);
+
+        static void getVertexPsoData( Renderable *renderable, bool casterPass,
+                                      VertexPsoData &outVertexData );
+
+        /// Returns the GLSL sampler layout for the current properties (mSetProperties),
+        /// building and caching it the first time the combination is seen.
+        const SamplerLayout& getSamplerLayout(void);
+
+        /// Hash identifying the shaders of the renderable & pass across runs.
+        uint32 calculateDiskCacheKey( uint32 renderableHash, const HlmsCache &passCache ) const;
+
+        /** Runs the template preprocessor the way Hlms::createShaderCacheEntry does, but
+            only generates the source of each stage; nothing gets compiled.
+        @param outEntry [out]
+            The final properties & the generated sources.
+        */
+        void generateShaderSources( uint32 renderableHash, const HlmsCache &passCache,
+                                    HlmsInkDiskCache::Entry &outEntry );
+
+        /// Does what Hlms::createShaderCacheEntry does, but with the source and final
+        /// properties of a disk cache entry (loaded or just generated) and without
+        /// touching the renderable.
+        const HlmsCache* createShaderCacheEntryFromDisk( const HlmsInkDiskCache::Entry &entry,
+                                                         uint32 diskCacheKey,
+                                                         const HlmsCache &passCache,
+                                                         uint32 finalHash,
+                                                         const HlmsDatablock *datablock,
+                                                         const VertexPsoData &vertexData );
+        /// Removes a permutation from the shader cache, destroying its PSO.
+        void destroyShaderCacheEntry( uint32 finalHash );
+
+        /// Drops all cached bone palettes if the tex buffer binding moved since they were written.
+        void validateBonePaletteCache(void);
+        /** Looks for a palette written earlier into the currently bound tex buffer range.
+        @param owner
+            SkeletonInstance (v2) or MovableObject (v1).
+        @param indexMap
+            v2: RenderableAnimated::IndexMap. v1: the SubMesh's blend index to bone index map.
+        @param isV1
+            v1 index maps are only matched by identity; v2 ones also by contents.
+        @return
+            Null if not found.
+        */
+        const BonePalette* findBonePalette( const void *owner, const void *indexMap,
+                                            bool isV1, uint32 numBones ) const;
+        void addBonePalette( const void *owner, const void *indexMap,
+                             uint32 numBones, uint32 distToWorldMatStart );
+
+        /// Returns the packet of the light, rebuilding it if the light changed.
+        /// The light is only checked once per frame.
+        const LightPacket& getLightPacket( const Light *light, uint32 globalIndex );
+
+        /** Writes the lights into the pass buffer.
+        @param globalIndices
+            Index of each light in the SceneManager's global light list.
+        @param fullPacket
+            True to write all 6 variables (position, diffuse, specular, attenuation,
+            spotDirection, spotParams). False to write only the first 3.
+        @return
+            lightsPtr advanced past the written data.
+        */
+        float* writeLights( Light const * const *lights, const uint32 *globalIndices,
+                            size_t numLights, bool fullPacket,
+                            const Matrix4 &viewMatrix, float *lightsPtr );
+
+        /// Moves mCurrentPassStats into mCurrentFrameStats, if a pass is being recorded.
+        void closePassStats(void);
+
+        /// Forgets everything known about the bound GPU state.
+        void invalidateBindings(void);
+        /// Updates the tracked bindings with the effects of the given command.
+        void applyCommandToBindings( const CbBase *cmd );
+        /** Walks the commands added since the last sync (i.e. by other Hlms implementations,
+            listeners & the RenderQueue) up to and including lastCmd, so the tracked
+            bindings reflect what the GPU will have bound after lastCmd executes.
+        */
+        void syncBindingsWithCommandBuffer( CommandBuffer *commandBuffer, CbBase *lastCmd );
+
+        static bool isBound( const BoundSlot &boundSlot, const void *object,
+                             const HlmsSamplerblock *samplerblock,
+                             uint32 offset, uint32 sizeBytes );
+
+        /// Adds a binding command unless the exact same binding is already in place.
+        void bindConstBuffer( CommandBuffer *commandBuffer, ShaderType shaderType, uint16 slot,
+                              ConstBufferPacked *buffer, uint32 offset, uint32 sizeBytes );
+        /// @copydoc bindConstBuffer
+        void bindTexBuffer( CommandBuffer *commandBuffer, ShaderType shaderType, uint16 slot,
+                            TexBufferPacked *buffer, uint32 offset, uint32 sizeBytes );
+        /// @copydoc bindConstBuffer
+        void bindTexture( CommandBuffer *commandBuffer, uint16 texUnit, Texture *texture,
+                          const HlmsSamplerblock *samplerblock );
+        /// @copydoc bindConstBuffer
+        void disableTexturesFrom( CommandBuffer *commandBuffer, uint16 texUnit );
+
+        /// Returns the index of a pass buffer block filled this frame from the same
+        /// inputs as mPassInputsScratch. Returns mCurrentPassBuffer if there's none.
+        uint32 findPassBufferWithInputs( uint32 inputsHash ) const;
+
+        /** Sub-allocates and maps a region from a ring of buffers, creating a new buffer
+            when the remaining ones are too small.
+        @remarks
+            The region is mapped without advancing the frame, i.e. it's written to the
+            region the GPU will read once advanceRing gets called.
+        @param isTexBuffer
+            When true the ring holds TexBufferPacked, ConstBufferPacked otherwise.
+        @param outBuffer [out]
+            The buffer the region belongs to. Caller must unmap it when done writing.
+        @param outOffset [out]
+            Offset in bytes of the region from the start of outBuffer.
+        @return
+            Mapped pointer to the region.
+        */
+        void* mapFromRing( BufferRing &ring, size_t sizeBytes, bool isTexBuffer,
+                           BufferPacked **outBuffer, size_t *outOffset );
+        /** Advances the frame of the ring's buffers used since the last call, so the GPU
+            reads what mapFromRing wrote. Must be called before the commands referencing
+            those blocks are executed. The buffers won't be mapped again until the next frame.
+        */
+        void advanceRing( BufferRing &ring );
+        void destroyRing( BufferRing &ring, bool isTexBuffer );
 
         virtual void destroyAllBuffers(void);
 
+        /// Size in bytes of the pass buffer, excluding the lights & the listener's data.
+        size_t getPassBufferSizeWithoutLights( bool casterPass, SceneManager *sceneManager,
+                                               AmbientLightMode ambientMode, float envMapScale,
+                                               size_t numShadowMaps, size_t numPssmSplits ) const;
+
+        static void writeInstanceMatrices( const Matrix4 &worldMat, const Matrix4 &viewMatrix,
+                                           float * RESTRICT_ALIAS texBufferPtr, bool casterPass );
+        /// Same as writeInstanceMatrices, but computes worldView for ARRAY_PACKED_REALS
+        /// renderables at a time using ArrayMatrixAf4x3.
+        static void writeInstanceMatricesBatched( const InstanceWriteJob *jobStart,
+                                                  const InstanceWriteJob *jobEnd,
+                                                  const Matrix4 &viewMatrix );
+        static void writeBonePalette( const SkeletonInstance *skeleton,
+                                      const RenderableAnimated *renderableAnimated,
+                                      float * RESTRICT_ALIAS texBufferPtr );
+
+        /// Executes all pending write jobs, in parallel if there's enough of them.
+        void flushRecordingJobs(void);
+
         FORCEINLINE uint32 fillBuffersFor( const HlmsCache *cache,
                                            const QueuedRenderable &queuedRenderable,
                                            bool casterPass, uint32 lastCacheHash,
                                            CommandBuffer *commandBuffer, bool isV1 );
 
     public:
-        HlmsInk( Archive *dataFolder, ArchiveVec *libraryFolders );
+        /**
+        @param compactMaterials
+            When true, materials are stored in the GPU with half precision (see
+            HlmsInkDatablock::writeCompactConstBuffer), which fits twice as many
+            materials per pool: fewer pools and fewer material buffer rebinds.
+            Shaders get the "compact_materials" property to decode them. The templates
+            declare they can by shipping a CompactMaterials_piece_* file; without one the
+            constructor throws.
+        */
+        HlmsInk( Archive *dataFolder, ArchiveVec *libraryFolders, bool compactMaterials = false );
         virtual ~HlmsInk();
 
+        /// Whether materials are stored in half precision. @see HlmsInk::HlmsInk
+        bool getCompactMaterials(void) const                { return mCompactMaterials; }
+
         virtual void _changeRenderSystem( RenderSystem *newRs );
 
         virtual HlmsCache preparePassHash( const Ogre::CompositorShadowNode *shadowNode,
@@ -174,8 +726,233 @@ namespace Ogre
                                          bool casterPass, uint32 lastCacheHash,
                                          CommandBuffer *commandBuffer );
 
+        virtual void preCommandBufferExecution( CommandBuffer *commandBuffer );
+
         virtual void frameEnded(void);
 
+        /** Sets the size of each of the large const buffers the pass buffers get
+            sub-allocated from. Takes effect for buffers created from now on.
+        @remarks
+            Each pass only takes the bytes it needs (aligned to the API's const buffer
+            offset alignment), so a single buffer can hold dozens of passes.
+            A pass will never take more than VaoManager::getConstBufferMaxSize; if it
+            doesn't fit, preparePassHash throws.
+        */
+        void setPassBufferRingSize( size_t sizeBytes )      { mPassBufferRingSize = sizeBytes; }
+        size_t getPassBufferRingSize(void) const            { return mPassBufferRingSize; }
+
+        /** Enables multithreaded recording of the per-instance data.
+        @remarks
+            When enabled, fillBuffersFor keeps recording the commands and the per-instance
+            const buffer data in order from the render thread (thus draw order and the
+            command stream are exactly the same as the serial path), but the expensive
+            writes (world & worldView matrices, bone palettes) are deferred and split in
+            contiguous slices across the SceneManager's worker threads.
+            Pending writes are executed before the buffers get unmapped.
+        @par
+            v1 skinned renderables are always written from the render thread since they
+            need to go through Renderable::getWorldTransforms.
+        @param enable
+            True to enable. Default is false.
+        @param minJobsPerDispatch
+            Below this amount of pending writes, they're executed in the render thread
+            as waking up the workers would cost more than it saves.
+        */
+        void setParallelRecording( bool enable, size_t minJobsPerDispatch = 256u );
+        bool getParallelRecording(void) const               { return mParallelRecording; }
+
+        /** Stats of the last completed frame (i.e. the one before the last frameEnded).
+            Per pass stats are listed in the order the passes were prepared.
+        */
+        const FrameStats& getFrameStats(void) const         { return mLastFrameStats; }
+
+        /** When enabled, permutations that aren't available yet don't stall the frame:
+            renderables are drawn with a simple fallback permutation (material colours,
+            no textures) and the real one is created at the end of the frame, within a
+            time budget. Renderables switch to it automatically once it exists.
+        @remarks
+            Permutations found in the disk cache are still created immediately, since
+            they skip the expensive part. warmUp always creates them immediately.
+        @par
+            Queued permutations are only created if a renderable still uses them. That
+            renderable is what HlmsListener::shaderCacheEntryCreated receives; its
+            QueuedRenderable has no movable object, as it didn't come from a render queue.
+        @param enable
+            True to enable. Default is false.
+        @param budgetMicroseconds
+            Time spent per frame on queued permutations. At least one is always created
+            per frame so the queue keeps moving.
+        */
+        void setAsyncCompilation( bool enable, uint64 budgetMicroseconds = 4000u );
+        bool getAsyncCompilation(void) const                { return mAsyncCompilation; }
+
+        /// Number of permutations waiting to be created by the async compilation mode.
+        size_t getNumPendingCompiles(void) const            { return mPendingCompiles.size(); }
+
+        /** Overrides the datablock's dryness & density, and sets a tint, for a single
+            renderable. Renderables sharing a datablock can then look different while
+            still being batched & auto-instanced together.
+        @remarks
+            Stored as Renderable custom parameters (@see InkCustomParameters). Always go
+            through this function; parameters set directly on the renderable may be ignored.
+            The shader gets them next to the material index: worldMaterialIdx[drawId].z
+            holds dryness & density as half2 and .w holds the tint as RGBA8
+            (unpackUnorm4x8). Renderables without overrides get the datablock's values
+            and a white tint.
+        */
+        static void setInstanceInkParameters( Renderable *renderable, Real dryness, Real density,
+                                              const ColourValue &tint = ColourValue::White );
+        /// Reverts to the datablock's dryness & density and removes the tint.
+        static void removeInstanceInkParameters( Renderable *renderable );
+
+        /** Lists the properties responsible for splitting materials into different shaders.
+        @remarks
+            This is a diagnostic tool, it walks every renderable cache and is not cheap.
+            Use it to decide what to pass to setPropertyFolding.
+        */
+        void getPermutationReport( PermutationReport &outReport ) const;
+
+        /** Folds properties into material const buffer values instead of shader defines.
+        @remarks
+            By default a datablock that sets e.g. a normal map weight of 0.8 gets a different
+            shader from one that leaves it at 1.0, because the multiplication is compiled
+            out when unused. The values are always in the material buffer anyway, so folding
+            enables the code path for every datablock that has the relevant textures: a few
+            more ALU instructions in exchange for fewer shaders, PSOs and PSO switches.
+            Changing this flushes the renderables of every datablock.
+        @param foldingMask
+            Bitmask of PropertyFolding values. 0 disables folding (default).
+        */
+        void setPropertyFolding( uint32 foldingMask );
+        uint32 getPropertyFolding(void) const               { return mPropertyFolding; }
+
+        /** Records which datablocks get drawn one after the other in the render queue,
+            so repackPoolsFromCoOccurrence can put them in the same material pool.
+        @remarks
+            Costs a map update every time the datablock changes between draws, so only
+            enable it while gathering statistics (e.g. a few frames of each level).
+        */
+        void setTrackCoOccurrence( bool track );
+        bool getTrackCoOccurrence(void) const               { return mTrackCoOccurrence; }
+        /// Forgets the statistics gathered with setTrackCoOccurrence.
+        void resetCoOccurrence(void)                        { mCoOccurrence.clear(); }
+
+        /** Reassigns the material pool slots of the given datablocks in the given order,
+            so datablocks next to each other in the list end up in the same pool.
+            Drawing materials of the same pool back to back avoids rebinding the
+            material buffer, and with LowerGpuOverhead their texture hashes match too.
+        @remarks
+            Datablocks not in the list keep their slots, and the listed ones fill the
+            free slots pool by pool; to get a clean layout, list every datablock.
+            Datablocks with a cubemap probe are skipped (they live in separate pools).
+            Don't call while rendering.
+        @return
+            Number of datablocks that moved to a different pool.
+        */
+        size_t repackPools( const vector<HlmsInkDatablock*>::type &datablocks );
+
+        /** Generates simplified copies of a datablock for distant geometry, which
+            updateMaterialLod switches renderables to.
+        @remarks
+            LOD 1 drops the detail normal maps and uses the uncorrelated (cheaper) GGX.
+            LOD 2 and beyond also drop the detail maps, the detail weight map, the normal
+            map and the reflection map.
+            Variants are regular datablocks named "<name>/Lod<N>" with their own pool
+            slot. Values that go to the GPU (colours, weights, etc) follow the parent's
+            changes; the rest (textures, blocks, modes) is copied at creation time, so
+            call this again after changing those. Any previous variants are destroyed
+            first. They're runtime data: saveMaterials leaves them out.
+        @param distances
+            Camera distance at which each LOD starts, in increasing order.
+            Its size is the number of variants generated.
+        */
+        void createMaterialLods( HlmsInkDatablock *datablock, const vector<Real>::type &distances );
+
+        /// Destroys the LOD variants of the datablock. Renderables using them go back to it.
+        void destroyMaterialLods( HlmsInkDatablock *datablock );
+
+        /** Switches the renderable to the LOD variant of its datablock that corresponds
+            to the given squared distance (or back to the original datablock).
+        @remarks
+            Switching datablocks recalculates the renderable's hashes, so only call this
+            outside rendering (e.g. once per frame before updating the scene).
+            The switch is skipped when the level doesn't change.
+        @return
+            True if the renderable's datablock changed.
+        */
+        bool updateMaterialLod( Renderable *renderable, Real squaredDistance );
+        /// Same, with the distance between the camera and the object (honours the LOD bias).
+        bool updateMaterialLod( Renderable *renderable, const MovableObject *movableObject,
+                                const Camera *camera );
+
+        /** Groups datablocks that were drawn together (see setTrackCoOccurrence), at most
+            one pool's worth per group, and calls repackPools with every datablock.
+        @return
+            Number of datablocks that moved to a different pool.
+        */
+        size_t repackPoolsFromCoOccurrence(void);
+
+        /** Reloads every texture used by Ink datablocks into as few HlmsTextureManager
+            arrays as possible, then updates the datablocks' array indices and hashes.
+            Materials whose textures end up in the same arrays share mTextureHash and no
+            longer break batches.
+        @remarks
+            Meant to run once after loading (it reloads textures from disk). Textures are
+            loaded back in material pool order, so call repackPools first if used.
+            Only textures the HlmsTextureManager loaded through _createOrRetrieveTexture
+            are reloaded; the rest (e.g. cubemap probes, or textures loaded by other Hlms
+            implementations first) are left alone and listed in the report. A texture Ink
+            loaded must not be used by datablocks of other Hlms implementations as well,
+            as its array slice changes.
+        */
+        void consolidateTextureArrays( TextureConsolidationReport &outReport );
+
+        /** Same as HlmsTextureManager::createOrRetrieveTexture, but remembers the map type
+            of the textures it makes the manager load, so consolidateTextureArrays can load
+            them back the same way. Used by HlmsInkDatablock & HlmsJsonInk.
+        */
+        HlmsTextureManager::TextureLocation _createOrRetrieveTexture(
+                const String &aliasName, HlmsTextureManager::TextureMapType mapType );
+
+        /** Creates the shaders for every pass & renderable combination in the manifest,
+            so they don't get created one by one on first draw.
+        @remarks
+            The passes are the ones preparePassHash actually built (see
+            getPreparedPassCaches), so no permutation is created that a real pass
+            wouldn't use. Render each kind of pass once (e.g. a loading screen with the
+            final compositor and lights) before warming up the materials loaded later.
+        @par
+            Must be called from the render thread: Hlms generation isn't thread safe
+            and shader compilation needs the render system's context.
+        @param maxPermutations
+            Maximum number of combinations to process in this call, to spread the work
+            across several loading frames. Combinations already created are cheap, so
+            the same manifest can simply be passed again.
+        @return
+            Number of shaders created by this call.
+        */
+        size_t warmUp( const WarmUpManifest &manifest, size_t maxPermutations = ~0u );
+
+        /// Pass caches seen so far; useful to build a WarmUpManifest.
+        const HlmsPassCacheVec& getPreparedPassCaches(void) const   { return mPreparedPassCaches; }
+
+        /** Sets the cache where generated shaders are looked up before running the
+            template preprocessor, and where new ones are stored.
+        @remarks
+            The cache is not owned by HlmsInk. Enables GpuProgramManager's microcode
+            cache so it can be saved along. Set to null to disable.
+        */
+        void setDiskCache( HlmsInkDiskCache *diskCache );
+        HlmsInkDiskCache* getDiskCache(void) const          { return mDiskCache; }
+
+        /// Number of binding commands that were skipped because the GPU
+        /// already had the same binding. Accumulates until reset.
+        size_t getNumElidedBindings(void) const             { return mNumElidedBindings; }
+        void resetNumElidedBindings(void)                   { mNumElidedBindings = 0; }
+
+        /// @copydoc UniformScalableTask::execute
+        virtual void execute( size_t threadId, size_t numThreads );
+
         void setShadowSettings( ShadowFilter filter );
         ShadowFilter getShadowFilter(void) const            { return mShadowFilter; }
 
@@ -199,6 +976,15 @@ namespace Ogre
         /// @copydoc Hlms::_collectSamplerblocks
         virtual void _collectSamplerblocks( set<const HlmsSamplerblock*>::type &outSamplerblocks,
                                             const HlmsDatablock *datablock ) const;
+
+        /** Same as HlmsJson::saveMaterials on this Hlms, but without the material LOD
+            variants (@see createMaterialLods); loading them back as regular materials
+            would break the "<name>/Lod<N>" names createMaterialLods generates.
+        @remarks
+            HlmsJson::saveMaterials & HlmsManager::saveMaterials can't tell them apart,
+            thus use this instead to save Ink materials.
+        */
+        void saveMaterials( String &outString );
 #endif
     };
 
@@ -287,6 +1073,7 @@ namespace Ogre
         static const IdString ParallaxCorrectCubemaps;
         static const IdString UseParallaxCorrectCubemaps;
         static const IdString IrradianceVolumes;
+        static const IdString CompactMaterials;
 
         static const IdString BrdfDefault;
         static const IdString BrdfCookTorrance;
@@ -176,6 +176,8 @@ namespace Ogre
 
 		float dryness;
 		float density;
+        /// dryness & density as half2, what the GPU gets unless the renderable overrides them.
+        uint32  mInkParamsHalf2;
 
         uint8   mUvSource[NUM_INK_SOURCES];
         uint8   mBlendModes[4];
@@ -203,6 +205,10 @@ namespace Ogre
         /// mBakedTextures[mTexToBakedTextureIdx[INK_DIFFUSE]]
         /// Then read mTexIndices[INK_DIFFUSE] to know which slice of the texture array.
         uint8   mTexToBakedTextureIdx[NUM_INK_TEXTURE_TYPES];
+        /// Textures assigned to detail slots (INK_DETAIL_WEIGHT to INK_DETAIL3_NM) that
+        /// were left out of mBakedTextures because they can't affect the result.
+        /// Kept so getTexture & co. still return them. @see isDetailMapDead
+        TexturePtr mDeadDetailTextures[INK_DETAIL3_NM - INK_DETAIL_WEIGHT + 1];
 
         HlmsSamplerblock const  *mSamplerblocks[NUM_INK_TEXTURE_TYPES];
 
@@ -211,8 +217,43 @@ namespace Ogre
         /// @see InkBrdf::InkBrdf
         uint32  mBrdf;
 
+        enum PendingUpdates
+        {
+            PendingCalculateHash    = 1u << 0u,
+            PendingFlush            = 1u << 1u,
+            PendingConstBuffer      = 1u << 2u
+        };
+
+        /// Nesting level of beginUpdate/endUpdate.
+        uint16  mUpdateDepth;
+        /// PendingUpdates flags collected while inside beginUpdate/endUpdate.
+        uint8   mPendingUpdates;
+
+        /// Material LOD, @see HlmsInk::createMaterialLods
+        /// Datablock this is a LOD variant of; null if it's not a variant.
+        HlmsInkDatablock                *mLodParent;
+        /// Variants of this datablock, from closest to farthest.
+        FastArray<HlmsInkDatablock*>    mLodVariants;
+        /// Squared distance at which each of mLodVariants kicks in.
+        FastArray<Real>                 mLodSquaredDistances;
+
+        /// These do the work right away, or once at endUpdate if inside an update.
+        void requestCalculateHash(void);
+        void requestFlushRenderables(void);
         void scheduleConstBufferUpdate(void);
+        /// Copies the values that go to the GPU to mLodVariants & schedules their upload.
+        void syncLodVariantsConstBuffer(void);
         virtual void uploadToConstBuffer( char *dstPtr );
+        /// Writes the GPU material to dstPtr with transparency already applied.
+        /// Unlike uploadToConstBuffer it's non-virtual and doesn't modify the datablock.
+        void writeConstBuffer( float * RESTRICT_ALIAS dstPtr ) const;
+        /** Same as writeConstBuffer, but in the compact layout (MaterialSizeInGpuCompact):
+            the first 56 floats (colours, roughness, fresnel, weights, detail offset &
+            scale) as half floats, then the normal map weight as half, then one uint8
+            texture array index per texture type (byte offset 114).
+            Texture array slices must be < 256.
+        */
+        void writeCompactConstBuffer( uint8 * RESTRICT_ALIAS dstPtr ) const;
         virtual void notifyOptimizationStrategyChanged(void);
 
         /// Sets the appropiate mTexIndices[textureType], and returns the texture pointer
@@ -221,6 +262,19 @@ namespace Ogre
         void decompileBakedTextures( InkBakedTexture outTextures[NUM_INK_TEXTURE_TYPES] );
         void bakeTextures( const InkBakedTexture textures[NUM_INK_TEXTURE_TYPES] );
 
+        /** Whether the detail texture in the given slot has no visible effect with the
+            current parameters, so bakeTextures can leave it out of the shader:
+                * A detail map whose weight is 0.
+                * A detail normal map whose weight is 0 (it blends towards a flat normal).
+                * The detail weight map, when every detail (normal) map is empty or dead.
+        @param textures
+            The textures about to be baked.
+        */
+        bool isDetailMapDead( InkTextureTypes texType,
+                              const InkBakedTexture textures[NUM_INK_TEXTURE_TYPES] ) const;
+        /// Rebakes the textures if the weight change revives or kills a detail map.
+        void rebakeIfDetailDeadnessChanged( InkTextureTypes texType, bool wasDead );
+
     public:
         /** Valid parameters in params:
         @param params
@@ -316,6 +370,22 @@ namespace Ogre
                           const HlmsParamVec &params );
         virtual ~HlmsInkDatablock();
 
+        /** Starts a batch of changes. Setters called until the matching endUpdate don't
+            rehash the datablock, flush its renderables or schedule the material upload;
+            endUpdate does each of those at most once.
+        @remarks
+            Calls can be nested; only the outermost endUpdate applies the changes.
+            Don't render with the datablock in between.
+        */
+        void beginUpdate(void);
+        /// @see beginUpdate
+        void endUpdate(void);
+
+        /// Datablock this is a LOD variant of, null if it's not one.
+        HlmsInkDatablock* getLodParent(void) const          { return mLodParent; }
+        size_t getNumLodVariants(void) const                { return mLodVariants.size(); }
+        HlmsInkDatablock* getLodVariant( size_t idx ) const { return mLodVariants[idx]; }
+
         /// Sets the diffuse background colour. When no diffuse texture is present, this
         /// solid colour replaces it, and can act as a background for the detail maps.
         void setBackgroundDiffuse( const ColourValue &bgDiffuse );
@@ -500,6 +570,20 @@ namespace Ogre
         /// Returns the detail normal maps' weight
         Real getNormalMapWeight(void) const;
 
+        /** Sets the ink dryness & density.
+        @remarks
+            They're sent per draw rather than in the material buffer (packed as half2 in
+            worldMaterialIdx[drawId].z), so changing them is cheap and doesn't cause a
+            flushRenderables. Individual renderables can override them without needing
+            another datablock; @see HlmsInk::setInstanceInkParameters
+        */
+        void setDryness( Real dryness );
+        Real getDryness(void) const;
+
+        /// @see setDryness
+        void setDensity( Real density );
+        Real getDensity(void) const;
+
         /** Sets the weight of detail map. Affects both diffuse and
             normal at the same time.
         @remarks
@@ -676,6 +760,8 @@ namespace Ogre
 
         static const size_t MaterialSizeInGpu;
         static const size_t MaterialSizeInGpuAligned;
+        /// Size of a material with HlmsInk's compact layout, @see writeCompactConstBuffer
+        static const size_t MaterialSizeInGpuCompact;
     };
 
     /** @} */
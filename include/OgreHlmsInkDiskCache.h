@@ -0,0 +1,138 @@
+/*
+-----------------------------------------------------------------------------
+This source file is part of OGRE
+    (Object-oriented Graphics Rendering Engine)
+For the latest info, see http://www.ogre3d.org/
+
+Copyright (c) 2000-2014 Torus Knot Software Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+-----------------------------------------------------------------------------
+*/
+#ifndef _OgreHlmsInkDiskCache_H_
+#define _OgreHlmsInkDiskCache_H_
+
+#include "OgreHlmsInkPrerequisites.h"
+#include "OgreHlmsCommon.h"
+#include "OgreHlmsPso.h"
+#include "OgreHeaderPrefix.h"
+
+namespace Ogre
+{
+    class HlmsInk;
+
+    /** \addtogroup Component
+    *  @{
+    */
+    /** \addtogroup Material
+    *  @{
+    */
+
+    /** Persistent cache of the shaders generated by HlmsInk.
+    @remarks
+        Each entry stores the final property set and the generated source of every
+        shader stage. On a later run HlmsInk creates the programs straight from the
+        stored source, skipping the template preprocessor. If the microcode is saved
+        along (see save) the compiler is skipped as well.
+    @par
+        Entries are keyed by a hash of the renderable & pass property sets and pieces,
+        not by the final hash: final hashes are indices assigned in the order the
+        renderables & passes showed up, and thus aren't stable across runs.
+    @par
+        The cache is bound to a hash of the Ink template & library archives (file names
+        and contents) and the shader profile. A cache file saved with different
+        templates is discarded on load.
+    @par
+        Usage:
+        @code
+            HlmsInkDiskCache *diskCache = OGRE_NEW HlmsInkDiskCache( hlmsInk );
+            diskCache->load( inStream );
+            hlmsInk->setDiskCache( diskCache );
+            //... render ...
+            if( diskCache->isDirty() )
+                diskCache->save( outStream, true );
+        @endcode
+    */
+    class _OgreHlmsInkExport HlmsInkDiskCache : public HlmsAlloc
+    {
+    public:
+        struct Entry
+        {
+            HlmsPropertyVec setProperties;
+            String          sources[NumShaderTypes];
+        };
+
+        typedef map<uint32, Entry>::type EntryMap;
+
+    protected:
+        EntryMap    mEntries;
+        uint32      mTemplateHash;
+        bool        mDirty;
+
+        static uint32 hashArchive( Archive *archive, uint32 hashSoFar );
+        /// Reads an entry's properties & sources. Returns false if the stream ends first.
+        static bool readEntry( DataStreamPtr &stream, Entry &outEntry );
+
+    public:
+        HlmsInkDiskCache( HlmsInk *hlmsInk );
+
+        /// Hash of the templates, libraries & shader profile the entries were generated with.
+        uint32 getTemplateHash(void) const          { return mTemplateHash; }
+
+        /// Returns null if not found.
+        const Entry* findEntry( uint32 key ) const;
+
+        /// Stores a newly generated shader: its final property set & source of every stage.
+        void addEntry( uint32 key, const Entry &entry );
+
+        /// Removes all entries.
+        void clear(void);
+
+        /// True when there are entries that aren't in the last saved/loaded file.
+        bool isDirty(void) const                    { return mDirty; }
+
+        /**
+        @param stream
+            Stream to write to.
+        @param includeMicrocode
+            When true, GpuProgramManager's microcode cache is written after the entries.
+            Requires GpuProgramManager::setSaveMicrocodesToCache( true ), which
+            HlmsInk::setDiskCache enables.
+        */
+        void save( DataStreamPtr &stream, bool includeMicrocode );
+
+        /** Loads the entries (and the microcode, if it was saved) from the stream.
+        @remarks
+            A truncated file keeps the entries that were read in full; the missing
+            ones are generated again and the cache is flagged dirty.
+        @return
+            False if the stream is not a cache file, or was generated with
+            different templates. The cache is left empty in that case.
+        */
+        bool load( DataStreamPtr &stream );
+    };
+
+    /** @} */
+    /** @} */
+
+}
+
+#include "OgreHeaderSuffix.h"
+
+#endif
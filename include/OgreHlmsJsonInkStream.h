@@ -0,0 +1,95 @@
+/*
+-----------------------------------------------------------------------------
+This source file is part of OGRE
+    (Object-oriented Graphics Rendering Engine)
+For the latest info, see http://www.ogre3d.org/
+
+Copyright (c) 2000-2014 Torus Knot Software Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+-----------------------------------------------------------------------------
+*/
+
+#if !OGRE_NO_JSON
+#ifndef _OgreHlmsJsonInkStream_H_
+#define _OgreHlmsJsonInkStream_H_
+
+#include "OgreHlmsInkPrerequisites.h"
+#include "OgreHlmsJson.h"
+#include "OgreDataStream.h"
+#include "OgreHeaderPrefix.h"
+
+namespace Ogre
+{
+    class HlmsJsonInkStreamHandler;
+
+    /** \addtogroup Component
+    *  @{
+    */
+    /** \addtogroup Material
+    *  @{
+    */
+
+    /** Loads JSON material files the same way HlmsJson::loadMaterials does, but parses
+        them with SAX events instead of building a DOM of the whole file.
+    @remarks
+        Only one material entry is turned into a (small) JSON value at a time, which is
+        then handed to the regular HlmsJson::loadDatablockCommon & Hlms::_loadJson
+        (i.e. HlmsJsonInk::loadMaterial), so the results are identical to the DOM path.
+        Peak memory no longer grows with the number of materials in the file.
+    @par
+        The "samplers", "macroblocks" and "blendblocks" sections must appear before any
+        material section (HlmsJson::saveMaterials always writes them first).
+    */
+    class _OgreHlmsInkExport HlmsJsonInkStream : public HlmsJson
+    {
+        friend class HlmsJsonInkStreamHandler;
+
+        size_t  mPeakValueBytes;
+
+    public:
+        HlmsJsonInkStream( HlmsManager *hlmsManager );
+
+        /// Same as HlmsJson::loadMaterials.
+        void loadMaterials( const String &filename, const String &resourceGroup,
+                            const char *jsonString );
+
+        /** Loads the materials reading the stream in chunks, without ever holding the whole
+            file in memory.
+        @param filename
+            Name reported in errors & stored in the datablocks. Empty to use the stream's name.
+        */
+        void loadMaterials( const DataStreamPtr &stream, const String &resourceGroup,
+                            const String &filename=BLANKSTRING );
+
+        /// Largest amount of memory, in bytes, used by the JSON values held at the same
+        /// time during the last load (the named blocks plus one material entry).
+        size_t getPeakValueBytes(void) const            { return mPeakValueBytes; }
+    };
+
+    /** @} */
+    /** @} */
+
+}
+
+#include "OgreHeaderSuffix.h"
+
+#endif
+
+#endif
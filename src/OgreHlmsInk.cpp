@@ -32,6 +32,7 @@ THE SOFTWARE.
 #include "OgreHlmsInkDatablock.h"
 #include "OgreHlmsManager.h"
 #include "OgreHlmsListener.h"
+#include "OgreHlmsTextureManager.h"
 #include "OgreLwString.h"
 
 #if !OGRE_NO_JSON
@@ -42,21 +43,34 @@ THE SOFTWARE.
 #include "OgreRenderTarget.h"
 #include "OgreHighLevelGpuProgramManager.h"
 #include "OgreHighLevelGpuProgram.h"
+#include "OgreGpuProgramManager.h"
+#include "OgreTimer.h"
+#include "OgreBitwise.h"
+#include "OgreRenderOperation.h"
+#include "Vao/OgreVertexArrayObject.h"
 #include "OgreForward3D.h"
 #include "Cubemaps/OgreParallaxCorrectedCubemap.h"
 #include "OgreIrradianceVolume.h"
 
 #include "OgreSceneManager.h"
+#include "OgreCamera.h"
+#include "OgreNode.h"
 #include "Compositor/OgreCompositorShadowNode.h"
 #include "Vao/OgreVaoManager.h"
 #include "Vao/OgreConstBufferPacked.h"
 #include "Vao/OgreTexBufferPacked.h"
+#include "Vao/OgreStagingBuffer.h"
 
 #include "CommandBuffer/OgreCommandBuffer.h"
 #include "CommandBuffer/OgreCbTexture.h"
 #include "CommandBuffer/OgreCbShaderBuffer.h"
 
 #include "Animation/OgreSkeletonInstance.h"
+#include "OgreSubEntity.h"
+#include "OgreSubMesh.h"
+#include "OgreMesh.h"
+#include "Math/Array/OgreArrayMatrixAf4x3.h"
+#include "Math/Array/OgreArrayVector3.h"
 
 #include "RenderSystems/Direct3D11/include/OgreD3D11HlmsPso.h";
 
@@ -143,6 +157,7 @@ namespace Ogre
     const IdString InkProperty::ParallaxCorrectCubemaps = IdString( "parallax_correct_cubemaps" );
     const IdString InkProperty::UseParallaxCorrectCubemaps= IdString( "use_parallax_correct_cubemaps" );
     const IdString InkProperty::IrradianceVolumes = IdString( "irradiance_volumes" );
+    const IdString InkProperty::CompactMaterials  = IdString( "compact_materials" );
 
     const IdString InkProperty::BrdfDefault       = IdString( "BRDF_Default" );
     const IdString InkProperty::BrdfCookTorrance  = IdString( "BRDF_CookTorrance" );
@@ -200,15 +215,107 @@ namespace Ogre
 
     extern const String c_pbsBlendModes[];
 
-    HlmsInk::HlmsInk( Archive *dataFolder, ArchiveVec *libraryFolders ) :
+    //Sampler & buffer names, kept around so setting them doesn't allocate.
+    static const String c_f3dGridName           = "f3dGrid";
+    static const String c_f3dLightListName      = "f3dLightList";
+    static const String c_irradianceVolumeName  = "irradianceVolume";
+    static const String c_texShadowMapName      = "texShadowMap";
+    static const String c_texEnvProbeMapName    = "texEnvProbeMap";
+    static const String c_worldMatBufName       = "worldMatBuf";
+
+    /// Binary search over HlmsPropertyVec, which Hlms keeps sorted by key.
+    struct OrderInkPropertyByIdString
+    {
+        bool operator () ( const HlmsProperty &a, IdString b ) const
+        {
+            return a.keyName < b;
+        }
+    };
+
+    /// Same order Hlms keeps mShaderCache in.
+    struct OrderInkCacheByHash
+    {
+        bool operator () ( const HlmsCache *a, const HlmsCache *b ) const
+        {
+            return a->hash < b->hash;
+        }
+    };
+
+    /// Groups dirty datablocks by pool, then sorts them by slot.
+    struct OrderConstBufferPoolUserByPoolThenSlot
+    {
+        bool operator () ( const ConstBufferPoolUser *a, const ConstBufferPoolUser *b ) const
+        {
+            return  a->getAssignedPool() < b->getAssignedPool() ||
+                    (a->getAssignedPool() == b->getAssignedPool() &&
+                     a->getAssignedSlot() < b->getAssignedSlot());
+        }
+    };
+
+    /// Appends the bits of what a pass buffer is built from, to compare passes without filling them.
+    static inline void pushPassInput( FastArray<uint32> &inputs, uint32 value )
+    {
+        inputs.push_back( value );
+    }
+    static inline void pushPassInput( FastArray<uint32> &inputs, Real value )
+    {
+        //Compare what gets uploaded, not the extra precision Real may have.
+        const float fValue = static_cast<float>( value );
+        uint32 bits;
+        memcpy( &bits, &fValue, sizeof(bits) );
+        inputs.push_back( bits );
+    }
+    static inline void pushPassInput( FastArray<uint32> &inputs, const void *ptr )
+    {
+        const uint64 value = static_cast<uint64>( reinterpret_cast<uintptr_t>( ptr ) );
+        inputs.push_back( static_cast<uint32>( value ) );
+        inputs.push_back( static_cast<uint32>( value >> 32u ) );
+    }
+    static void pushPassInput( FastArray<uint32> &inputs, const Matrix4 &matrix )
+    {
+        for( size_t i=0; i<16; ++i )
+            pushPassInput( inputs, matrix[0][i] );
+    }
+
+    /// A datablock's texture slot whose texture comes from the HlmsTextureManager.
+    struct InkManagedTextureSlot
+    {
+        HlmsInkDatablock    *datablock;
+        InkTextureTypes     texType;
+        size_t              aliasIdx;
+    };
+
+    struct InkManagedTexture
+    {
+        String                              aliasName;
+        String                              resourceName;
+        HlmsTextureManager::TextureMapType  mapType;
+    };
+
+    /// Sorts permutation splits worst offenders first.
+    struct OrderPermutationSplit
+    {
+        bool operator () ( const HlmsInk::PermutationSplit &a,
+                           const HlmsInk::PermutationSplit &b ) const
+        {
+            return a.numSplits > b.numSplits;
+        }
+    };
+
+    size_t HlmsInk::msNumInstanceInkOverrides = 0;
+
+    HlmsInk::HlmsInk( Archive *dataFolder, ArchiveVec *libraryFolders, bool compactMaterials ) :
         HlmsBufferManager( HLMS_USER0, "Ink", dataFolder, libraryFolders ),
-        ConstBufferPool( HlmsInkDatablock::MaterialSizeInGpuAligned,
+        ConstBufferPool( compactMaterials ? HlmsInkDatablock::MaterialSizeInGpuCompact :
+                                            HlmsInkDatablock::MaterialSizeInGpuAligned,
                          ConstBufferPool::ExtraBufferParams() ),
+        mPassBufferRingSize( 64u * 1024u ),
         mShadowmapSamplerblock( 0 ),
         mShadowmapCmpSamplerblock( 0 ),
         mCurrentShadowmapSamplerblock( 0 ),
         mParallaxCorrectedCubemap( 0 ),
         mCurrentPassBuffer( 0 ),
+        mActivePassBuffer( 0 ),
         mGridBuffer( 0 ),
         mGlobalLightListBuffer( 0 ),
         mTexUnitSlotStart( 0 ),
@@ -216,8 +323,123 @@ namespace Ogre
         mLastBoundPool( 0 ),
         mLastTextureHash( 0 ),
         mShadowFilter( PCF_3x3 ),
-        mAmbientLightMode( AmbientAuto )
+        mAmbientLightMode( AmbientAuto ),
+        mRecordingSceneManager( 0 ),
+        mParallelRecording( false ),
+        mParallelRecordingThreshold( 256u ),
+        mBonePaletteCacheTexStart( 0 ),
+        mBonePaletteCacheTexBuffer( 0 ),
+        mTrackedCommandBuffer( 0 ),
+        mTrackedCommandOffset( 0 ),
+        mUntrackedResourcesClean( false ),
+        mNumElidedBindings( 0 ),
+        mPassStatsOpen( false ),
+        mLightPacketsFrame( 0 ),
+        mPropertyFolding( 0 ),
+        mCompactMaterials( compactMaterials ),
+        mTrackCoOccurrence( false ),
+        mLastDrawnDatablock( 0 ),
+        mAsyncCompilation( false ),
+        mAsyncCompileBudgetUs( 4000u ),
+        mDiskCache( 0 )
     {
+        if( mCompactMaterials )
+        {
+            //The decode lives in the templates. Without it every material reads garbage.
+            StringVectorPtr decodePieces = dataFolder->find( "*CompactMaterials_piece_*" );
+            if( decodePieces->empty() )
+            {
+                OGRE_EXCEPT( Exception::ERR_INVALIDPARAMS,
+                             "compactMaterials requested but the templates in '" +
+                             dataFolder->getName() + "' don't declare support for it "
+                             "(no CompactMaterials_piece_* file)",
+                             "HlmsInk::HlmsInk" );
+            }
+        }
+
+        invalidateBindings();
+
+        mCasterProperties[0] = InkProperty::HwGammaRead;
+        mCasterProperties[1] = InkProperty::UvDiffuse;
+        mCasterProperties[2] = InkProperty::FirstValidDetailMapNm;
+        mCasterProperties[3] = HlmsBaseProp::Skeleton;
+        mCasterProperties[4] = HlmsBaseProp::BonesPerVertex;
+        mCasterProperties[5] = HlmsBaseProp::DualParaboloidMapping;
+        mCasterProperties[6] = HlmsBaseProp::AlphaTest;
+        mCasterProperties[7] = HlmsBaseProp::AlphaBlend;
+        std::sort( mCasterProperties, mCasterProperties + NumCasterProperties );
+
+        const IdString alphaTestProperties[] =
+        {
+            InkProperty::NumTextures,
+            InkProperty::DiffuseMap,
+            InkProperty::DetailWeightMap,
+            InkProperty::DetailMap0, InkProperty::DetailMap1,
+            InkProperty::DetailMap2, InkProperty::DetailMap3,
+            InkProperty::DetailWeights,
+            InkProperty::DetailOffsetsD0, InkProperty::DetailOffsetsD1,
+            InkProperty::DetailOffsetsD2, InkProperty::DetailOffsetsD3,
+            InkProperty::UvDetailWeight,
+            InkProperty::UvDetail0, InkProperty::UvDetail1,
+            InkProperty::UvDetail2, InkProperty::UvDetail3,
+            InkProperty::BlendModeIndex0, InkProperty::BlendModeIndex1,
+            InkProperty::BlendModeIndex2, InkProperty::BlendModeIndex3,
+            InkProperty::DetailMapsDiffuse,
+            HlmsBaseProp::UvCount
+        };
+        mAlphaTestProperties.assign( alphaTestProperties, alphaTestProperties +
+                                     sizeof(alphaTestProperties) / sizeof(alphaTestProperties[0]) );
+        for( int i=0; i<8; ++i )
+            mAlphaTestProperties.push_back( *HlmsBaseProp::UvCountPtrs[i] );
+        std::sort( mAlphaTestProperties.begin(), mAlphaTestProperties.end() );
+
+        for( size_t i=0; i<NUM_INK_TEXTURE_TYPES; ++i )
+            mTextureMapNames[i] = "textureMaps[" + StringConverter::toString( i ) + "]";
+
+        {
+            //The fallback permutation keeps the vertex format, skinning, blending and
+            //workflow, but loses every texture and detail map.
+            const char *textureProperties[] =
+            {
+                InkProperty::DiffuseMap, InkProperty::NormalMapTex, InkProperty::SpecularMap,
+                InkProperty::RoughnessMap, InkProperty::EnvProbeMap, InkProperty::DetailWeightMap
+            };
+            for( size_t i=0; i<sizeof(textureProperties) / sizeof(textureProperties[0]); ++i )
+            {
+                mFallbackStrippedProperties.push_back( textureProperties[i] );
+                mFallbackStrippedProperties.push_back( String( textureProperties[i] ) + "_idx" );
+            }
+
+            for( size_t i=0; i<4; ++i )
+            {
+                const String idx = StringConverter::toString( i );
+                mFallbackStrippedProperties.push_back( InkProperty::DetailMapN + idx );
+                mFallbackStrippedProperties.push_back( InkProperty::DetailMapN + idx + "_idx" );
+                mFallbackStrippedProperties.push_back( InkProperty::DetailMapNmN + idx );
+                mFallbackStrippedProperties.push_back( InkProperty::DetailMapNmN + idx + "_idx" );
+                mFallbackStrippedProperties.push_back( *InkProperty::DetailNormalWeights[i] );
+                mFallbackStrippedProperties.push_back( *InkProperty::DetailOffsetsDPtrs[i] );
+                mFallbackStrippedProperties.push_back( *InkProperty::DetailOffsetsNPtrs[i] );
+                mFallbackStrippedProperties.push_back( *InkProperty::BlendModes[i] );
+            }
+
+            for( size_t i=0; i<NUM_INK_SOURCES; ++i )
+                mFallbackStrippedProperties.push_back( *InkProperty::UvSourcePtrs[i] );
+
+            mFallbackStrippedProperties.push_back( InkProperty::NumTextures );
+            mFallbackStrippedProperties.push_back( InkProperty::NormalMap );
+            mFallbackStrippedProperties.push_back( InkProperty::NormalWeight );
+            mFallbackStrippedProperties.push_back( InkProperty::NormalWeightTex );
+            mFallbackStrippedProperties.push_back( InkProperty::DetailWeights );
+            mFallbackStrippedProperties.push_back( InkProperty::DetailMapsDiffuse );
+            mFallbackStrippedProperties.push_back( InkProperty::DetailMapsNormal );
+            mFallbackStrippedProperties.push_back( InkProperty::FirstValidDetailMapNm );
+            mFallbackStrippedProperties.push_back( InkProperty::UseTextureAlpha );
+            mFallbackStrippedProperties.push_back( InkProperty::UseParallaxCorrectCubemaps );
+
+            std::sort( mFallbackStrippedProperties.begin(), mFallbackStrippedProperties.end() );
+        }
+
         //Override defaults
         mLightGatheringMode = LightGatherForwardPlus;
     }
@@ -232,6 +454,9 @@ namespace Ogre
         ConstBufferPool::_changeRenderSystem( newRs );
         HlmsBufferManager::_changeRenderSystem( newRs );
 
+        //worldMaterialIdx only has 9 bits for the slot (see fillBuffersFor).
+        assert( mSlotsPerPool <= 512u && "The material index won't fit in 9 bits" );
+
         if( newRs )
         {
             HlmsDatablockMap::const_iterator itor = mDatablocks.begin();
@@ -280,74 +505,347 @@ namespace Ogre
                                                             uint32 finalHash,
                                                             const QueuedRenderable &queuedRenderable )
     {
-        const HlmsCache *retVal = Hlms::createShaderCacheEntry( renderableHash, passCache, finalHash,
-                                                                queuedRenderable );
+        if( mAsyncCompilation &&
+            (!mDiskCache ||
+             !mDiskCache->findEntry( calculateDiskCacheKey( renderableHash, passCache ) )) )
+        {
+            return deferShaderCacheEntry( renderableHash, passCache, finalHash, queuedRenderable );
+        }
 
-        if( mShaderProfile == "hlsl" || mShaderProfile == "metal" )
+        return compileShaderCacheEntry( renderableHash, passCache, finalHash, queuedRenderable );
+    }
+    //-----------------------------------------------------------------------------------
+    const HlmsCache* HlmsInk::deferShaderCacheEntry( uint32 renderableHash,
+                                                     const HlmsCache &passCache,
+                                                     uint32 finalHash,
+                                                     const QueuedRenderable &queuedRenderable )
+    {
+        //Find (or create) the renderable hash of the fallback.
+        uint32 fallbackRenderableHash;
+        map<uint32, uint32>::type::const_iterator itFallback =
+                mFallbackRenderableHashes.find( renderableHash );
+        if( itFallback != mFallbackRenderableHashes.end() )
         {
-            mListener->shaderCacheEntryCreated( mShaderProfile, retVal, passCache,
-                                                mSetProperties, queuedRenderable );
-            return retVal; //D3D embeds the texture slots in the shader.
+            fallbackRenderableHash = itFallback->second;
         }
+        else
+        {
+            const RenderableCache &renderableCache = getRenderableCache( renderableHash );
 
-        //Set samplers.
-        if( !retVal->pso.pixelShader.isNull() )
+            HlmsPropertyVec fallbackProperties;
+            fallbackProperties.reserve( renderableCache.setProperties.size() );
+
+            HlmsPropertyVec::const_iterator itor = renderableCache.setProperties.begin();
+            HlmsPropertyVec::const_iterator end  = renderableCache.setProperties.end();
+            while( itor != end )
+            {
+                if( !std::binary_search( mFallbackStrippedProperties.begin(),
+                                         mFallbackStrippedProperties.end(), itor->keyName ) )
+                {
+                    fallbackProperties.push_back( *itor );
+                }
+                ++itor;
+            }
+
+            fallbackRenderableHash = addRenderableCache( fallbackProperties,
+                                                         renderableCache.pieces );
+            mFallbackRenderableHashes[renderableHash] = fallbackRenderableHash;
+        }
+
+        //Already as simple as the fallback; nothing to gain by waiting.
+        if( fallbackRenderableHash == renderableHash )
+            return compileShaderCacheEntry( renderableHash, passCache, finalHash, queuedRenderable );
+
+        if( mPendingCompileHashes.insert( finalHash ).second )
         {
-            GpuProgramParametersSharedPtr psParams = retVal->pso.pixelShader->getDefaultParameters();
+            PendingCompile pending;
+            pending.renderableHash  = renderableHash;
+            pending.finalHash       = finalHash;
+            pending.passCache       = passCache;
+            pending.datablock       = queuedRenderable.renderable->getDatablock();
+            pending.datablockName   = pending.datablock->getName();
+            getVertexPsoData( queuedRenderable.renderable,
+                              getProperty( passCache.setProperties,
+                                           HlmsBaseProp::ShadowCaster ) != 0,
+                              pending.vertexData );
+            mPendingCompiles.push_back( pending );
+        }
+
+        //Same composition as Hlms::getMaterial (renderable and pass bits don't overlap).
+        const uint32 fallbackFinalHash = fallbackRenderableHash | passCache.hash;
+
+        const HlmsCache *fallback = getShaderCache( fallbackFinalHash );
+        if( !fallback )
+        {
+            fallback = compileShaderCacheEntry( fallbackRenderableHash, passCache,
+                                                fallbackFinalHash, queuedRenderable );
+        }
+
+        //Register the fallback under our own hash so getMaterial finds it and stops calling
+        //us every draw. compilePendingShaders replaces it once the real shader is ready.
+        HlmsPso pso = fallback->pso;
+        pso.rsData = 0;
+        mRenderSystem->_hlmsPipelineStateObjectCreated( &pso );
+
+        return addShaderCache( finalHash, pso );
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::compilePendingShaders(void)
+    {
+        if( mPendingCompiles.empty() )
+            return;
+
+        Timer timer;
+        const uint64 startTime = timer.getMicroseconds();
+
+        do
+        {
+            const PendingCompile pending = mPendingCompiles.front();
+            mPendingCompiles.pop_front();
+            mPendingCompileHashes.erase( pending.finalHash );
+
+            //The renderable that queued it may be gone or use another material by now.
+            //Look for any live renderable of the datablock that still needs it; if none
+            //does, it will be queued again the next time it's drawn.
+            HlmsDatablockMap::const_iterator itDatablock =
+                    mDatablocks.find( pending.datablockName );
+
+            Renderable *renderable = 0;
+            if( itDatablock != mDatablocks.end() &&
+                itDatablock->second.datablock == pending.datablock )
+            {
+                const vector<Renderable*>::type &linkedRenderables =
+                        pending.datablock->getLinkedRenderables();
+
+                vector<Renderable*>::type::const_iterator itor = linkedRenderables.begin();
+                vector<Renderable*>::type::const_iterator end  = linkedRenderables.end();
+
+                while( itor != end && !renderable )
+                {
+                    if( (*itor)->getHlmsHash() == pending.renderableHash ||
+                        (*itor)->getHlmsCasterHash() == pending.renderableHash )
+                    {
+                        renderable = *itor;
+                    }
+                    ++itor;
+                }
+            }
 
-            int texUnit = 1; //Vertex shader consumes 1 slot with its tbuffer.
+            //Drop the fallback registered under its hash.
+            destroyShaderCacheEntry( pending.finalHash );
 
-            //Forward3D consumes 2 more slots.
-            if( mGridBuffer )
+            if( renderable )
             {
-                psParams->setNamedConstant( "f3dGrid",      1 );
-                psParams->setNamedConstant( "f3dLightList", 2 );
-                texUnit += 2;
+                compileShaderCacheEntry( pending.renderableHash, pending.passCache,
+                                         pending.finalHash, QueuedRenderable( 0, renderable, 0 ),
+                                         &pending.vertexData );
             }
+        }
+        while( !mPendingCompiles.empty() &&
+               timer.getMicroseconds() - startTime < mAsyncCompileBudgetUs );
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::getVertexPsoData( Renderable *renderable, bool casterPass,
+                                    VertexPsoData &outVertexData )
+    {
+        const VertexArrayObjectArray &vaos =
+                renderable->getVaos( static_cast<VertexPass>( casterPass ) );
+        if( !vaos.empty() )
+        {
+            outVertexData.operationType     = vaos.front()->getOperationType();
+            outVertexData.vertexElements    = vaos.front()->getVertexDeclaration();
+        }
+        else
+        {
+            v1::RenderOperation renderOp;
+            renderable->getRenderOperation( renderOp, casterPass );
+            outVertexData.operationType     = renderOp.operationType;
+            outVertexData.vertexElements    = renderOp.vertexData->vertexDeclaration->convertToV2();
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::uploadDirtyDatablocks(void)
+    {
+        if( mDirtyUsers.empty() )
+            return;
+
+        std::sort( mDirtyUsers.begin(), mDirtyUsers.end(), OrderConstBufferPoolUserByPoolThenSlot() );
+
+        const size_t bytesPerSlot = mBytesPerSlot;
+
+        vector<StagingBuffer::Destination>::type destinations;
+
+        ConstBufferPoolUserVec::const_iterator itor = mDirtyUsers.begin();
+        ConstBufferPoolUserVec::const_iterator end  = mDirtyUsers.end();
+
+        while( itor != end )
+        {
+            const BufferPool *pool = (*itor)->getAssignedPool();
+
+            ConstBufferPoolUserVec::const_iterator itPoolEnd = itor;
+            while( itPoolEnd != end && (*itPoolEnd)->getAssignedPool() == pool )
+                ++itPoolEnd;
+
+            //Only the dirty slots are staged, packed back to back.
+            const size_t uploadSize = (itPoolEnd - itor) * bytesPerSlot;
+            StagingBuffer *stagingBuffer = mVaoManager->getStagingBuffer( uploadSize, true );
+            char *stagingStart = reinterpret_cast<char*>( stagingBuffer->map( uploadSize ) );
+            char *dstPtr = stagingStart;
+
+            destinations.clear();
 
-            if( mIrradianceVolume && getProperty( HlmsBaseProp::ShadowCaster ) == 0 )
-                psParams->setNamedConstant( "irradianceVolume", texUnit++ );
+            uint32 lastSlot = std::numeric_limits<uint32>::max() - 1u;
 
-            if( !mPreparedPass.shadowMaps.empty() )
+            while( itor != itPoolEnd )
             {
-                vector<int>::type shadowMaps;
-                shadowMaps.reserve( mPreparedPass.shadowMaps.size() );
-                for( size_t i=0; i<mPreparedPass.shadowMaps.size(); ++i )
-                    shadowMaps.push_back( texUnit++ );
+                assert( dynamic_cast<HlmsInkDatablock*>( *itor ) );
+                HlmsInkDatablock *datablock = static_cast<HlmsInkDatablock*>( *itor );
 
-                psParams->setNamedConstant( "texShadowMap", &shadowMaps[0], shadowMaps.size(), 1 );
+                if( mCompactMaterials )
+                    datablock->writeCompactConstBuffer( reinterpret_cast<uint8*>( dstPtr ) );
+                else
+                    datablock->writeConstBuffer( reinterpret_cast<float*>( dstPtr ) );
+                datablock->mDirtyFlags = DirtyNone;
+
+                const uint32 slot = datablock->getAssignedSlot();
+                if( slot == lastSlot + 1u )
+                {
+                    //Extends the current run of contiguous slots.
+                    destinations.back().length += bytesPerSlot;
+                }
+                else
+                {
+                    destinations.push_back( StagingBuffer::Destination(
+                                                pool->materialBuffer, slot * bytesPerSlot,
+                                                dstPtr - stagingStart, bytesPerSlot ) );
+                }
+
+                lastSlot = slot;
+                dstPtr += bytesPerSlot;
+                ++itor;
             }
 
-            int cubemapTexUnit = 0;
-            const int32 parallaxCorrectCubemaps = getProperty( InkProperty::ParallaxCorrectCubemaps );
-            if( parallaxCorrectCubemaps )
-                cubemapTexUnit = texUnit++;
+            stagingBuffer->unmap( &destinations[0], destinations.size() );
+            stagingBuffer->removeReferenceCount();
+        }
+
+        mDirtyUsers.clear();
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::setAsyncCompilation( bool enable, uint64 budgetMicroseconds )
+    {
+        mAsyncCompilation = enable;
+        mAsyncCompileBudgetUs = budgetMicroseconds;
+
+        if( !enable )
+        {
+            //Drop the fallbacks standing in for them; they'll be
+            //created synchronously the next time they're needed.
+            set<uint32>::type::const_iterator itor = mPendingCompileHashes.begin();
+            set<uint32>::type::const_iterator end  = mPendingCompileHashes.end();
+            while( itor != end )
+                destroyShaderCacheEntry( *itor++ );
+
+            mPendingCompiles.clear();
+            mPendingCompileHashes.clear();
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    const HlmsCache* HlmsInk::compileShaderCacheEntry( uint32 renderableHash,
+                                                       const HlmsCache &passCache,
+                                                       uint32 finalHash,
+                                                       const QueuedRenderable &queuedRenderable,
+                                                       const VertexPsoData *deferredVertexData )
+    {
+        const HlmsCache *retVal = 0;
+
+        uint32 diskCacheKey = 0;
+        const HlmsInkDiskCache::Entry *diskCacheEntry = 0;
+        if( mDiskCache || deferredVertexData )
+            diskCacheKey = calculateDiskCacheKey( renderableHash, passCache );
+        if( mDiskCache )
+            diskCacheEntry = mDiskCache->findEntry( diskCacheKey );
+
+        VertexPsoData vertexData;
+        if( deferredVertexData )
+        {
+            vertexData = *deferredVertexData;
+        }
+        else if( mDiskCache )
+        {
+            getVertexPsoData( queuedRenderable.renderable,
+                              getProperty( passCache.setProperties,
+                                           HlmsBaseProp::ShadowCaster ) != 0,
+                              vertexData );
+        }
+
+        const HlmsDatablock *datablock = queuedRenderable.renderable->getDatablock();
+
+        if( diskCacheEntry )
+        {
+            retVal = createShaderCacheEntryFromDisk( *diskCacheEntry, diskCacheKey, passCache,
+                                                     finalHash, datablock, vertexData );
+            ++mCurrentFrameStats.numShaderCacheHits;
+        }
+        else if( mDiskCache || deferredVertexData )
+        {
+            //Hlms names the programs after the order they were generated in, thus the
+            //microcode saved along the cache would never be found by the next run.
+            //Generate the source only, and compile it once under the stable names.
+            HlmsInkDiskCache::Entry entry;
+            generateShaderSources( renderableHash, passCache, entry );
+            if( mDiskCache )
+                mDiskCache->addEntry( diskCacheKey, entry );
+
+            retVal = createShaderCacheEntryFromDisk( entry, diskCacheKey, passCache, finalHash,
+                                                     datablock, vertexData );
+            ++mCurrentFrameStats.numShaderCacheMisses;
+        }
+        else
+        {
+            const size_t numCompiledShaders = mShaderCodeCache.size();
+
+            retVal = Hlms::createShaderCacheEntry( renderableHash, passCache, finalHash,
+                                                   queuedRenderable );
+
+            if( mShaderCodeCache.size() == numCompiledShaders )
+                ++mCurrentFrameStats.numShaderCacheHits;
+            else
+                ++mCurrentFrameStats.numShaderCacheMisses;
+        }
+
+        if( mShaderProfile == "hlsl" || mShaderProfile == "metal" )
+        {
+            mListener->shaderCacheEntryCreated( mShaderProfile, retVal, passCache,
+                                                mSetProperties, queuedRenderable );
+            return retVal; //D3D embeds the texture slots in the shader.
+        }
+
+        //Set samplers.
+        if( !retVal->pso.pixelShader.isNull() )
+        {
+            GpuProgramParametersSharedPtr psParams = retVal->pso.pixelShader->getDefaultParameters();
 
-            assert( dynamic_cast<const HlmsInkDatablock*>( queuedRenderable.renderable->getDatablock() ) );
-            const HlmsInkDatablock *datablock = static_cast<const HlmsInkDatablock*>(
-                                                        queuedRenderable.renderable->getDatablock() );
+            const SamplerLayout &layout = getSamplerLayout();
 
-            int numTextures = getProperty( InkProperty::NumTextures );
-            for( int i=0; i<numTextures; ++i )
+            SamplerSlotVec::const_iterator itor = layout.slots.begin();
+            SamplerSlotVec::const_iterator end  = layout.slots.end();
+
+            while( itor != end )
             {
-                psParams->setNamedConstant( "textureMaps[" + StringConverter::toString( i ) + "]",
-                                            texUnit++ );
+                psParams->setNamedConstant( *itor->name, itor->texUnit );
+                ++itor;
             }
 
-            const int32 envProbeMap         = getProperty( InkProperty::EnvProbeMap );
-            const int32 targetEnvProbeMap   = getProperty( InkProperty::TargetEnvprobeMap );
-            if( (envProbeMap && envProbeMap != targetEnvProbeMap) || parallaxCorrectCubemaps )
+            if( !layout.shadowMapUnits.empty() )
             {
-                assert( !datablock->getTexture( INK_REFLECTION ).isNull() || parallaxCorrectCubemaps );
-                if( !envProbeMap || envProbeMap == targetEnvProbeMap )
-                    psParams->setNamedConstant( "texEnvProbeMap", cubemapTexUnit );
-                else
-                    psParams->setNamedConstant( "texEnvProbeMap", texUnit++ );
+                psParams->setNamedConstant( c_texShadowMapName, &layout.shadowMapUnits[0],
+                                            layout.shadowMapUnits.size(), 1 );
             }
         }
 
         GpuProgramParametersSharedPtr vsParams = retVal->pso.vertexShader->getDefaultParameters();
-        vsParams->setNamedConstant( "worldMatBuf", 0 );
+        vsParams->setNamedConstant( c_worldMatBufName, 0 );
 
         mListener->shaderCacheEntryCreated( mShaderProfile, retVal, passCache,
                                             mSetProperties, queuedRenderable );
@@ -364,863 +862,2516 @@ namespace Ogre
         return retVal;
     }
     //-----------------------------------------------------------------------------------
-    void HlmsInk::setDetailMapProperties( HlmsInkDatablock *datablock, PiecesMap *inOutPieces )
+    const HlmsInk::SamplerLayout& HlmsInk::getSamplerLayout(void)
     {
-        uint32 minNormalMap = 4;
-        bool hasDiffuseMaps = false;
-        bool hasNormalMaps = false;
-        bool anyDetailWeight = false;
-        for( size_t i=0; i<4; ++i )
-        {
-            uint8 blendMode = datablock->mBlendModes[i];
+        //Slots are derived from the final properties rather than the currently prepared
+        //pass, since permutations may be created for other passes (see warmUp).
+        const bool casterPass = getProperty( HlmsBaseProp::ShadowCaster ) != 0;
 
-            setDetailTextureProperty( InkProperty::DetailMapN,   datablock, INK_DETAIL0, i );
-            setDetailTextureProperty( InkProperty::DetailMapNmN, datablock, INK_DETAIL0_NM, i );
+        const bool forwardPlus      = !casterPass && getProperty( HlmsBaseProp::ForwardPlus );
+        const bool irradianceVolume = mIrradianceVolume && !casterPass;
+        const bool parallaxCorrectCubemaps = getProperty( InkProperty::ParallaxCorrectCubemaps ) != 0;
+        const int32 numShadowMaps   = casterPass ? 0 : getProperty( HlmsBaseProp::NumShadowMaps );
+        const int32 numTextures     = getProperty( InkProperty::NumTextures );
 
-            if( !datablock->getTexture( INK_DETAIL0 + i ).isNull() )
-            {
-                inOutPieces[PixelShader][*InkProperty::BlendModes[i]] =
-                                                "@insertpiece( " + c_pbsBlendModes[blendMode] + ")";
-                hasDiffuseMaps = true;
-            }
+        //0 = no env probe sampler, 1 = shares the cubemap unit, 2 = has its own unit.
+        uint32 envProbeMode = 0;
+        const int32 envProbeMap         = getProperty( InkProperty::EnvProbeMap );
+        const int32 targetEnvProbeMap   = getProperty( InkProperty::TargetEnvprobeMap );
+        if( (envProbeMap && envProbeMap != targetEnvProbeMap) || parallaxCorrectCubemaps )
+            envProbeMode = (!envProbeMap || envProbeMap == targetEnvProbeMap) ? 1u : 2u;
 
-            if( !datablock->getTexture( INK_DETAIL0_NM + i ).isNull() )
-            {
-                minNormalMap = std::min<uint32>( minNormalMap, i );
-                hasNormalMaps = true;
-            }
+        assert( numShadowMaps < 256 && numTextures <= NUM_INK_TEXTURE_TYPES );
 
-            if( datablock->mDetailsOffsetScale[i] != Vector4( 0, 0, 1, 1 ) )
-                setProperty( *InkProperty::DetailOffsetsDPtrs[i], 1 );
+        const uint32 key = (forwardPlus ? 1u : 0u) |
+                           (irradianceVolume ? 4u : 0u) | (parallaxCorrectCubemaps ? 8u : 0u) |
+                           (envProbeMode << 4u) |
+                           (static_cast<uint32>( numShadowMaps ) << 8u) |
+                           (static_cast<uint32>( numTextures ) << 16u);
 
-            if( datablock->mDetailsOffsetScale[i+4] != Vector4( 0, 0, 1, 1 ) )
-                setProperty( *InkProperty::DetailOffsetsNPtrs[i], 1 );
+        SamplerLayoutMap::const_iterator itor = mSamplerLayouts.find( key );
+        if( itor != mSamplerLayouts.end() )
+            return itor->second;
 
-            if( datablock->mDetailWeight[i] != 1.0f &&
-                (!datablock->getTexture( INK_DETAIL0 + i ).isNull() ||
-                 !datablock->getTexture( INK_DETAIL0_NM + i ).isNull()) )
-            {
-                anyDetailWeight = true;
-            }
-        }
+        SamplerLayout &layout = mSamplerLayouts[key];
 
-        if( hasDiffuseMaps )
-            setProperty( InkProperty::DetailMapsDiffuse, 4 );
+        int32 texUnit = 1; //Vertex shader consumes 1 slot with its tbuffer.
 
-        if( hasNormalMaps )
-            setProperty( InkProperty::DetailMapsNormal, 4 );
+        SamplerSlot slot;
 
-        setProperty( InkProperty::FirstValidDetailMapNm, minNormalMap );
+        //Forward3D consumes 2 more slots.
+        if( forwardPlus )
+        {
+            slot.name = &c_f3dGridName;
+            slot.texUnit = 1;
+            layout.slots.push_back( slot );
+            slot.name = &c_f3dLightListName;
+            slot.texUnit = 2;
+            layout.slots.push_back( slot );
+            texUnit += 2;
+        }
 
-        if( anyDetailWeight )
-            setProperty( InkProperty::DetailWeights, 1 );
-    }
-    //-----------------------------------------------------------------------------------
-    void HlmsInk::setTextureProperty( const char *propertyName, HlmsInkDatablock *datablock,
-                                      InkTextureTypes texType )
-    {
-        uint8 idx = datablock->getBakedTextureIdx( texType );
-        if( idx != NUM_INK_TEXTURE_TYPES )
+        if( irradianceVolume )
         {
-            char tmpData[64];
-            LwString propName = LwString::FromEmptyPointer( tmpData, sizeof(tmpData) );
+            slot.name = &c_irradianceVolumeName;
+            slot.texUnit = texUnit++;
+            layout.slots.push_back( slot );
+        }
 
-            propName = propertyName; //diffuse_map
+        layout.shadowMapUnits.reserve( numShadowMaps );
+        for( int32 i=0; i<numShadowMaps; ++i )
+            layout.shadowMapUnits.push_back( texUnit++ );
 
-            //In the template the we subtract the "+1" for the index.
-            //We need to increment it now otherwise @property( diffuse_map )
-            //can translate to @property( 0 ) which is not what we want.
-            setProperty( propertyName, idx + 1 );
+        int32 cubemapTexUnit = 0;
+        if( parallaxCorrectCubemaps )
+            cubemapTexUnit = texUnit++;
 
-            propName.a( "_idx" ); //diffuse_map_idx
-            setProperty( propName.c_str(), idx );
+        for( int32 i=0; i<numTextures; ++i )
+        {
+            slot.name = &mTextureMapNames[i];
+            slot.texUnit = texUnit++;
+            layout.slots.push_back( slot );
         }
+
+        if( envProbeMode )
+        {
+            slot.name = &c_texEnvProbeMapName;
+            slot.texUnit = envProbeMode == 1u ? cubemapTexUnit : texUnit++;
+            layout.slots.push_back( slot );
+        }
+
+        return layout;
     }
     //-----------------------------------------------------------------------------------
-    void HlmsInk::setDetailTextureProperty( const char *propertyName, HlmsInkDatablock *datablock,
-                                            InkTextureTypes baseTexType, uint8 detailIdx )
+    uint32 HlmsInk::calculateDiskCacheKey( uint32 renderableHash, const HlmsCache &passCache ) const
     {
-        const InkTextureTypes texType = static_cast<InkTextureTypes>( baseTexType + detailIdx );
-        const uint8 idx = datablock->getBakedTextureIdx( texType );
-        if( idx != NUM_INK_TEXTURE_TYPES )
+        const RenderableCache &renderableCache = getRenderableCache( renderableHash );
+
+        uint32 hash = FastHash( reinterpret_cast<const char*>( &mHighQuality ),
+                                sizeof( mHighQuality ) );
+
+        //HlmsProperty is an IdString hash + an int32 value; both vectors are sorted.
+        if( !renderableCache.setProperties.empty() )
         {
-            char tmpData[64];
-            LwString propName = LwString::FromEmptyPointer( tmpData, sizeof(tmpData) );
+            hash = FastHash( reinterpret_cast<const char*>( &renderableCache.setProperties[0] ),
+                             static_cast<int>( renderableCache.setProperties.size() *
+                                               sizeof( HlmsProperty ) ), hash );
+        }
+        if( !passCache.setProperties.empty() )
+        {
+            hash = FastHash( reinterpret_cast<const char*>( &passCache.setProperties[0] ),
+                             static_cast<int>( passCache.setProperties.size() *
+                                               sizeof( HlmsProperty ) ), hash );
+        }
 
-            propName.a( propertyName, detailIdx ); //detail_map0
+        for( size_t i=0; i<NumShaderTypes; ++i )
+        {
+            PiecesMap::const_iterator itor = renderableCache.pieces[i].begin();
+            PiecesMap::const_iterator end  = renderableCache.pieces[i].end();
 
-            //In the template the we subtract the "+1" for the index.
-            //We need to increment it now otherwise @property( diffuse_map )
-            //can translate to @property( 0 ) which is not what we want.
-            setProperty( propName.c_str(), idx + 1 );
-
-            propName.a( "_idx" ); //detail_map0_idx
-            setProperty( propName.c_str(), idx );
+            while( itor != end )
+            {
+                hash = FastHash( reinterpret_cast<const char*>( &itor->first.mHash ),
+                                 sizeof( uint32 ), hash );
+                hash = FastHash( itor->second.c_str(), static_cast<int>( itor->second.size() ),
+                                 hash );
+                ++itor;
+            }
         }
+
+        return hash;
     }
     //-----------------------------------------------------------------------------------
-    void HlmsInk::calculateHashForPreCreate( Renderable *renderable, PiecesMap *inOutPieces )
+    void HlmsInk::generateShaderSources( uint32 renderableHash, const HlmsCache &passCache,
+                                         HlmsInkDiskCache::Entry &outEntry )
     {
-        assert( dynamic_cast<HlmsInkDatablock*>( renderable->getDatablock() ) );
-        HlmsInkDatablock *datablock = static_cast<HlmsInkDatablock*>(
-                                                        renderable->getDatablock() );
-
-        const bool metallicWorkflow = datablock->getWorkflow() == HlmsInkDatablock::MetallicWorkflow;
-        const bool fresnelWorkflow = datablock->getWorkflow() ==
-                                                        HlmsInkDatablock::SpecularAsFresnelWorkflow;
+        static const char *c_shaderFiles[NumShaderTypes] =
+        {
+            "VertexShader_vs", "PixelShader_ps", "GeometryShader_gs",
+            "HullShader_hs", "DomainShader_ds"
+        };
 
-        setProperty( InkProperty::FresnelScalar, datablock->hasSeparateFresnel() || metallicWorkflow );
-        setProperty( InkProperty::FresnelWorkflow, fresnelWorkflow );
-        setProperty( InkProperty::MetallicWorkflow, metallicWorkflow );
+        const RenderableCache &renderableCache = getRenderableCache( renderableHash );
 
-        if( datablock->getTwoSidedLighting() )
-            setProperty( InkProperty::TwoSidedLighting, 1 );
+        //Merge the renderable's & pass' properties, as Hlms::createShaderCacheEntry does.
+        mSetProperties = renderableCache.setProperties;
+        HlmsPropertyVec::const_iterator itProp = passCache.setProperties.begin();
+        HlmsPropertyVec::const_iterator enProp = passCache.setProperties.end();
+        while( itProp != enProp )
+        {
+            setProperty( itProp->keyName, itProp->value );
+            ++itProp;
+        }
 
-        uint32 brdf = datablock->getBrdf();
-        if( (brdf & InkBrdf::BRDF_MASK) == InkBrdf::Default )
+        for( size_t i=0; i<NumShaderTypes; ++i )
         {
-            setProperty( InkProperty::BrdfDefault, 1 );
+            outEntry.sources[i].clear();
 
-            if( !(brdf & InkBrdf::FLAG_UNCORRELATED) )
-                setProperty( InkProperty::GgxHeightCorrelated, 1 );
-        }
-        else if( (brdf & InkBrdf::BRDF_MASK) == InkBrdf::CookTorrance )
-            setProperty( InkProperty::BrdfCookTorrance, 1 );
+            const String filename = c_shaderFiles[i] + mShaderFileExt;
+            if( !mDataFolder->exists( filename ) )
+                continue;
 
-        if( brdf & InkBrdf::FLAG_SPERATE_DIFFUSE_FRESNEL )
-            setProperty( InkProperty::FresnelSeparateDiffuse, 1 );
+            mPieces = renderableCache.pieces[i];
 
-        for( size_t i=0; i<INK_REFLECTION; ++i )
-        {
-            uint8 uvSource = datablock->mUvSource[i];
-            setProperty( *InkProperty::UvSourcePtrs[i], uvSource );
+            if( mShaderProfile == "glsl" )
+            {
+                setProperty( HlmsBaseProp::GL3Plus,
+                             mRenderSystem->getNativeShadingLanguageVersion() );
+            }
+            setProperty( HlmsBaseProp::HighQuality, mHighQuality );
 
-            if( !datablock->getTexture( i ).isNull() &&
-                getProperty( *HlmsBaseProp::UvCountPtrs[uvSource] ) < 2 )
+            //Library piece files first, then the main ones.
+            LibraryVec::const_iterator itor = mLibrary.begin();
+            LibraryVec::const_iterator end  = mLibrary.end();
+            while( itor != end )
             {
-                OGRE_EXCEPT( Exception::ERR_INVALID_STATE,
-                             "Renderable needs at least 2 coordinates in UV set #" +
-                             StringConverter::toString( uvSource ) +
-                             ". Either change the mesh, or change the UV source settings",
-                             "HlmsInk::calculateHashForPreCreate" );
+                processPieces( itor->dataFolder, itor->pieceFiles[i] );
+                ++itor;
             }
-        }
+            processPieces( mDataFolder, mPieceFiles[i] );
 
-        int numNormalWeights = 0;
-        if( datablock->getNormalMapWeight() != 1.0f && !datablock->getTexture( INK_NORMAL ).isNull() )
-        {
-            setProperty( InkProperty::NormalWeightTex, 1 );
-            ++numNormalWeights;
-        }
+            DataStreamPtr inFile = mDataFolder->open( filename );
 
-        {
-            size_t validDetailMaps = 0;
-            for( size_t i=0; i<4; ++i )
-            {
-                if( !datablock->getTexture( INK_DETAIL0_NM + i ).isNull() )
-                {
-                    if( datablock->getDetailNormalWeight( i ) != 1.0f )
-                    {
-                        setProperty( *InkProperty::DetailNormalWeights[validDetailMaps], 1 );
-                        ++numNormalWeights;
-                    }
+            String inString;
+            String outString;
+            inString.resize( inFile->size() );
+            inFile->read( &inString[0], inFile->size() );
 
-                    ++validDetailMaps;
-                }
+            parseMath( inString, outString );
+            while( outString.find( "@foreach" ) != String::npos )
+            {
+                parseForEach( outString, inString );
+                inString.swap( outString );
             }
+            parseProperties( outString, inString );
+            parseUndefPieces( inString, outString );
+            collectPieces( outString, inString );
+            parseProperties( inString, outString );
+            insertPieces( outString, inString );
+            parseCounter( inString, outString );
+
+            outEntry.sources[i].swap( outString );
         }
 
-        setProperty( InkProperty::NormalWeight, numNormalWeights );
+        outEntry.setProperties = mSetProperties;
+    }
+    //-----------------------------------------------------------------------------------
+    const HlmsCache* HlmsInk::createShaderCacheEntryFromDisk( const HlmsInkDiskCache::Entry &entry,
+                                                              uint32 diskCacheKey,
+                                                              const HlmsCache &passCache,
+                                                              uint32 finalHash,
+                                                              const HlmsDatablock *datablock,
+                                                              const VertexPsoData &vertexData )
+    {
+        static const char *c_stageSuffixes[NumShaderTypes] =
+        {
+            "_vs", "_ps", "_gs", "_hs", "_ds"
+        };
 
-        setDetailMapProperties( datablock, inOutPieces );
+        //The rest of createShaderCacheEntry relies on the final property set.
+        mSetProperties = entry.setProperties;
 
-        bool envMap = datablock->getBakedTextureIdx( INK_REFLECTION ) != NUM_INK_TEXTURE_TYPES;
+        HighLevelGpuProgramManager *gpuProgramManager = HighLevelGpuProgramManager::getSingletonPtr();
 
-        setProperty( InkProperty::NumTextures, datablock->mBakedTextures.size() - envMap );
+        GpuProgramPtr shaders[NumShaderTypes];
+        for( size_t i=0; i<NumShaderTypes; ++i )
+        {
+            if( entry.sources[i].empty() )
+                continue;
 
-        setTextureProperty( InkProperty::DiffuseMap,    datablock,  INK_DIFFUSE );
-        setTextureProperty( InkProperty::NormalMapTex,  datablock,  INK_NORMAL );
-        setTextureProperty( InkProperty::SpecularMap,   datablock,  INK_SPECULAR );
-        setTextureProperty( InkProperty::RoughnessMap,  datablock,  INK_ROUGHNESS );
-        setTextureProperty( InkProperty::EnvProbeMap,   datablock,  INK_REFLECTION );
-        setTextureProperty( InkProperty::DetailWeightMap,datablock, INK_DETAIL_WEIGHT );
+            //Stable names, so the microcode cache can find them on the next run.
+            //Entries with the same key share the programs.
+            const String programName = "InkDiskCache/" + StringConverter::toString( diskCacheKey ) +
+                                       c_stageSuffixes[i];
 
-        {
-            //Save the name of the cubemap for hazard prevention
-            //(don't sample the cubemap and render to it at the same time).
-            TexturePtr reflectionTexture = datablock->getTexture( INK_REFLECTION );
-            if( !reflectionTexture.isNull() )
+            HighLevelGpuProgramPtr gp = gpuProgramManager->getByName(
+                        programName, ResourceGroupManager::INTERNAL_RESOURCE_GROUP_NAME );
+
+            if( gp.isNull() )
             {
-                //Manual reflection texture
-                if( datablock->getCubemapProbe() )
-                    setProperty( InkProperty::UseParallaxCorrectCubemaps, 1 );
-                setProperty( InkProperty::EnvProbeMap, static_cast<int32>(
-                             IdString( reflectionTexture->getName() ).mHash ) );
+                gp = gpuProgramManager->createProgram(
+                            programName, ResourceGroupManager::INTERNAL_RESOURCE_GROUP_NAME,
+                            mShaderProfile, static_cast<GpuProgramType>( i ) );
+                gp->setSource( entry.sources[i] );
+
+                if( mShaderTargets[i] )
+                {
+                    //D3D-specific
+                    gp->setParameter( "target", *mShaderTargets[i] );
+                    gp->setParameter( "entry_point", "main" );
+                }
+
+                gp->setSkeletalAnimationIncluded( getProperty( HlmsBaseProp::Skeleton ) != 0 );
+                gp->setMorphAnimationIncluded( false );
+                gp->setPoseAnimationIncluded( getProperty( HlmsBaseProp::Pose ) );
+                gp->setVertexTextureFetchRequired( false );
+
+                gp->load();
             }
+
+            shaders[i] = gp;
         }
 
-        bool usesNormalMap = !datablock->getTexture( INK_NORMAL ).isNull();
-        for( size_t i=INK_DETAIL0_NM; i<=INK_DETAIL3_NM; ++i )
-            usesNormalMap |= !datablock->getTexture( i ).isNull();
-        setProperty( InkProperty::NormalMap, usesNormalMap );
+        HlmsPso pso;
+        pso.initialize();
+        pso.vertexShader            = shaders[VertexShader];
+        pso.geometryShader          = shaders[GeometryShader];
+        pso.tesselationHullShader   = shaders[HullShader];
+        pso.tesselationDomainShader = shaders[DomainShader];
+        pso.pixelShader             = shaders[PixelShader];
 
-        /*setProperty( HlmsBaseProp::, !datablock->getTexture( INK_DETAIL0 ).isNull() );
-        setProperty( HlmsBaseProp::DiffuseMap, !datablock->getTexture( INK_DETAIL1 ).isNull() );*/
-        bool normalMapCanBeSupported = (getProperty( HlmsBaseProp::Normal ) &&
-                                        getProperty( HlmsBaseProp::Tangent )) ||
-                                        getProperty( HlmsBaseProp::QTangent );
+        const bool casterPass = getProperty( HlmsBaseProp::ShadowCaster ) != 0;
 
-        if( !normalMapCanBeSupported && usesNormalMap )
-        {
-            OGRE_EXCEPT( Exception::ERR_INVALID_STATE,
-                         "Renderable can't use normal maps but datablock wants normal maps. "
-                         "Generate Tangents for this mesh to fix the problem or use a "
-                         "datablock without normal maps.", "HlmsInk::calculateHashForPreCreate" );
-        }
+        pso.macroblock = datablock->getMacroblock( casterPass );
+        pso.blendblock = datablock->getBlendblock( casterPass );
+        pso.pass = passCache.pso.pass;
 
-        if( datablock->mUseAlphaFromTextures && datablock->mBlendblock[0]->mIsTransparent &&
-            (getProperty( InkProperty::DiffuseMap ) || getProperty( InkProperty::DetailMapsDiffuse )) )
-        {
-            setProperty( InkProperty::UseTextureAlpha, 1 );
+        const size_t numGlobalClipDistances = (size_t)getProperty( HlmsBaseProp::PsoClipDistances );
+        pso.clipDistances = (1u << numGlobalClipDistances) - 1u;
+        pso.sampleMask = 0xffffffff;
 
-            //When we don't use the alpha in the texture, transparency still works but
-            //only at material level (i.e. what datablock->mTransparency says). The
-            //alpha from the texture will be ignored.
-            if( datablock->mTransparencyMode == HlmsInkDatablock::Transparent )
-                setProperty( InkProperty::TransparentMode, 1 );
-        }
+        pso.operationType   = vertexData.operationType;
+        pso.vertexElements  = vertexData.vertexElements;
+        pso.enablePrimitiveRestart = true;
 
-        String slotsPerPoolStr = StringConverter::toString( mSlotsPerPool );
-        inOutPieces[VertexShader][InkProperty::MaterialsPerBuffer] = slotsPerPoolStr;
-		inOutPieces[GeometryShader][InkProperty::MaterialsPerBuffer] = slotsPerPoolStr;
-        inOutPieces[PixelShader][InkProperty::MaterialsPerBuffer] = slotsPerPoolStr;
+        mRenderSystem->_hlmsPipelineStateObjectCreated( &pso );
+
+        return addShaderCache( finalHash, pso );
     }
     //-----------------------------------------------------------------------------------
-    void HlmsInk::calculateHashForPreCaster( Renderable *renderable, PiecesMap *inOutPieces )
+    void HlmsInk::destroyShaderCacheEntry( uint32 finalHash )
     {
-        HlmsInkDatablock *datablock = static_cast<HlmsInkDatablock*>( renderable->getDatablock() );
-        const bool hasAlphaTest = datablock->getAlphaTest() != CMPF_ALWAYS_PASS;
+        HlmsCache key( finalHash, mType, HlmsPso() );
+        HlmsCacheVec::iterator itor = std::lower_bound( mShaderCache.begin(), mShaderCache.end(),
+                                                        &key, OrderInkCacheByHash() );
+        if( itor != mShaderCache.end() && (*itor)->hash == finalHash )
+        {
+            mRenderSystem->_hlmsPipelineStateObjectDestroyed( &(*itor)->pso );
+            delete *itor;
+            mShaderCache.erase( itor );
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::setInstanceInkParameters( Renderable *renderable, Real dryness, Real density,
+                                            const ColourValue &tint )
+    {
+        if( !renderable->hasCustomParameter( CustomParamInkParams ) )
+            ++msNumInstanceInkOverrides;
 
-        HlmsPropertyVec::iterator itor = mSetProperties.begin();
-        HlmsPropertyVec::iterator end  = mSetProperties.end();
+        renderable->setCustomParameter( CustomParamInkParams, Vector4( dryness, density, 0, 0 ) );
+        renderable->setCustomParameter( CustomParamInkTint,
+                                        Vector4( tint.r, tint.g, tint.b, tint.a ) );
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::removeInstanceInkParameters( Renderable *renderable )
+    {
+        if( renderable->hasCustomParameter( CustomParamInkParams ) )
+            --msNumInstanceInkOverrides;
 
-        while( itor != end )
+        renderable->removeCustomParameter( CustomParamInkParams );
+        renderable->removeCustomParameter( CustomParamInkTint );
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::getPermutationReport( PermutationReport &outReport ) const
+    {
+        outReport.numRenderableHashes   = mRenderableCache.size();
+        outReport.numShaders            = mShaderCache.size();
+        outReport.splits.clear();
+
+        //Gather every property key in use.
+        vector<IdString>::type keys;
+        RenderableCacheVec::const_iterator itCache = mRenderableCache.begin();
+        RenderableCacheVec::const_iterator enCache = mRenderableCache.end();
+        while( itCache != enCache )
         {
-            if( itor->keyName == InkProperty::FirstValidDetailMapNm )
-            {
-                itor->value = 0;
-                ++itor;
-            }
-            else if( itor->keyName != InkProperty::HwGammaRead &&
-                     itor->keyName != InkProperty::UvDiffuse &&
-                     itor->keyName != HlmsBaseProp::Skeleton &&
-                     itor->keyName != HlmsBaseProp::BonesPerVertex &&
-                     itor->keyName != HlmsBaseProp::DualParaboloidMapping &&
-                     itor->keyName != HlmsBaseProp::AlphaTest &&
-                     itor->keyName != HlmsBaseProp::AlphaBlend &&
-                     (!hasAlphaTest || !requiredPropertyByAlphaTest( itor->keyName )) )
-            {
-                itor = mSetProperties.erase( itor );
-                end  = mSetProperties.end();
-            }
-            else
+            HlmsPropertyVec::const_iterator itor = itCache->setProperties.begin();
+            HlmsPropertyVec::const_iterator end  = itCache->setProperties.end();
+            while( itor != end )
             {
+                keys.push_back( itor->keyName );
                 ++itor;
             }
+            ++itCache;
         }
 
-        if( hasAlphaTest )
+        std::sort( keys.begin(), keys.end() );
+        keys.erase( std::unique( keys.begin(), keys.end() ), keys.end() );
+
+        //For each key, hash every property set leaving that key out. The number of
+        //hashes that collapse is the number of permutations that key alone is causing.
+        vector<uint32>::type scratch;
+        vector<uint32>::type setHashes;
+        vector<int32>::type values;
+        setHashes.reserve( mRenderableCache.size() );
+        values.reserve( mRenderableCache.size() );
+
+        vector<IdString>::type::const_iterator itKey = keys.begin();
+        vector<IdString>::type::const_iterator enKey = keys.end();
+        while( itKey != enKey )
         {
-            //Keep GLSL happy by not declaring more textures than we'll actually need.
-            uint8 numTextures = 0;
-            for( int i=0; i<4; ++i )
+            setHashes.clear();
+            values.clear();
+
+            itCache = mRenderableCache.begin();
+            while( itCache != enCache )
             {
-                if( datablock->mTexToBakedTextureIdx[INK_DETAIL0+i] < datablock->mBakedTextures.size() )
+                scratch.clear();
+                int32 value = 0;
+
+                HlmsPropertyVec::const_iterator itor = itCache->setProperties.begin();
+                HlmsPropertyVec::const_iterator end  = itCache->setProperties.end();
+                while( itor != end )
                 {
-                    numTextures = std::max<uint8>(
-                                numTextures, datablock->mTexToBakedTextureIdx[INK_DETAIL0+i] + 1 );
+                    if( itor->keyName != *itKey )
+                    {
+                        scratch.push_back( itor->keyName.mHash );
+                        scratch.push_back( static_cast<uint32>( itor->value ) );
+                    }
+                    else
+                    {
+                        value = itor->value;
+                    }
+                    ++itor;
                 }
-            }
 
-            if( datablock->mTexToBakedTextureIdx[INK_DIFFUSE] < datablock->mBakedTextures.size() )
-            {
-                numTextures = std::max<uint8>(
-                            numTextures, datablock->mTexToBakedTextureIdx[INK_DIFFUSE] + 1 );
+                uint32 hash = 0;
+                if( !scratch.empty() )
+                {
+                    hash = FastHash( reinterpret_cast<const char*>( &scratch[0] ),
+                                     scratch.size() * sizeof(uint32) );
+                }
+                setHashes.push_back( hash );
+                values.push_back( value );
+
+                ++itCache;
             }
 
-            setProperty( InkProperty::NumTextures, numTextures );
+            std::sort( setHashes.begin(), setHashes.end() );
+            std::sort( values.begin(), values.end() );
+            const size_t numMerged = std::unique( setHashes.begin(), setHashes.end() ) -
+                                     setHashes.begin();
 
-            //Set the blending mode as a piece again
-            for( size_t i=0; i<4; ++i )
+            if( numMerged < mRenderableCache.size() )
             {
-                uint8 blendMode = datablock->mBlendModes[i];
-                if( !datablock->getTexture( INK_DETAIL0 + i ).isNull() )
-                {
-                    inOutPieces[PixelShader][*InkProperty::BlendModes[i]] =
-                                                    "@insertpiece( " + c_pbsBlendModes[blendMode] + ")";
-                }
+                PermutationSplit split;
+                split.property  = *itKey;
+                split.numSplits = mRenderableCache.size() - numMerged;
+                split.numValues = std::unique( values.begin(), values.end() ) - values.begin();
+                outReport.splits.push_back( split );
             }
-        }
 
-        String slotsPerPoolStr = StringConverter::toString( mSlotsPerPool );
-        inOutPieces[VertexShader][InkProperty::MaterialsPerBuffer] = slotsPerPoolStr;
-        inOutPieces[PixelShader][InkProperty::MaterialsPerBuffer] = slotsPerPoolStr;
-    }
-    //-----------------------------------------------------------------------------------
-    bool HlmsInk::requiredPropertyByAlphaTest( IdString keyName )
-    {
-        bool retVal =
-                keyName == InkProperty::NumTextures ||
-                keyName == InkProperty::DiffuseMap ||
-                keyName == InkProperty::DetailWeightMap ||
-                keyName == InkProperty::DetailMap0 || keyName == InkProperty::DetailMap1 ||
-                keyName == InkProperty::DetailMap2 || keyName == InkProperty::DetailMap3 ||
-                keyName == InkProperty::DetailWeights ||
-                keyName == InkProperty::DetailOffsetsD0 || keyName == InkProperty::DetailOffsetsD1 ||
-                keyName == InkProperty::DetailOffsetsD2 || keyName == InkProperty::DetailOffsetsD3 ||
-                keyName == InkProperty::UvDetailWeight ||
-                keyName == InkProperty::UvDetail0 || keyName == InkProperty::UvDetail1 ||
-                keyName == InkProperty::UvDetail2 || keyName == InkProperty::UvDetail3 ||
-                keyName == InkProperty::BlendModeIndex0 || keyName == InkProperty::BlendModeIndex1 ||
-                keyName == InkProperty::BlendModeIndex2 || keyName == InkProperty::BlendModeIndex3 ||
-                keyName == InkProperty::DetailMapsDiffuse ||
-                keyName == HlmsBaseProp::UvCount;
-
-        for( int i=0; i<8 && !retVal; ++i )
-            retVal |= keyName == *HlmsBaseProp::UvCountPtrs[i];
+            ++itKey;
+        }
 
-        return retVal;
+        std::sort( outReport.splits.begin(), outReport.splits.end(), OrderPermutationSplit() );
     }
     //-----------------------------------------------------------------------------------
-    HlmsCache HlmsInk::preparePassHash( const CompositorShadowNode *shadowNode, bool casterPass,
-                                        bool dualParaboloid, SceneManager *sceneManager )
+    void HlmsInk::setPropertyFolding( uint32 foldingMask )
     {
-        mSetProperties.clear();
-
-        //The properties need to be set before preparePassHash so that
-        //they are considered when building the HlmsCache's hash.
-        if( shadowNode && !casterPass )
+        if( mPropertyFolding != foldingMask )
         {
-            //Shadow receiving can be improved in performance by using gather sampling.
-            //(it's the only feature so far that uses gather)
-            const RenderSystemCapabilities *capabilities = mRenderSystem->getCapabilities();
-            if( capabilities->hasCapability( RSC_TEXTURE_GATHER ) )
-                setProperty( HlmsBaseProp::TexGather, 1 );
+            mPropertyFolding = foldingMask;
 
-            if( mShadowFilter == PCF_3x3 )
-            {
-                setProperty( InkProperty::Pcf3x3, 1 );
-                setProperty( InkProperty::PcfIterations, 4 );
-            }
-            else if( mShadowFilter == PCF_4x4 )
-            {
-                setProperty( InkProperty::Pcf4x4, 1 );
-                setProperty( InkProperty::PcfIterations, 9 );
-            }
-            else
+            HlmsDatablockMap::const_iterator itor = mDatablocks.begin();
+            HlmsDatablockMap::const_iterator end  = mDatablocks.end();
+            while( itor != end )
             {
-                setProperty( InkProperty::PcfIterations, 1 );
+                itor->second.datablock->flushRenderables();
+                ++itor;
             }
         }
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::setTrackCoOccurrence( bool track )
+    {
+        mTrackCoOccurrence = track;
+        mLastDrawnDatablock = 0;
+    }
+    //-----------------------------------------------------------------------------------
+    size_t HlmsInk::repackPools( const vector<HlmsInkDatablock*>::type &datablocks )
+    {
+        //Get pending uploads out of the way; every moved datablock is uploaded again below.
+        uploadDirtyDatablocks();
 
-        mTargetEnvMap.setNull();
-
-        AmbientLightMode ambientMode = mAmbientLightMode;
-        ColourValue upperHemisphere = sceneManager->getAmbientLightUpperHemisphere();
-        ColourValue lowerHemisphere = sceneManager->getAmbientLightLowerHemisphere();
+        vector<HlmsInkDatablock*>::type moved;
+        vector<const BufferPool*>::type oldPools;
+        moved.reserve( datablocks.size() );
+        oldPools.reserve( datablocks.size() );
 
-        const float envMapScale = upperHemisphere.a;
-        //Ignore alpha channel
-        upperHemisphere.a = lowerHemisphere.a = 1.0;
+        vector<HlmsInkDatablock*>::type::const_iterator itor = datablocks.begin();
+        vector<HlmsInkDatablock*>::type::const_iterator end  = datablocks.end();
 
-        if( !casterPass )
+        while( itor != end )
         {
-            if( mAmbientLightMode == AmbientAuto )
+            HlmsInkDatablock *datablock = *itor;
+            const BufferPool *pool = datablock->getAssignedPool();
+            if( pool && !datablock->getCubemapProbe() )
             {
-                if( upperHemisphere == lowerHemisphere )
-                {
-                    if( upperHemisphere == ColourValue::Black )
-                        ambientMode = AmbientNone;
-                    else
-                        ambientMode = AmbientFixed;
-                }
-                else
-                {
-                    ambientMode = AmbientHemisphere;
-                }
+                moved.push_back( datablock );
+                oldPools.push_back( pool );
+                releaseSlot( datablock );
             }
+            ++itor;
+        }
 
-            if( ambientMode == AmbientFixed )
-                setProperty( InkProperty::AmbientFixed, 1 );
-            if( ambientMode == AmbientHemisphere )
-                setProperty( InkProperty::AmbientHemisphere, 1 );
+        size_t numChangedPools = 0;
 
-            if( envMapScale != 1.0f )
-                setProperty( InkProperty::EnvMapScale, 1 );
+        for( size_t i=0; i<moved.size(); ++i )
+        {
+            HlmsInkDatablock *datablock = moved[i];
+            requestSlot( 0, datablock, false );
 
-            //Save cubemap's name so that we never try to render & sample to/from it at the same time
-            const CompositorTexture &compoTarget = sceneManager->getCompositorTarget();
-            if( !compoTarget.textures->empty() )
-            {
-                const TexturePtr &firstTargetTex = (*compoTarget.textures)[0];
-                if( firstTargetTex->getTextureType() == TEX_TYPE_CUBE_MAP )
-                {
-                    setProperty( InkProperty::TargetEnvprobeMap,
-                                 static_cast<int32>( IdString(firstTargetTex->getName()).mHash ) );
-                    mTargetEnvMap = firstTargetTex;
-                }
-            }
-
-            if( mParallaxCorrectedCubemap )
-                setProperty( InkProperty::ParallaxCorrectCubemaps, 1 );
+            if( datablock->getAssignedPool() != oldPools[i] )
+                ++numChangedPools;
 
-            if( mIrradianceVolume )
-                setProperty( InkProperty::IrradianceVolumes, 1 );
+            //The pool index is part of the texture hash.
+            datablock->calculateHash();
+            scheduleForUpdate( datablock );
         }
 
-        if( mOptimizationStrategy == LowerGpuOverhead )
-            setProperty( InkProperty::LowerGpuOverhead, 1 );
-
-        HlmsCache retVal = Hlms::preparePassHashBase( shadowNode, casterPass,
-                                                      dualParaboloid, sceneManager );
-
-        RenderTarget *renderTarget = sceneManager->getCurrentViewport()->getTarget();
-
-        const RenderSystemCapabilities *capabilities = mRenderSystem->getCapabilities();
-        setProperty( InkProperty::HwGammaRead, capabilities->hasCapability( RSC_HW_GAMMA ) );
-        setProperty( InkProperty::HwGammaWrite, capabilities->hasCapability( RSC_HW_GAMMA ) &&
-                                                        renderTarget->isHardwareGammaEnabled() );
-        setProperty( InkProperty::SignedIntTex, capabilities->hasCapability(
-                                                            RSC_TEXTURE_SIGNED_INT ) );
-        retVal.setProperties = mSetProperties;
-
-        Camera *camera = sceneManager->getCameraInProgress();
-        Matrix4 viewMatrix = camera->getViewMatrix(true);
+        mLastBoundPool = 0;
+        mLastTextureHash = 0;
 
-        Matrix4 projectionMatrix = camera->getProjectionMatrixWithRSDepth();
+        return numChangedPools;
+    }
+    //-----------------------------------------------------------------------------------
+    size_t HlmsInk::repackPoolsFromCoOccurrence(void)
+    {
+        //Live datablocks, which are the only mCoOccurrence keys that may be dereferenced.
+        vector<HlmsInkDatablock*>::type datablocks;
+        datablocks.reserve( mDatablocks.size() );
 
-        if( renderTarget->requiresTextureFlipping() )
+        HlmsDatablockMap::const_iterator itDatablock = mDatablocks.begin();
+        HlmsDatablockMap::const_iterator enDatablock = mDatablocks.end();
+        while( itDatablock != enDatablock )
         {
-            projectionMatrix[1][0] = -projectionMatrix[1][0];
-            projectionMatrix[1][1] = -projectionMatrix[1][1];
-            projectionMatrix[1][2] = -projectionMatrix[1][2];
-            projectionMatrix[1][3] = -projectionMatrix[1][3];
+            datablocks.push_back( static_cast<HlmsInkDatablock*>( itDatablock->second.datablock ) );
+            ++itDatablock;
         }
 
-        int32 numLights             = getProperty( HlmsBaseProp::LightsSpot );
-        int32 numDirectionalLights  = getProperty( HlmsBaseProp::LightsDirNonCaster );
-        int32 numShadowMaps         = getProperty( HlmsBaseProp::NumShadowMaps );
-        int32 numPssmSplits         = getProperty( HlmsBaseProp::PssmSplits );
+        std::sort( datablocks.begin(), datablocks.end() );
 
-        //mat4 viewProj;
-        size_t mapSize = 16 * 4;
+        //Union-find over datablocks, merging the most frequent pairs first
+        //while groups still fit in a single pool.
+        vector<size_t>::type parent( datablocks.size() );
+        vector<size_t>::type groupSize( datablocks.size(), 1u );
+        for( size_t i=0; i<parent.size(); ++i )
+            parent[i] = i;
 
-        mGridBuffer             = 0;
-        mGlobalLightListBuffer  = 0;
+        typedef std::pair<uint32, std::pair<size_t, size_t> > WeightedPair;
+        vector<WeightedPair>::type pairs;
+        pairs.reserve( mCoOccurrence.size() );
 
-        if( !casterPass )
+        CoOccurrenceMap::const_iterator itor = mCoOccurrence.begin();
+        CoOccurrenceMap::const_iterator end  = mCoOccurrence.end();
+        while( itor != end )
         {
-            ForwardPlusBase *forwardPlus = sceneManager->_getActivePassForwardPlus();
-            if( forwardPlus )
+            vector<HlmsInkDatablock*>::type::const_iterator itA =
+                    std::lower_bound( datablocks.begin(), datablocks.end(), itor->first.first );
+            vector<HlmsInkDatablock*>::type::const_iterator itB =
+                    std::lower_bound( datablocks.begin(), datablocks.end(), itor->first.second );
+
+            if( itA != datablocks.end() && *itA == itor->first.first &&
+                itB != datablocks.end() && *itB == itor->first.second )
             {
-                mapSize += forwardPlus->getConstBufferSize();
-                mGridBuffer             = forwardPlus->getGridBuffer( camera );
-                mGlobalLightListBuffer  = forwardPlus->getGlobalLightListBuffer( camera );
+                pairs.push_back( WeightedPair( itor->second,
+                                               std::pair<size_t, size_t>(
+                                                   itA - datablocks.begin(),
+                                                   itB - datablocks.begin() ) ) );
             }
+            ++itor;
+        }
 
-            if( mParallaxCorrectedCubemap )
+        std::sort( pairs.begin(), pairs.end(), std::greater<WeightedPair>() );
+
+        for( size_t i=0; i<pairs.size(); ++i )
+        {
+            size_t a = pairs[i].second.first;
+            size_t b = pairs[i].second.second;
+            while( parent[a] != a )
+                a = parent[a] = parent[parent[a]];
+            while( parent[b] != b )
+                b = parent[b] = parent[parent[b]];
+
+            if( a != b && groupSize[a] + groupSize[b] <= mSlotsPerPool )
             {
-                mParallaxCorrectedCubemap->_notifyPreparePassHash( viewMatrix );
-                mapSize += mParallaxCorrectedCubemap->getConstBufferSize();
+                if( groupSize[a] < groupSize[b] )
+                    std::swap( a, b );
+                parent[b] = a;
+                groupSize[a] += groupSize[b];
             }
+        }
 
-            //mat4 view + mat4 shadowRcv[numShadowMaps].texViewProj +
-            //              vec2 shadowRcv[numShadowMaps].shadowDepthRange +
-            //              vec2 padding +
-            //              vec4 shadowRcv[numShadowMaps].invShadowMapSize +
-            //mat3 invViewMatCubemap (upgraded to three vec4)
-            mapSize += ( 16 + (16 + 2 + 2 + 4) * numShadowMaps + 4 * 3 ) * 4;
+        //Biggest groups first so they get whole pools; members of a group stay adjacent.
+        typedef std::pair<size_t, size_t> GroupKey; //(-size, root)
+        vector< std::pair<GroupKey, HlmsInkDatablock*> >::type order;
+        order.reserve( datablocks.size() );
+        for( size_t i=0; i<datablocks.size(); ++i )
+        {
+            size_t root = i;
+            while( parent[root] != root )
+                root = parent[root];
+            order.push_back( std::make_pair( GroupKey( datablocks.size() - groupSize[root], root ),
+                                             datablocks[i] ) );
+        }
 
-            //vec3 ambientUpperHemi + float envMapScale
-            if( ambientMode == AmbientFixed || ambientMode == AmbientHemisphere || envMapScale != 1.0f )
-                mapSize += 4 * 4;
+        std::sort( order.begin(), order.end() );
 
-            //vec3 ambientLowerHemi + padding + vec3 ambientHemisphereDir + padding
-            if( ambientMode == AmbientHemisphere )
-                mapSize += 8 * 4;
+        for( size_t i=0; i<order.size(); ++i )
+            datablocks[i] = order[i].second;
 
-            //vec3 irradianceOrigin + float maxPower +
-            //vec3 irradianceSize + float invHeight + mat4 invView
-            if( mIrradianceVolume )
-                mapSize += (4 + 4 + 4*4) * 4;
+        return repackPools( datablocks );
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::countTextureArrays( size_t &outNumArrays, size_t &outNumTextureHashes ) const
+    {
+        set<const Texture*>::type arrays;
+        set<uint32>::type textureHashes;
 
-            //float pssmSplitPoints N times.
-            mapSize += numPssmSplits * 4;
-            mapSize = alignToNextMultiple( mapSize, 16 );
+        HlmsDatablockMap::const_iterator itor = mDatablocks.begin();
+        HlmsDatablockMap::const_iterator end  = mDatablocks.end();
+        while( itor != end )
+        {
+            const HlmsInkDatablock *datablock =
+                    static_cast<const HlmsInkDatablock*>( itor->second.datablock );
 
-            if( shadowNode )
+            InkBakedTextureArray::const_iterator itTex = datablock->mBakedTextures.begin();
+            InkBakedTextureArray::const_iterator enTex = datablock->mBakedTextures.end();
+            while( itTex != enTex )
             {
-                //Six variables * 4 (padded vec3) * 4 (bytes) * numLights
-                mapSize += ( 6 * 4 * 4 ) * numLights;
+                arrays.insert( itTex->texture.get() );
+                ++itTex;
             }
-            else
+
+            //Dead detail maps aren't baked, but still hold their array alive.
+            for( size_t i=INK_DETAIL_WEIGHT; i<=INK_DETAIL3_NM; ++i )
             {
-                //Three variables * 4 (padded vec3) * 4 (bytes) * numDirectionalLights
-                mapSize += ( 3 * 4 * 4 ) * numDirectionalLights;
+                const TexturePtr &deadTexture = datablock->mDeadDetailTextures[i - INK_DETAIL_WEIGHT];
+                if( !deadTexture.isNull() )
+                    arrays.insert( deadTexture.get() );
             }
-        }
-        else
-        {
-            mapSize += (2 + 2) * 4;
-        }
 
-        mapSize += mListener->getPassBufferSize( shadowNode, casterPass, dualParaboloid,
-                                                 sceneManager );
+            textureHashes.insert( datablock->mTextureHash );
+            ++itor;
+        }
 
-        //Arbitrary 16kb (minimum supported by GL), should be enough.
-        const size_t maxBufferSize = 16 * 1024;
+        outNumArrays        = arrays.size();
+        outNumTextureHashes = textureHashes.size();
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::consolidateTextureArrays( TextureConsolidationReport &outReport )
+    {
+        HlmsTextureManager *textureManager = mHlmsManager->getTextureManager();
 
-        assert( mapSize <= maxBufferSize );
+        countTextureArrays( outReport.numArraysBefore, outReport.numTextureHashesBefore );
 
-        if( mCurrentPassBuffer >= mPassBuffers.size() )
+        //Visit datablocks in pool order, so materials likely drawn together
+        //(see repackPools) get their textures loaded next to each other.
+        vector<HlmsInkDatablock*>::type datablocks;
+        datablocks.reserve( mDatablocks.size() );
         {
-            mPassBuffers.push_back( mVaoManager->createConstBuffer( maxBufferSize, BT_DYNAMIC_PERSISTENT,
-                                                                    0, false ) );
+            HlmsDatablockMap::const_iterator itor = mDatablocks.begin();
+            HlmsDatablockMap::const_iterator end  = mDatablocks.end();
+            while( itor != end )
+            {
+                datablocks.push_back( static_cast<HlmsInkDatablock*>( itor->second.datablock ) );
+                ++itor;
+            }
         }
+        std::sort( datablocks.begin(), datablocks.end(), OrderConstBufferPoolUserByPoolThenSlot() );
 
-        ConstBufferPacked *passBuffer = mPassBuffers[mCurrentPassBuffer++];
-        float *passBufferPtr = reinterpret_cast<float*>( passBuffer->map( 0, mapSize ) );
+        vector<InkManagedTextureSlot>::type slots;
+        vector<InkManagedTexture>::type textures;
+        map<String, size_t>::type aliasToIdx;
+        set<String>::type skippedAliases;
 
-#ifndef NDEBUG
-        const float *startupPtr = passBufferPtr;
-#endif
+        vector<HlmsInkDatablock*>::type::const_iterator itor = datablocks.begin();
+        vector<HlmsInkDatablock*>::type::const_iterator end  = datablocks.end();
+        while( itor != end )
+        {
+            HlmsInkDatablock *datablock = *itor;
 
-        //---------------------------------------------------------------------------
-        //                          ---- VERTEX SHADER ----
-        //---------------------------------------------------------------------------
+            for( size_t i=0; i<NUM_INK_TEXTURE_TYPES; ++i )
+            {
+                const InkTextureTypes texType = static_cast<InkTextureTypes>( i );
+
+                //Includes dead detail maps: their slices move too, and they must point
+                //to the new ones in case they come back to life.
+                const TexturePtr texture = datablock->getTexture( texType );
+                if( texture.isNull() )
+                    continue;
+
+                HlmsTextureManager::TextureLocation texLocation;
+                texLocation.texture = texture;
+                texLocation.xIdx    = datablock->mTexIndices[i];
+                texLocation.yIdx    = 0;
+                texLocation.divisor = 1;
+
+                const String *aliasName = textureManager->findAliasName( texLocation );
+                if( !aliasName )
+                    continue; //Not from the HlmsTextureManager.
+
+                map<String, size_t>::type::const_iterator itAlias = aliasToIdx.find( *aliasName );
+                if( itAlias == aliasToIdx.end() )
+                {
+                    //Loaded by someone else, who may still be using the slice.
+                    TextureMapTypeMap::const_iterator itMapType =
+                            mLoadedTextureMapTypes.find( *aliasName );
+                    if( itMapType == mLoadedTextureMapTypes.end() )
+                    {
+                        skippedAliases.insert( *aliasName );
+                        continue;
+                    }
 
-        //mat4 viewProj;
-        Matrix4 viewProjMatrix = projectionMatrix * viewMatrix;
-        for( size_t i=0; i<16; ++i )
-            *passBufferPtr++ = (float)viewProjMatrix[0][i];
+                    const String *resourceName = textureManager->findResourceNameFromAlias(
+                                                                                *aliasName );
+                    InkManagedTexture texture;
+                    texture.aliasName       = *aliasName;
+                    texture.resourceName    = resourceName ? *resourceName : *aliasName;
+                    //Load it back the way it was loaded; the slot's type is only a guess
+                    //(i.e. the same texture may be used as diffuse & detail map).
+                    texture.mapType         = itMapType->second;
+                    itAlias = aliasToIdx.insert( std::make_pair( *aliasName,
+                                                                 textures.size() ) ).first;
+                    textures.push_back( texture );
+                }
 
-        mPreparedPass.viewMatrix        = viewMatrix;
+                InkManagedTextureSlot slot;
+                slot.datablock  = datablock;
+                slot.texType    = texType;
+                slot.aliasIdx   = itAlias->second;
+                slots.push_back( slot );
+            }
 
-        mPreparedPass.shadowMaps.clear();
+            ++itor;
+        }
 
-        if( !casterPass )
+        //Free every slice first so the arrays can be refilled densely. The datablocks
+        //keep their TexturePtrs alive until they're pointed at the new locations.
+        vector<InkManagedTexture>::type::const_iterator itTex = textures.begin();
+        vector<InkManagedTexture>::type::const_iterator enTex = textures.end();
+        while( itTex != enTex )
         {
-            //mat4 view;
-            for( size_t i=0; i<16; ++i )
-                *passBufferPtr++ = (float)viewMatrix[0][i];
+            textureManager->destroyTexture( itTex->aliasName );
+            ++itTex;
+        }
+
+        vector<HlmsTextureManager::TextureLocation>::type newLocations;
+        newLocations.reserve( textures.size() );
+        itTex = textures.begin();
+        while( itTex != enTex )
+        {
+            newLocations.push_back( textureManager->createOrRetrieveTexture(
+                                        itTex->aliasName, itTex->resourceName, itTex->mapType ) );
+            ++itTex;
+        }
 
-            for( int32 i=0; i<numShadowMaps; ++i )
+        //Point the datablocks at the new slices; rebake & rehash once per datablock.
+        HlmsInkDatablock *lastDatablock = 0;
+        vector<InkManagedTextureSlot>::type::const_iterator itSlot = slots.begin();
+        vector<InkManagedTextureSlot>::type::const_iterator enSlot = slots.end();
+        while( itSlot != enSlot )
+        {
+            if( itSlot->datablock != lastDatablock )
             {
-                //mat4 shadowRcv[numShadowMaps].texViewProj
-                Matrix4 viewProjTex = shadowNode->getViewProjectionMatrix( i );
-                for( size_t j=0; j<16; ++j )
-                    *passBufferPtr++ = (float)viewProjTex[0][j];
+                if( lastDatablock )
+                    lastDatablock->endUpdate();
+                lastDatablock = itSlot->datablock;
+                lastDatablock->beginUpdate();
+            }
 
-                //vec2 shadowRcv[numShadowMaps].shadowDepthRange
-                Real fNear, fFar;
-                shadowNode->getMinMaxDepthRange( i, fNear, fFar );
-                const Real depthRange = fFar - fNear;
-                *passBufferPtr++ = fNear;
-                *passBufferPtr++ = 1.0f / depthRange;
-                ++passBufferPtr; //Padding
-                ++passBufferPtr; //Padding
+            const HlmsTextureManager::TextureLocation &texLocation = newLocations[itSlot->aliasIdx];
+            itSlot->datablock->setTexture( itSlot->texType, texLocation.xIdx, texLocation.texture );
 
+            ++itSlot;
+        }
 
-                //vec2 shadowRcv[numShadowMaps].invShadowMapSize
-                //TODO: textures[0] is out of bounds when using shadow atlas. Also see how what
-                //changes need to be done so that UV calculations land on the right place
-                uint32 texWidth  = shadowNode->getLocalTextures()[i].textures[0]->getWidth();
-                uint32 texHeight = shadowNode->getLocalTextures()[i].textures[0]->getHeight();
-                *passBufferPtr++ = 1.0f / texWidth;
-                *passBufferPtr++ = 1.0f / texHeight;
-                *passBufferPtr++ = static_cast<float>( texWidth );
-                *passBufferPtr++ = static_cast<float>( texHeight );
-            }
+        if( lastDatablock )
+            lastDatablock->endUpdate();
 
-            //---------------------------------------------------------------------------
-            //                          ---- PIXEL SHADER ----
-            //---------------------------------------------------------------------------
+        mLastTextureHash = 0;
 
-            Matrix3 viewMatrix3, invViewMatrixCubemap;
-            viewMatrix.extract3x3Matrix( viewMatrix3 );
-            //Cubemaps are left-handed.
-            invViewMatrixCubemap = viewMatrix3;
-            invViewMatrixCubemap[0][2] = -invViewMatrixCubemap[0][2];
-            invViewMatrixCubemap[1][2] = -invViewMatrixCubemap[1][2];
-            invViewMatrixCubemap[2][2] = -invViewMatrixCubemap[2][2];
-            invViewMatrixCubemap = invViewMatrixCubemap.Inverse();
+        outReport.numTexturesReloaded = textures.size();
+        outReport.skippedAliases.assign( skippedAliases.begin(), skippedAliases.end() );
+        countTextureArrays( outReport.numArraysAfter, outReport.numTextureHashesAfter );
+    }
+    //-----------------------------------------------------------------------------------
+    HlmsTextureManager::TextureLocation HlmsInk::_createOrRetrieveTexture(
+            const String &aliasName, HlmsTextureManager::TextureMapType mapType )
+    {
+        HlmsTextureManager *textureManager = mHlmsManager->getTextureManager();
 
-            //mat3 invViewMatCubemap
-            for( size_t i=0; i<9; ++i )
-            {
-#ifdef OGRE_GLES2_WORKAROUND_2
-                Matrix3 xRot( 1.0f, 0.0f, 0.0f,
-                              0.0f, 0.0f, -1.0f,
-                              0.0f, 1.0f, 0.0f );
-                xRot = xRot * invViewMatrixCubemap;
-                *passBufferPtr++ = (float)xRot[0][i];
-#else
-                *passBufferPtr++ = (float)invViewMatrixCubemap[0][i];
-#endif
+        const bool alreadyLoaded = textureManager->findResourceNameFromAlias( aliasName ) != 0;
 
-                //Alignment: each row/column is one vec4, despite being 3x3
-                if( !( (i+1) % 3 ) )
-                    ++passBufferPtr;
-            }
+        HlmsTextureManager::TextureLocation retVal =
+                textureManager->createOrRetrieveTexture( aliasName, mapType );
 
-            //vec3 ambientUpperHemi + padding
-            if( ambientMode == AmbientFixed || ambientMode == AmbientHemisphere || envMapScale != 1.0f )
-            {
-                *passBufferPtr++ = static_cast<float>( upperHemisphere.r );
-                *passBufferPtr++ = static_cast<float>( upperHemisphere.g );
-                *passBufferPtr++ = static_cast<float>( upperHemisphere.b );
-                *passBufferPtr++ = envMapScale;
-            }
+        if( !alreadyLoaded && retVal.texture != textureManager->getBlankTexture().texture )
+            mLoadedTextureMapTypes[aliasName] = mapType;
 
-            //vec3 ambientLowerHemi + padding + vec3 ambientHemisphereDir + padding
-            if( ambientMode == AmbientHemisphere )
-            {
-                *passBufferPtr++ = static_cast<float>( lowerHemisphere.r );
-                *passBufferPtr++ = static_cast<float>( lowerHemisphere.g );
-                *passBufferPtr++ = static_cast<float>( lowerHemisphere.b );
-                *passBufferPtr++ = 1.0f;
+        return retVal;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::createMaterialLods( HlmsInkDatablock *datablock, const vector<Real>::type &distances )
+    {
+        assert( !datablock->mLodParent && "Can't create LODs of a LOD variant" );
 
-                Vector3 hemisphereDir = viewMatrix3 * sceneManager->getAmbientLightHemisphereDir();
-                hemisphereDir.normalise();
-                *passBufferPtr++ = static_cast<float>( hemisphereDir.x );
-                *passBufferPtr++ = static_cast<float>( hemisphereDir.y );
-                *passBufferPtr++ = static_cast<float>( hemisphereDir.z );
-                *passBufferPtr++ = 1.0f;
-            }
+        destroyMaterialLods( datablock );
 
-            if( mIrradianceVolume )
+        for( size_t lod=1; lod<=distances.size(); ++lod )
+        {
+            const String lodName = *datablock->getFullName() + "/Lod" +
+                                   StringConverter::toString( lod );
+
+            HlmsInkDatablock *variant = static_cast<HlmsInkDatablock*>(
+                        createDatablock( lodName, lodName, *datablock->getMacroblock(),
+                                         *datablock->getBlendblock(), HlmsParamVec() ) );
+
+            variant->beginUpdate();
+
+            variant->setMacroblock( *datablock->getMacroblock( true ), true );
+            variant->setBlendblock( *datablock->getBlendblock( true ), true );
+            variant->setAlphaTest( datablock->getAlphaTest() );
+            variant->setAlphaTestThreshold( datablock->getAlphaTestThreshold() );
+            variant->mShadowConstantBias = datablock->mShadowConstantBias;
+
+            variant->setDryness( datablock->getDryness() );
+            variant->setDensity( datablock->getDensity() );
+
+            memcpy( variant->mUvSource, datablock->mUvSource, sizeof( variant->mUvSource ) );
+            memcpy( variant->mBlendModes, datablock->mBlendModes, sizeof( variant->mBlendModes ) );
+            variant->mFresnelTypeSizeBytes  = datablock->mFresnelTypeSizeBytes;
+            variant->mTwoSided              = datablock->mTwoSided;
+            variant->mUseAlphaFromTextures  = datablock->mUseAlphaFromTextures;
+            variant->mWorkflow              = datablock->mWorkflow;
+            variant->mTransparencyMode      = datablock->mTransparencyMode;
+            //Everything that goes to the GPU, from mBgDiffuse to mNormalMapWeight.
+            memcpy( &variant->mBgDiffuse[0], &datablock->mBgDiffuse[0],
+                    HlmsInkDatablock::MaterialSizeInGpu );
+
+            uint32 brdf = datablock->mBrdf;
+            if( (brdf & InkBrdf::BRDF_MASK) == InkBrdf::Default )
+                brdf |= InkBrdf::FLAG_UNCORRELATED;
+            variant->setBrdf( static_cast<InkBrdf::InkBrdf>( brdf ) );
+
+            for( size_t i=0; i<NUM_INK_TEXTURE_TYPES; ++i )
             {
-                const Vector3 irradianceCellSize = mIrradianceVolume->getIrradianceCellSize();
-                const Vector3 irradianceVolumeOrigin = mIrradianceVolume->getIrradianceOrigin() /
-                                                       irradianceCellSize;
-                const float fTexWidth = static_cast<float>(
-                            mIrradianceVolume->getIrradianceVolumeTexture()->getWidth() );
-                const float fTexDepth = static_cast<float>(
-                            mIrradianceVolume->getIrradianceVolumeTexture()->getDepth() );
-
-                *passBufferPtr++ = static_cast<float>( irradianceVolumeOrigin.x ) / fTexWidth;
-                *passBufferPtr++ = static_cast<float>( irradianceVolumeOrigin.y );
-                *passBufferPtr++ = static_cast<float>( irradianceVolumeOrigin.z ) / fTexDepth;
-                *passBufferPtr++ = mIrradianceVolume->getIrradianceMaxPower() *
-                                   mIrradianceVolume->getPowerScale();
-
-                const float fTexHeight = static_cast<float>(
-                            mIrradianceVolume->getIrradianceVolumeTexture()->getHeight() );
-
-                *passBufferPtr++ = 1.0f / (fTexWidth * irradianceCellSize.x);
-                *passBufferPtr++ = 1.0f / irradianceCellSize.y;
-                *passBufferPtr++ = 1.0f / (fTexDepth * irradianceCellSize.z);
-                *passBufferPtr++ = 1.0f / fTexHeight;
-
-                //mat4 invView;
-                Matrix4 invViewMatrix = viewMatrix.inverse();
-                for( size_t i=0; i<16; ++i )
-                    *passBufferPtr++ = (float)invViewMatrix[0][i];
+                const InkTextureTypes texType = static_cast<InkTextureTypes>( i );
+
+                bool keep = !(texType >= INK_DETAIL0_NM && texType <= INK_DETAIL3_NM);
+                if( lod >= 2u )
+                {
+                    keep &= !(texType >= INK_DETAIL0 && texType <= INK_DETAIL3) &&
+                            texType != INK_DETAIL_WEIGHT && texType != INK_NORMAL &&
+                            texType != INK_REFLECTION;
+                }
+
+                TexturePtr texture = datablock->getTexture( texType );
+                if( keep && !texture.isNull() )
+                {
+                    variant->setTexture( texType, datablock->mTexIndices[i], texture,
+                                         datablock->mSamplerblocks[i] );
+                }
             }
 
-            //float pssmSplitPoints
-            for( int32 i=0; i<numPssmSplits; ++i )
-                *passBufferPtr++ = (*shadowNode->getPssmSplits(0))[i+1];
+            variant->scheduleConstBufferUpdate();
+            variant->endUpdate();
 
-            passBufferPtr += alignToNextMultiple( numPssmSplits, 4 ) - numPssmSplits;
+            variant->mLodParent = datablock;
+            datablock->mLodVariants.push_back( variant );
+            datablock->mLodSquaredDistances.push_back( distances[lod - 1u] * distances[lod - 1u] );
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::destroyMaterialLods( HlmsInkDatablock *datablock )
+    {
+        while( !datablock->mLodVariants.empty() )
+        {
+            HlmsInkDatablock *variant = datablock->mLodVariants.back();
 
-            if( shadowNode )
-            {
-                //All directional lights (caster and non-caster) are sent.
-                //Then non-directional shadow-casting shadow lights are sent.
-                size_t shadowLightIdx = 0;
-                size_t nonShadowLightIdx = 0;
-                const LightListInfo &globalLightList = sceneManager->getGlobalLightList();
-                const LightClosestArray &lights = shadowNode->getShadowCastingLights();
+            //Copy: setDatablock unlinks the renderable from the variant.
+            const vector<Renderable*>::type linkedRenderables = variant->getLinkedRenderables();
+            for( size_t i=0; i<linkedRenderables.size(); ++i )
+                linkedRenderables[i]->setDatablock( datablock );
 
-                const CompositorShadowNode::LightsBitSet &affectedLights =
-                        shadowNode->getAffectedLightsBitSet();
+            //The destructor unlinks it from datablock->mLodVariants.
+            destroyDatablock( variant->getName() );
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    bool HlmsInk::updateMaterialLod( Renderable *renderable, Real squaredDistance )
+    {
+        assert( dynamic_cast<HlmsInkDatablock*>( renderable->getDatablock() ) );
+        HlmsInkDatablock *current = static_cast<HlmsInkDatablock*>( renderable->getDatablock() );
+        HlmsInkDatablock *base = current->mLodParent ? current->mLodParent : current;
 
-                int32 shadowCastingDirLights = getProperty( HlmsBaseProp::LightsDirectional );
+        HlmsInkDatablock *target = base;
+        for( size_t i=0; i<base->mLodSquaredDistances.size() &&
+                         squaredDistance >= base->mLodSquaredDistances[i]; ++i )
+        {
+            target = base->mLodVariants[i];
+        }
 
-                for( int32 i=0; i<numLights; ++i )
-                {
-                    Light const *light = 0;
+        if( target == current )
+            return false;
 
-                    if( i >= shadowCastingDirLights && i < numDirectionalLights )
-                    {
-                        while( affectedLights[nonShadowLightIdx] )
-                            ++nonShadowLightIdx;
+        renderable->setDatablock( target );
+        return true;
+    }
+    //-----------------------------------------------------------------------------------
+    bool HlmsInk::updateMaterialLod( Renderable *renderable, const MovableObject *movableObject,
+                                     const Camera *camera )
+    {
+        const Vector3 &objPos = movableObject->getParentNode()->_getDerivedPosition();
+        const Real lodBias = camera->getLodBias();
+        const Real squaredDistance = camera->getDerivedPosition().squaredDistance( objPos ) /
+                                     (lodBias * lodBias);
+        return updateMaterialLod( renderable, squaredDistance );
+    }
+    //-----------------------------------------------------------------------------------
+    size_t HlmsInk::warmUp( const WarmUpManifest &manifest, size_t maxPermutations )
+    {
+        const size_t numShadersBefore = mShaderCache.size();
 
-                        light = globalLightList.lights[nonShadowLightIdx++];
+        //Warming up is the whole point; don't hand out fallbacks.
+        const bool asyncCompilation = mAsyncCompilation;
+        mAsyncCompilation = false;
 
-                        assert( light->getType() == Light::LT_DIRECTIONAL );
-                    }
-                    else
-                    {
-                        light = lights[shadowLightIdx++].light;
-                    }
+        size_t numRequests = 0;
 
-                    Vector4 lightPos4 = light->getAs4DVector();
-                    Vector3 lightPos;
+        HlmsPassCacheVec::const_iterator itPass = manifest.passes.begin();
+        HlmsPassCacheVec::const_iterator enPass = manifest.passes.end();
 
-                    if( light->getType() == Light::LT_DIRECTIONAL )
-                        lightPos = viewMatrix3 * Vector3( lightPos4.x, lightPos4.y, lightPos4.z );
-                    else
-                        lightPos = viewMatrix * Vector3( lightPos4.x, lightPos4.y, lightPos4.z );
-
-                    //vec3 lights[numLights].position
-                    *passBufferPtr++ = lightPos.x;
-                    *passBufferPtr++ = lightPos.y;
-                    *passBufferPtr++ = lightPos.z;
-                    ++passBufferPtr;
-
-                    //vec3 lights[numLights].diffuse
-                    ColourValue colour = light->getDiffuseColour() *
-                                         light->getPowerScale();
-                    *passBufferPtr++ = colour.r;
-                    *passBufferPtr++ = colour.g;
-                    *passBufferPtr++ = colour.b;
-                    ++passBufferPtr;
-
-                    //vec3 lights[numLights].specular
-                    colour = light->getSpecularColour() * light->getPowerScale();
-                    *passBufferPtr++ = colour.r;
-                    *passBufferPtr++ = colour.g;
-                    *passBufferPtr++ = colour.b;
-                    ++passBufferPtr;
-
-                    //vec3 lights[numLights].attenuation;
-                    Real attenRange     = light->getAttenuationRange();
-                    Real attenLinear    = light->getAttenuationLinear();
-                    Real attenQuadratic = light->getAttenuationQuadric();
-                    *passBufferPtr++ = attenRange;
-                    *passBufferPtr++ = attenLinear;
-                    *passBufferPtr++ = attenQuadratic;
-                    ++passBufferPtr;
-
-                    //vec3 lights[numLights].spotDirection;
-                    Vector3 spotDir = viewMatrix3 * light->getDerivedDirection();
-                    *passBufferPtr++ = spotDir.x;
-                    *passBufferPtr++ = spotDir.y;
-                    *passBufferPtr++ = spotDir.z;
-                    ++passBufferPtr;
-
-                    //vec3 lights[numLights].spotParams;
-                    Radian innerAngle = light->getSpotlightInnerAngle();
-                    Radian outerAngle = light->getSpotlightOuterAngle();
-                    *passBufferPtr++ = 1.0f / ( cosf( innerAngle.valueRadians() * 0.5f ) -
-                                             cosf( outerAngle.valueRadians() * 0.5f ) );
-                    *passBufferPtr++ = cosf( outerAngle.valueRadians() * 0.5f );
-                    *passBufferPtr++ = light->getSpotlightFalloff();
-                    ++passBufferPtr;
-                }
+        while( itPass != enPass && numRequests < maxPermutations )
+        {
+            const HlmsCache &passCache = *itPass;
 
-                mPreparedPass.shadowMaps.reserve( numShadowMaps );
-                for( int32 i=0; i<numShadowMaps; ++i )
-                    mPreparedPass.shadowMaps.push_back( shadowNode->getLocalTextures()[i].textures[0] );
-            }
-            else
+            if( passCache.type == mType )
             {
-                //No shadow maps, only send directional lights
-                const LightListInfo &globalLightList = sceneManager->getGlobalLightList();
+                const bool casterPass = getProperty( passCache.setProperties,
+                                                     HlmsBaseProp::ShadowCaster ) != 0;
 
-                for( int32 i=0; i<numDirectionalLights; ++i )
+                QueuedRenderableArray::const_iterator itor = manifest.renderables.begin();
+                QueuedRenderableArray::const_iterator end  = manifest.renderables.end();
+
+                while( itor != end && numRequests < maxPermutations )
                 {
-                    assert( globalLightList.lights[i]->getType() == Light::LT_DIRECTIONAL );
-
-                    Vector4 lightPos4 = globalLightList.lights[i]->getAs4DVector();
-                    Vector3 lightPos = viewMatrix3 * Vector3( lightPos4.x, lightPos4.y, lightPos4.z );
-
-                    //vec3 lights[numLights].position
-                    *passBufferPtr++ = lightPos.x;
-                    *passBufferPtr++ = lightPos.y;
-                    *passBufferPtr++ = lightPos.z;
-                    ++passBufferPtr;
-
-                    //vec3 lights[numLights].diffuse
-                    ColourValue colour = globalLightList.lights[i]->getDiffuseColour() *
-                                         globalLightList.lights[i]->getPowerScale();
-                    *passBufferPtr++ = colour.r;
-                    *passBufferPtr++ = colour.g;
-                    *passBufferPtr++ = colour.b;
-                    ++passBufferPtr;
-
-                    //vec3 lights[numLights].specular
-                    colour = globalLightList.lights[i]->getSpecularColour() * globalLightList.lights[i]->getPowerScale();
-                    *passBufferPtr++ = colour.r;
-                    *passBufferPtr++ = colour.g;
-                    *passBufferPtr++ = colour.b;
-                    ++passBufferPtr;
+                    const HlmsDatablock *datablock = itor->renderable->getDatablock();
+
+                    if( datablock->getCreator() == this )
+                    {
+                        //Same entry point as the RenderQueue; already created
+                        //permutations are just a lookup.
+                        getMaterial( 0, passCache, *itor, casterPass );
+                        ++numRequests;
+                    }
+
+                    ++itor;
                 }
             }
 
-            ForwardPlusBase *forwardPlus = sceneManager->_getActivePassForwardPlus();
-            if( forwardPlus )
-            {
-                forwardPlus->fillConstBufferData( renderTarget, passBufferPtr );
-                passBufferPtr += forwardPlus->getConstBufferSize() >> 2u;
-            }
+            ++itPass;
+        }
 
-            if( mParallaxCorrectedCubemap )
+        mAsyncCompilation = asyncCompilation;
+
+        return mShaderCache.size() - numShadersBefore;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::setDiskCache( HlmsInkDiskCache *diskCache )
+    {
+        mDiskCache = diskCache;
+
+        if( mDiskCache )
+            GpuProgramManager::getSingleton().setSaveMicrocodesToCache( true );
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::setDetailMapProperties( HlmsInkDatablock *datablock, PiecesMap *inOutPieces )
+    {
+        uint32 minNormalMap = 4;
+        bool hasDiffuseMaps = false;
+        bool hasNormalMaps = false;
+        bool anyDetailWeight = false;
+        const bool foldOffsets = (mPropertyFolding & FoldDetailOffsets) != 0;
+        const bool foldWeights = (mPropertyFolding & FoldDetailWeights) != 0;
+        for( size_t i=0; i<4; ++i )
+        {
+            uint8 blendMode = datablock->mBlendModes[i];
+
+            setDetailTextureProperty( InkProperty::DetailMapN,   datablock, INK_DETAIL0, i );
+            setDetailTextureProperty( InkProperty::DetailMapNmN, datablock, INK_DETAIL0_NM, i );
+
+            //Detail maps culled by HlmsInkDatablock::isDetailMapDead are not baked,
+            //thus check the baked textures rather than getTexture.
+            const bool hasDetailMap   = datablock->getBakedTextureIdx(
+                        static_cast<InkTextureTypes>( INK_DETAIL0 + i ) ) != NUM_INK_TEXTURE_TYPES;
+            const bool hasDetailNmMap = datablock->getBakedTextureIdx(
+                        static_cast<InkTextureTypes>( INK_DETAIL0_NM + i ) ) != NUM_INK_TEXTURE_TYPES;
+
+            if( hasDetailMap )
             {
-                mParallaxCorrectedCubemap->fillConstBufferData( viewMatrix, passBufferPtr );
-                passBufferPtr += mParallaxCorrectedCubemap->getConstBufferSize() >> 2u;
+                inOutPieces[PixelShader][*InkProperty::BlendModes[i]] =
+                                                "@insertpiece( " + c_pbsBlendModes[blendMode] + ")";
+                hasDiffuseMaps = true;
+            }
+
+            if( hasDetailNmMap )
+            {
+                minNormalMap = std::min<uint32>( minNormalMap, i );
+                hasNormalMaps = true;
+            }
+
+            if( datablock->mDetailsOffsetScale[i] != Vector4( 0, 0, 1, 1 ) ||
+                (foldOffsets && hasDetailMap) )
+            {
+                setProperty( *InkProperty::DetailOffsetsDPtrs[i], 1 );
+            }
+
+            if( datablock->mDetailsOffsetScale[i+4] != Vector4( 0, 0, 1, 1 ) ||
+                (foldOffsets && hasDetailNmMap) )
+            {
+                setProperty( *InkProperty::DetailOffsetsNPtrs[i], 1 );
+            }
+
+            if( (datablock->mDetailWeight[i] != 1.0f || foldWeights) &&
+                (hasDetailMap || hasDetailNmMap) )
+            {
+                anyDetailWeight = true;
+            }
+        }
+
+        if( hasDiffuseMaps )
+            setProperty( InkProperty::DetailMapsDiffuse, 4 );
+
+        if( hasNormalMaps )
+            setProperty( InkProperty::DetailMapsNormal, 4 );
+
+        setProperty( InkProperty::FirstValidDetailMapNm, minNormalMap );
+
+        if( anyDetailWeight )
+            setProperty( InkProperty::DetailWeights, 1 );
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::setTextureProperty( const char *propertyName, HlmsInkDatablock *datablock,
+                                      InkTextureTypes texType )
+    {
+        uint8 idx = datablock->getBakedTextureIdx( texType );
+        if( idx != NUM_INK_TEXTURE_TYPES )
+        {
+            char tmpData[64];
+            LwString propName = LwString::FromEmptyPointer( tmpData, sizeof(tmpData) );
+
+            propName = propertyName; //diffuse_map
+
+            //In the template the we subtract the "+1" for the index.
+            //We need to increment it now otherwise @property( diffuse_map )
+            //can translate to @property( 0 ) which is not what we want.
+            setProperty( propertyName, idx + 1 );
+
+            propName.a( "_idx" ); //diffuse_map_idx
+            setProperty( propName.c_str(), idx );
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::setDetailTextureProperty( const char *propertyName, HlmsInkDatablock *datablock,
+                                            InkTextureTypes baseTexType, uint8 detailIdx )
+    {
+        const InkTextureTypes texType = static_cast<InkTextureTypes>( baseTexType + detailIdx );
+        const uint8 idx = datablock->getBakedTextureIdx( texType );
+        if( idx != NUM_INK_TEXTURE_TYPES )
+        {
+            char tmpData[64];
+            LwString propName = LwString::FromEmptyPointer( tmpData, sizeof(tmpData) );
+
+            propName.a( propertyName, detailIdx ); //detail_map0
+
+            //In the template the we subtract the "+1" for the index.
+            //We need to increment it now otherwise @property( diffuse_map )
+            //can translate to @property( 0 ) which is not what we want.
+            setProperty( propName.c_str(), idx + 1 );
+
+            propName.a( "_idx" ); //detail_map0_idx
+            setProperty( propName.c_str(), idx );
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::calculateHashForPreCreate( Renderable *renderable, PiecesMap *inOutPieces )
+    {
+        assert( dynamic_cast<HlmsInkDatablock*>( renderable->getDatablock() ) );
+        HlmsInkDatablock *datablock = static_cast<HlmsInkDatablock*>(
+                                                        renderable->getDatablock() );
+
+        const bool metallicWorkflow = datablock->getWorkflow() == HlmsInkDatablock::MetallicWorkflow;
+        const bool fresnelWorkflow = datablock->getWorkflow() ==
+                                                        HlmsInkDatablock::SpecularAsFresnelWorkflow;
+
+        setProperty( InkProperty::FresnelScalar, datablock->hasSeparateFresnel() || metallicWorkflow );
+        setProperty( InkProperty::FresnelWorkflow, fresnelWorkflow );
+        setProperty( InkProperty::MetallicWorkflow, metallicWorkflow );
+
+        if( datablock->getTwoSidedLighting() )
+            setProperty( InkProperty::TwoSidedLighting, 1 );
+
+        uint32 brdf = datablock->getBrdf();
+        if( (brdf & InkBrdf::BRDF_MASK) == InkBrdf::Default )
+        {
+            setProperty( InkProperty::BrdfDefault, 1 );
+
+            if( !(brdf & InkBrdf::FLAG_UNCORRELATED) )
+                setProperty( InkProperty::GgxHeightCorrelated, 1 );
+        }
+        else if( (brdf & InkBrdf::BRDF_MASK) == InkBrdf::CookTorrance )
+            setProperty( InkProperty::BrdfCookTorrance, 1 );
+
+        if( brdf & InkBrdf::FLAG_SPERATE_DIFFUSE_FRESNEL )
+            setProperty( InkProperty::FresnelSeparateDiffuse, 1 );
+
+        for( size_t i=0; i<INK_REFLECTION; ++i )
+        {
+            uint8 uvSource = datablock->mUvSource[i];
+            setProperty( *InkProperty::UvSourcePtrs[i], uvSource );
+
+            if( datablock->getBakedTextureIdx( static_cast<InkTextureTypes>( i ) ) !=
+                    NUM_INK_TEXTURE_TYPES &&
+                getProperty( *HlmsBaseProp::UvCountPtrs[uvSource] ) < 2 )
+            {
+                OGRE_EXCEPT( Exception::ERR_INVALID_STATE,
+                             "Renderable needs at least 2 coordinates in UV set #" +
+                             StringConverter::toString( uvSource ) +
+                             ". Either change the mesh, or change the UV source settings",
+                             "HlmsInk::calculateHashForPreCreate" );
+            }
+        }
+
+        const bool foldNormalWeights = (mPropertyFolding & FoldNormalWeights) != 0;
+
+        int numNormalWeights = 0;
+        if( (datablock->getNormalMapWeight() != 1.0f || foldNormalWeights) &&
+            !datablock->getTexture( INK_NORMAL ).isNull() )
+        {
+            setProperty( InkProperty::NormalWeightTex, 1 );
+            ++numNormalWeights;
+        }
+
+        {
+            size_t validDetailMaps = 0;
+            for( size_t i=0; i<4; ++i )
+            {
+                if( datablock->getBakedTextureIdx( static_cast<InkTextureTypes>(
+                                                       INK_DETAIL0_NM + i ) ) != NUM_INK_TEXTURE_TYPES )
+                {
+                    if( datablock->getDetailNormalWeight( i ) != 1.0f || foldNormalWeights )
+                    {
+                        setProperty( *InkProperty::DetailNormalWeights[validDetailMaps], 1 );
+                        ++numNormalWeights;
+                    }
+
+                    ++validDetailMaps;
+                }
+            }
+        }
+
+        setProperty( InkProperty::NormalWeight, numNormalWeights );
+
+        setDetailMapProperties( datablock, inOutPieces );
+
+        bool envMap = datablock->getBakedTextureIdx( INK_REFLECTION ) != NUM_INK_TEXTURE_TYPES;
+
+        setProperty( InkProperty::NumTextures, datablock->mBakedTextures.size() - envMap );
+
+        setTextureProperty( InkProperty::DiffuseMap,    datablock,  INK_DIFFUSE );
+        setTextureProperty( InkProperty::NormalMapTex,  datablock,  INK_NORMAL );
+        setTextureProperty( InkProperty::SpecularMap,   datablock,  INK_SPECULAR );
+        setTextureProperty( InkProperty::RoughnessMap,  datablock,  INK_ROUGHNESS );
+        setTextureProperty( InkProperty::EnvProbeMap,   datablock,  INK_REFLECTION );
+        setTextureProperty( InkProperty::DetailWeightMap,datablock, INK_DETAIL_WEIGHT );
+
+        {
+            //Save the name of the cubemap for hazard prevention
+            //(don't sample the cubemap and render to it at the same time).
+            TexturePtr reflectionTexture = datablock->getTexture( INK_REFLECTION );
+            if( !reflectionTexture.isNull() )
+            {
+                //Manual reflection texture
+                if( datablock->getCubemapProbe() )
+                    setProperty( InkProperty::UseParallaxCorrectCubemaps, 1 );
+                setProperty( InkProperty::EnvProbeMap, static_cast<int32>(
+                             IdString( reflectionTexture->getName() ).mHash ) );
+            }
+        }
+
+        bool usesNormalMap = !datablock->getTexture( INK_NORMAL ).isNull();
+        for( size_t i=INK_DETAIL0_NM; i<=INK_DETAIL3_NM; ++i )
+        {
+            usesNormalMap |= datablock->getBakedTextureIdx( static_cast<InkTextureTypes>( i ) ) !=
+                             NUM_INK_TEXTURE_TYPES;
+        }
+        setProperty( InkProperty::NormalMap, usesNormalMap );
+
+        /*setProperty( HlmsBaseProp::, !datablock->getTexture( INK_DETAIL0 ).isNull() );
+        setProperty( HlmsBaseProp::DiffuseMap, !datablock->getTexture( INK_DETAIL1 ).isNull() );*/
+        bool normalMapCanBeSupported = (getProperty( HlmsBaseProp::Normal ) &&
+                                        getProperty( HlmsBaseProp::Tangent )) ||
+                                        getProperty( HlmsBaseProp::QTangent );
+
+        if( !normalMapCanBeSupported && usesNormalMap )
+        {
+            OGRE_EXCEPT( Exception::ERR_INVALID_STATE,
+                         "Renderable can't use normal maps but datablock wants normal maps. "
+                         "Generate Tangents for this mesh to fix the problem or use a "
+                         "datablock without normal maps.", "HlmsInk::calculateHashForPreCreate" );
+        }
+
+        if( datablock->mUseAlphaFromTextures && datablock->mBlendblock[0]->mIsTransparent &&
+            (getProperty( InkProperty::DiffuseMap ) || getProperty( InkProperty::DetailMapsDiffuse )) )
+        {
+            setProperty( InkProperty::UseTextureAlpha, 1 );
+
+            //When we don't use the alpha in the texture, transparency still works but
+            //only at material level (i.e. what datablock->mTransparency says). The
+            //alpha from the texture will be ignored.
+            if( datablock->mTransparencyMode == HlmsInkDatablock::Transparent )
+                setProperty( InkProperty::TransparentMode, 1 );
+        }
+
+        String slotsPerPoolStr = StringConverter::toString( mSlotsPerPool );
+        inOutPieces[VertexShader][InkProperty::MaterialsPerBuffer] = slotsPerPoolStr;
+		inOutPieces[GeometryShader][InkProperty::MaterialsPerBuffer] = slotsPerPoolStr;
+        inOutPieces[PixelShader][InkProperty::MaterialsPerBuffer] = slotsPerPoolStr;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::calculateHashForPreCaster( Renderable *renderable, PiecesMap *inOutPieces )
+    {
+        HlmsInkDatablock *datablock = static_cast<HlmsInkDatablock*>( renderable->getDatablock() );
+        const bool hasAlphaTest = datablock->getAlphaTest() != CMPF_ALWAYS_PASS;
+
+        if( !hasAlphaTest )
+        {
+            //Without alpha testing only a handful of properties survive, so look them up
+            //directly (mSetProperties is sorted) and reuse the set built for the last
+            //renderable with the same values instead of filtering the whole list.
+            CasterPropertyMemo key;
+            key.presentMask = 0;
+
+            HlmsPropertyVec::const_iterator itor = mSetProperties.begin();
+            HlmsPropertyVec::const_iterator end  = mSetProperties.end();
+
+            for( size_t i=0; i<NumCasterProperties; ++i )
+            {
+                itor = std::lower_bound( itor, end, mCasterProperties[i],
+                                         OrderInkPropertyByIdString() );
+                key.values[i] = 0;
+                if( itor != end && itor->keyName == mCasterProperties[i] )
+                {
+                    key.presentMask |= 1u << i;
+                    if( itor->keyName != InkProperty::FirstValidDetailMapNm )
+                        key.values[i] = itor->value;
+                }
+            }
+
+            CasterPropertyMemoVec::const_iterator itMemo = mCasterPropertyMemo.begin();
+            CasterPropertyMemoVec::const_iterator enMemo = mCasterPropertyMemo.end();
+
+            while( itMemo != enMemo &&
+                   (itMemo->presentMask != key.presentMask ||
+                    memcmp( itMemo->values, key.values, sizeof(key.values) ) != 0) )
+            {
+                ++itMemo;
+            }
+
+            if( itMemo == enMemo )
+            {
+                for( size_t i=0; i<NumCasterProperties; ++i )
+                {
+                    if( key.presentMask & (1u << i) )
+                        key.properties.push_back( HlmsProperty( mCasterProperties[i], key.values[i] ) );
+                }
+
+                mCasterPropertyMemo.push_back( key );
+                itMemo = mCasterPropertyMemo.end() - 1;
+            }
+
+            mSetProperties = itMemo->properties;
+        }
+        else
+        {
+            //Compact in a single pass rather than erasing one by one.
+            HlmsPropertyVec::iterator itor = mSetProperties.begin();
+            HlmsPropertyVec::iterator end  = mSetProperties.end();
+            HlmsPropertyVec::iterator dst  = mSetProperties.begin();
+
+            while( itor != end )
+            {
+                if( itor->keyName == InkProperty::FirstValidDetailMapNm )
+                {
+                    *dst = *itor;
+                    dst->value = 0;
+                    ++dst;
+                }
+                else if( isCasterProperty( itor->keyName ) ||
+                         requiredPropertyByAlphaTest( itor->keyName ) )
+                {
+                    *dst++ = *itor;
+                }
+
+                ++itor;
+            }
+
+            mSetProperties.erase( dst, end );
+        }
+
+        if( hasAlphaTest )
+        {
+            //Keep GLSL happy by not declaring more textures than we'll actually need.
+            uint8 numTextures = 0;
+            for( int i=0; i<4; ++i )
+            {
+                if( datablock->mTexToBakedTextureIdx[INK_DETAIL0+i] < datablock->mBakedTextures.size() )
+                {
+                    numTextures = std::max<uint8>(
+                                numTextures, datablock->mTexToBakedTextureIdx[INK_DETAIL0+i] + 1 );
+                }
+            }
+
+            if( datablock->mTexToBakedTextureIdx[INK_DIFFUSE] < datablock->mBakedTextures.size() )
+            {
+                numTextures = std::max<uint8>(
+                            numTextures, datablock->mTexToBakedTextureIdx[INK_DIFFUSE] + 1 );
+            }
+
+            setProperty( InkProperty::NumTextures, numTextures );
+
+            //Set the blending mode as a piece again
+            for( size_t i=0; i<4; ++i )
+            {
+                uint8 blendMode = datablock->mBlendModes[i];
+                if( datablock->mTexToBakedTextureIdx[INK_DETAIL0+i] < datablock->mBakedTextures.size() )
+                {
+                    inOutPieces[PixelShader][*InkProperty::BlendModes[i]] =
+                                                    "@insertpiece( " + c_pbsBlendModes[blendMode] + ")";
+                }
+            }
+        }
+
+        String slotsPerPoolStr = StringConverter::toString( mSlotsPerPool );
+        inOutPieces[VertexShader][InkProperty::MaterialsPerBuffer] = slotsPerPoolStr;
+        inOutPieces[PixelShader][InkProperty::MaterialsPerBuffer] = slotsPerPoolStr;
+    }
+    //-----------------------------------------------------------------------------------
+    bool HlmsInk::requiredPropertyByAlphaTest( IdString keyName ) const
+    {
+        return std::binary_search( mAlphaTestProperties.begin(), mAlphaTestProperties.end(),
+                                   keyName );
+    }
+    //-----------------------------------------------------------------------------------
+    bool HlmsInk::isCasterProperty( IdString keyName ) const
+    {
+        return std::binary_search( mCasterProperties, mCasterProperties + NumCasterProperties,
+                                   keyName );
+    }
+    //-----------------------------------------------------------------------------------
+    size_t HlmsInk::getPassBufferSizeWithoutLights( bool casterPass, SceneManager *sceneManager,
+                                                    AmbientLightMode ambientMode, float envMapScale,
+                                                    size_t numShadowMaps, size_t numPssmSplits ) const
+    {
+        //mat4 viewProj;
+        size_t mapSize = 16 * 4;
+
+        if( !casterPass )
+        {
+            ForwardPlusBase *forwardPlus = sceneManager->_getActivePassForwardPlus();
+            if( forwardPlus )
+                mapSize += forwardPlus->getConstBufferSize();
+
+            if( mParallaxCorrectedCubemap )
+                mapSize += mParallaxCorrectedCubemap->getConstBufferSize();
+
+            //mat4 view + mat4 shadowRcv[numShadowMaps].texViewProj +
+            //              vec2 shadowRcv[numShadowMaps].shadowDepthRange +
+            //              vec2 padding +
+            //              vec4 shadowRcv[numShadowMaps].invShadowMapSize +
+            //mat3 invViewMatCubemap (upgraded to three vec4)
+            mapSize += ( 16 + (16 + 2 + 2 + 4) * numShadowMaps + 4 * 3 ) * 4;
+
+            //vec3 ambientUpperHemi + float envMapScale
+            if( ambientMode == AmbientFixed || ambientMode == AmbientHemisphere || envMapScale != 1.0f )
+                mapSize += 4 * 4;
+
+            //vec3 ambientLowerHemi + padding + vec3 ambientHemisphereDir + padding
+            if( ambientMode == AmbientHemisphere )
+                mapSize += 8 * 4;
+
+            //vec3 irradianceOrigin + float maxPower +
+            //vec3 irradianceSize + float invHeight + mat4 invView
+            if( mIrradianceVolume )
+                mapSize += (4 + 4 + 4*4) * 4;
+
+            //float pssmSplitPoints N times.
+            mapSize += numPssmSplits * 4;
+            mapSize = alignToNextMultiple( mapSize, 16 );
+        }
+        else
+        {
+            //vec2 depthRange + padding
+            mapSize += (2 + 2) * 4;
+        }
+
+        return mapSize;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::setInkPassProperties( bool casterPass, bool receivesShadows,
+                                        ShadowFilter shadowFilter, AmbientLightMode ambientMode,
+                                        bool envMapScale )
+    {
+        if( mCompactMaterials )
+            setProperty( InkProperty::CompactMaterials, 1 );
+
+        if( receivesShadows && !casterPass )
+        {
+            //Shadow receiving can be improved in performance by using gather sampling.
+            //(it's the only feature so far that uses gather)
+            const RenderSystemCapabilities *capabilities = mRenderSystem->getCapabilities();
+            if( capabilities->hasCapability( RSC_TEXTURE_GATHER ) )
+                setProperty( HlmsBaseProp::TexGather, 1 );
+
+            if( shadowFilter == PCF_3x3 )
+            {
+                setProperty( InkProperty::Pcf3x3, 1 );
+                setProperty( InkProperty::PcfIterations, 4 );
+            }
+            else if( shadowFilter == PCF_4x4 )
+            {
+                setProperty( InkProperty::Pcf4x4, 1 );
+                setProperty( InkProperty::PcfIterations, 9 );
+            }
+            else
+            {
+                setProperty( InkProperty::PcfIterations, 1 );
+            }
+        }
+
+        if( !casterPass )
+        {
+            if( ambientMode == AmbientFixed )
+                setProperty( InkProperty::AmbientFixed, 1 );
+            if( ambientMode == AmbientHemisphere )
+                setProperty( InkProperty::AmbientHemisphere, 1 );
+
+            if( envMapScale )
+                setProperty( InkProperty::EnvMapScale, 1 );
+
+            if( mParallaxCorrectedCubemap )
+                setProperty( InkProperty::ParallaxCorrectCubemaps, 1 );
+
+            if( mIrradianceVolume )
+                setProperty( InkProperty::IrradianceVolumes, 1 );
+        }
+
+        if( mOptimizationStrategy == LowerGpuOverhead )
+            setProperty( InkProperty::LowerGpuOverhead, 1 );
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::setInkPassPropertiesAfterHash( bool hwGammaWrite )
+    {
+        const RenderSystemCapabilities *capabilities = mRenderSystem->getCapabilities();
+        setProperty( InkProperty::HwGammaRead, capabilities->hasCapability( RSC_HW_GAMMA ) );
+        setProperty( InkProperty::HwGammaWrite, capabilities->hasCapability( RSC_HW_GAMMA ) &&
+                                                        hwGammaWrite );
+        setProperty( InkProperty::SignedIntTex, capabilities->hasCapability(
+                                                            RSC_TEXTURE_SIGNED_INT ) );
+    }
+    //-----------------------------------------------------------------------------------
+    HlmsCache HlmsInk::preparePassHash( const CompositorShadowNode *shadowNode, bool casterPass,
+                                        bool dualParaboloid, SceneManager *sceneManager )
+    {
+        //Pending writes from the previous pass still reference its view matrix.
+        flushRecordingJobs();
+        mRecordingSceneManager = sceneManager;
+
+        closePassStats();
+        mCurrentPassStats = PassStats();
+        mLastDrawnDatablock = 0;
+        mCurrentPassStats.casterPass = casterPass;
+        mPassStatsOpen = true;
+
+        mSetProperties.clear();
+
+        mTargetEnvMap.setNull();
+
+        AmbientLightMode ambientMode = mAmbientLightMode;
+        ColourValue upperHemisphere = sceneManager->getAmbientLightUpperHemisphere();
+        ColourValue lowerHemisphere = sceneManager->getAmbientLightLowerHemisphere();
+
+        const float envMapScale = upperHemisphere.a;
+        //Ignore alpha channel
+        upperHemisphere.a = lowerHemisphere.a = 1.0;
+
+        if( !casterPass )
+        {
+            if( mAmbientLightMode == AmbientAuto )
+            {
+                if( upperHemisphere == lowerHemisphere )
+                {
+                    if( upperHemisphere == ColourValue::Black )
+                        ambientMode = AmbientNone;
+                    else
+                        ambientMode = AmbientFixed;
+                }
+                else
+                {
+                    ambientMode = AmbientHemisphere;
+                }
+            }
+
+            //Save cubemap's name so that we never try to render & sample to/from it at the same time
+            const CompositorTexture &compoTarget = sceneManager->getCompositorTarget();
+            if( !compoTarget.textures->empty() )
+            {
+                const TexturePtr &firstTargetTex = (*compoTarget.textures)[0];
+                if( firstTargetTex->getTextureType() == TEX_TYPE_CUBE_MAP )
+                {
+                    setProperty( InkProperty::TargetEnvprobeMap,
+                                 static_cast<int32>( IdString(firstTargetTex->getName()).mHash ) );
+                    mTargetEnvMap = firstTargetTex;
+                }
+            }
+        }
+
+        //The properties need to be set before preparePassHashBase so that
+        //they are considered when building the HlmsCache's hash.
+        setInkPassProperties( casterPass, shadowNode != 0, mShadowFilter,
+                              ambientMode, envMapScale != 1.0f );
+
+        //A pass can't take more than what the API lets us bind at once.
+        const size_t maxBlockSize = std::min( mVaoManager->getConstBufferMaxSize(),
+                                              mPassBufferRingSize );
+
+        HlmsCache retVal = Hlms::preparePassHashBase( shadowNode, casterPass,
+                                                      dualParaboloid, sceneManager );
+
+        RenderTarget *renderTarget = sceneManager->getCurrentViewport()->getTarget();
+
+        setInkPassPropertiesAfterHash( renderTarget->isHardwareGammaEnabled() );
+        retVal.setProperties = mSetProperties;
+
+        Camera *camera = sceneManager->getCameraInProgress();
+        Matrix4 viewMatrix = camera->getViewMatrix(true);
+
+        Matrix4 projectionMatrix = camera->getProjectionMatrixWithRSDepth();
+
+        if( renderTarget->requiresTextureFlipping() )
+        {
+            projectionMatrix[1][0] = -projectionMatrix[1][0];
+            projectionMatrix[1][1] = -projectionMatrix[1][1];
+            projectionMatrix[1][2] = -projectionMatrix[1][2];
+            projectionMatrix[1][3] = -projectionMatrix[1][3];
+        }
+
+        int32 numLights             = getProperty( HlmsBaseProp::LightsSpot );
+        int32 numDirectionalLights  = getProperty( HlmsBaseProp::LightsDirNonCaster );
+        int32 numShadowMaps         = getProperty( HlmsBaseProp::NumShadowMaps );
+        int32 numPssmSplits         = getProperty( HlmsBaseProp::PssmSplits );
+
+        mGridBuffer             = 0;
+        mGlobalLightListBuffer  = 0;
+
+        size_t lightsSize = 0;
+        if( !casterPass )
+        {
+            ForwardPlusBase *forwardPlus = sceneManager->_getActivePassForwardPlus();
+            if( forwardPlus )
+            {
+                mGridBuffer             = forwardPlus->getGridBuffer( camera );
+                mGlobalLightListBuffer  = forwardPlus->getGlobalLightListBuffer( camera );
+            }
+
+            if( mParallaxCorrectedCubemap )
+                mParallaxCorrectedCubemap->_notifyPreparePassHash( viewMatrix );
+
+            if( shadowNode )
+            {
+                //Six variables * 4 (padded vec3) * 4 (bytes) * numLights
+                lightsSize = ( 6 * 4 * 4 ) * numLights;
+            }
+            else
+            {
+                //Three variables * 4 (padded vec3) * 4 (bytes) * numDirectionalLights
+                lightsSize = ( 3 * 4 * 4 ) * numDirectionalLights;
+            }
+        }
+
+        size_t mapSize = getPassBufferSizeWithoutLights( casterPass, sceneManager, ambientMode,
+                                                         envMapScale, numShadowMaps, numPssmSplits );
+        mapSize += lightsSize;
+
+        const size_t listenerSize = mListener->getPassBufferSize( shadowNode, casterPass,
+                                                                  dualParaboloid, sceneManager );
+        mapSize += listenerSize;
+
+        if( mapSize > maxBlockSize )
+        {
+            OGRE_EXCEPT( Exception::ERR_INVALID_STATE,
+                         "Pass buffer needs " + StringConverter::toString( mapSize ) +
+                         " bytes, but the RenderSystem can only bind up to " +
+                         StringConverter::toString( maxBlockSize ) + " bytes.",
+                         "HlmsInk::preparePassHash" );
+        }
+
+        //Gather what the pass buffer is made of, so we can check if an identical one was
+        //already uploaded this frame (i.e. same camera, lights and shadow node being
+        //rendered in multiple render queues or split compositor passes) before filling it.
+        mPreparedPass.viewMatrix = viewMatrix;
+        mPreparedPass.shadowMaps.clear();
+        mPassLights.clear();
+        mPassLightIndices.clear();
+
+        if( !casterPass )
+        {
+            const LightListInfo &globalLightList = sceneManager->getGlobalLightList();
+
+            //Packets are indexed like the global light list. Grow it now
+            //so the references getLightPacket returns stay valid.
+            if( mLightPackets.size() < globalLightList.lights.size() )
+                mLightPackets.resize( globalLightList.lights.size() );
+
+            if( shadowNode )
+            {
+                //All directional lights (caster and non-caster) are sent.
+                //Then non-directional shadow-casting shadow lights are sent.
+                size_t shadowLightIdx = 0;
+                size_t nonShadowLightIdx = 0;
+                const LightClosestArray &lights = shadowNode->getShadowCastingLights();
+
+                const CompositorShadowNode::LightsBitSet &affectedLights =
+                        shadowNode->getAffectedLightsBitSet();
+
+                int32 shadowCastingDirLights = getProperty( HlmsBaseProp::LightsDirectional );
+
+                mPassLights.reserve( numLights );
+                mPassLightIndices.reserve( numLights );
+
+                for( int32 i=0; i<numLights; ++i )
+                {
+                    Light const *light = 0;
+                    size_t globalIndex = 0;
+
+                    if( i >= shadowCastingDirLights && i < numDirectionalLights )
+                    {
+                        while( affectedLights[nonShadowLightIdx] )
+                            ++nonShadowLightIdx;
+
+                        globalIndex = nonShadowLightIdx++;
+                        light = globalLightList.lights[globalIndex];
+
+                        assert( light->getType() == Light::LT_DIRECTIONAL );
+                    }
+                    else
+                    {
+                        light       = lights[shadowLightIdx].light;
+                        globalIndex = lights[shadowLightIdx].globalIndex;
+                        ++shadowLightIdx;
+                    }
+
+                    mPassLights.push_back( light );
+                    mPassLightIndices.push_back( static_cast<uint32>( globalIndex ) );
+                }
+
+                mPreparedPass.shadowMaps.reserve( numShadowMaps );
+                for( int32 i=0; i<numShadowMaps; ++i )
+                    mPreparedPass.shadowMaps.push_back( shadowNode->getLocalTextures()[i].textures[0] );
+            }
+            else
+            {
+                //No shadow maps, only send directional lights
+                mPassLights.reserve( numDirectionalLights );
+                mPassLightIndices.reserve( numDirectionalLights );
+                for( int32 i=0; i<numDirectionalLights; ++i )
+                {
+                    mPassLights.push_back( globalLightList.lights[i] );
+                    mPassLightIndices.push_back( static_cast<uint32>( i ) );
+                }
+            }
+        }
+
+        //The listener's data can't be compared.
+        const bool shareable = listenerSize == 0;
+
+        uint32 inputsHash = 0;
+        mPassInputsScratch.clear();
+        mActivePassBuffer = mCurrentPassBuffer;
+        if( shareable )
+        {
+            pushPassInput( mPassInputsScratch, retVal.hash );
+            pushPassInput( mPassInputsScratch, static_cast<uint32>( mapSize ) );
+            pushPassInput( mPassInputsScratch, viewMatrix );
+            pushPassInput( mPassInputsScratch, projectionMatrix );
+
+            if( !casterPass )
+            {
+                pushPassInput( mPassInputsScratch, renderTarget );
+
+                for( int32 i=0; i<numShadowMaps; ++i )
+                {
+                    Real fNear, fFar;
+                    shadowNode->getMinMaxDepthRange( i, fNear, fFar );
+                    pushPassInput( mPassInputsScratch, shadowNode->getViewProjectionMatrix( i ) );
+                    pushPassInput( mPassInputsScratch, fNear );
+                    pushPassInput( mPassInputsScratch, fFar );
+                    pushPassInput( mPassInputsScratch, mPreparedPass.shadowMaps[i].get() );
+                }
+
+                for( int32 i=0; i<numPssmSplits; ++i )
+                    pushPassInput( mPassInputsScratch, (*shadowNode->getPssmSplits(0))[i+1] );
+
+                for( size_t i=0; i<mPassLights.size(); ++i )
+                {
+                    const Light *light = mPassLights[i];
+                    const LightPacket &packet = getLightPacket( light, mPassLightIndices[i] );
+                    const Vector4 lightPos4 = light->getAs4DVector();
+                    const Vector3 lightDir = light->getDerivedDirection();
+                    pushPassInput( mPassInputsScratch, light );
+                    pushPassInput( mPassInputsScratch, lightPos4.x );
+                    pushPassInput( mPassInputsScratch, lightPos4.y );
+                    pushPassInput( mPassInputsScratch, lightPos4.z );
+                    pushPassInput( mPassInputsScratch, lightDir.x );
+                    pushPassInput( mPassInputsScratch, lightDir.y );
+                    pushPassInput( mPassInputsScratch, lightDir.z );
+                    for( size_t j=0; j<16; ++j )
+                        pushPassInput( mPassInputsScratch, static_cast<Real>( packet.gpuData[j] ) );
+                }
+
+                pushPassInput( mPassInputsScratch, upperHemisphere.r );
+                pushPassInput( mPassInputsScratch, upperHemisphere.g );
+                pushPassInput( mPassInputsScratch, upperHemisphere.b );
+                pushPassInput( mPassInputsScratch, lowerHemisphere.r );
+                pushPassInput( mPassInputsScratch, lowerHemisphere.g );
+                pushPassInput( mPassInputsScratch, lowerHemisphere.b );
+                pushPassInput( mPassInputsScratch, envMapScale );
+                const Vector3 &hemisphereDir = sceneManager->getAmbientLightHemisphereDir();
+                pushPassInput( mPassInputsScratch, hemisphereDir.x );
+                pushPassInput( mPassInputsScratch, hemisphereDir.y );
+                pushPassInput( mPassInputsScratch, hemisphereDir.z );
+
+                pushPassInput( mPassInputsScratch, sceneManager->_getActivePassForwardPlus() );
+                pushPassInput( mPassInputsScratch, mParallaxCorrectedCubemap );
+                pushPassInput( mPassInputsScratch, mIrradianceVolume );
+            }
+            else
+            {
+                //The caster's depth range comes from the camera rendering the shadow map.
+                pushPassInput( mPassInputsScratch, camera );
+                pushPassInput( mPassInputsScratch, shadowNode );
             }
+
+            inputsHash = FastHash( reinterpret_cast<const char*>( mPassInputsScratch.begin() ),
+                                   static_cast<int>( mPassInputsScratch.size() * sizeof(uint32) ) );
+            mActivePassBuffer = findPassBufferWithInputs( inputsHash );
+        }
+
+        if( mActivePassBuffer >= mCurrentPassBuffer )
+        {
+            //Not uploaded yet this frame. Dynamic buffers rotate every frame,
+            //thus we can't reuse what was uploaded in previous frames.
+            if( mCurrentPassBuffer >= mPassBufferBlocks.size() )
+                mPassBufferBlocks.push_back( PassBufferBlock() );
+
+            mActivePassBuffer = mCurrentPassBuffer++;
+
+            //Bound ranges must be multiple of 16 bytes.
+            const size_t blockSize = alignToNextMultiple( mapSize, 16u );
+
+            BufferPacked *passBuffer = 0;
+            size_t blockOffset = 0;
+            float *passBufferPtr = reinterpret_cast<float*>(
+                        mapFromRing( mPassBufferRing, blockSize, false, &passBuffer, &blockOffset ) );
+
+            const float *startupPtr = passBufferPtr;
+
+            //---------------------------------------------------------------------------
+            //                          ---- VERTEX SHADER ----
+            //---------------------------------------------------------------------------
+
+            //mat4 viewProj;
+            Matrix4 viewProjMatrix = projectionMatrix * viewMatrix;
+            for( size_t i=0; i<16; ++i )
+                *passBufferPtr++ = (float)viewProjMatrix[0][i];
+
+            if( !casterPass )
+            {
+                //mat4 view;
+                for( size_t i=0; i<16; ++i )
+                    *passBufferPtr++ = (float)viewMatrix[0][i];
+
+                for( int32 i=0; i<numShadowMaps; ++i )
+                {
+                    //mat4 shadowRcv[numShadowMaps].texViewProj
+                    Matrix4 viewProjTex = shadowNode->getViewProjectionMatrix( i );
+                    for( size_t j=0; j<16; ++j )
+                        *passBufferPtr++ = (float)viewProjTex[0][j];
+
+                    //vec2 shadowRcv[numShadowMaps].shadowDepthRange
+                    Real fNear, fFar;
+                    shadowNode->getMinMaxDepthRange( i, fNear, fFar );
+                    const Real depthRange = fFar - fNear;
+                    *passBufferPtr++ = fNear;
+                    *passBufferPtr++ = 1.0f / depthRange;
+                    ++passBufferPtr; //Padding
+                    ++passBufferPtr; //Padding
+
+
+                    //vec2 shadowRcv[numShadowMaps].invShadowMapSize
+                    //TODO: textures[0] is out of bounds when using shadow atlas. Also see how what
+                    //changes need to be done so that UV calculations land on the right place
+                    uint32 texWidth  = shadowNode->getLocalTextures()[i].textures[0]->getWidth();
+                    uint32 texHeight = shadowNode->getLocalTextures()[i].textures[0]->getHeight();
+                    *passBufferPtr++ = 1.0f / texWidth;
+                    *passBufferPtr++ = 1.0f / texHeight;
+                    *passBufferPtr++ = static_cast<float>( texWidth );
+                    *passBufferPtr++ = static_cast<float>( texHeight );
+                }
+
+                //---------------------------------------------------------------------------
+                //                          ---- PIXEL SHADER ----
+                //---------------------------------------------------------------------------
+
+                Matrix3 viewMatrix3, invViewMatrixCubemap;
+                viewMatrix.extract3x3Matrix( viewMatrix3 );
+                //Cubemaps are left-handed.
+                invViewMatrixCubemap = viewMatrix3;
+                invViewMatrixCubemap[0][2] = -invViewMatrixCubemap[0][2];
+                invViewMatrixCubemap[1][2] = -invViewMatrixCubemap[1][2];
+                invViewMatrixCubemap[2][2] = -invViewMatrixCubemap[2][2];
+                invViewMatrixCubemap = invViewMatrixCubemap.Inverse();
+
+                //mat3 invViewMatCubemap
+                for( size_t i=0; i<9; ++i )
+                {
+#ifdef OGRE_GLES2_WORKAROUND_2
+                    Matrix3 xRot( 1.0f, 0.0f, 0.0f,
+                                  0.0f, 0.0f, -1.0f,
+                                  0.0f, 1.0f, 0.0f );
+                    xRot = xRot * invViewMatrixCubemap;
+                    *passBufferPtr++ = (float)xRot[0][i];
+#else
+                    *passBufferPtr++ = (float)invViewMatrixCubemap[0][i];
+#endif
+
+                    //Alignment: each row/column is one vec4, despite being 3x3
+                    if( !( (i+1) % 3 ) )
+                        ++passBufferPtr;
+                }
+
+                //vec3 ambientUpperHemi + padding
+                if( ambientMode == AmbientFixed || ambientMode == AmbientHemisphere || envMapScale != 1.0f )
+                {
+                    *passBufferPtr++ = static_cast<float>( upperHemisphere.r );
+                    *passBufferPtr++ = static_cast<float>( upperHemisphere.g );
+                    *passBufferPtr++ = static_cast<float>( upperHemisphere.b );
+                    *passBufferPtr++ = envMapScale;
+                }
+
+                //vec3 ambientLowerHemi + padding + vec3 ambientHemisphereDir + padding
+                if( ambientMode == AmbientHemisphere )
+                {
+                    *passBufferPtr++ = static_cast<float>( lowerHemisphere.r );
+                    *passBufferPtr++ = static_cast<float>( lowerHemisphere.g );
+                    *passBufferPtr++ = static_cast<float>( lowerHemisphere.b );
+                    *passBufferPtr++ = 1.0f;
+
+                    Vector3 hemisphereDir = viewMatrix3 * sceneManager->getAmbientLightHemisphereDir();
+                    hemisphereDir.normalise();
+                    *passBufferPtr++ = static_cast<float>( hemisphereDir.x );
+                    *passBufferPtr++ = static_cast<float>( hemisphereDir.y );
+                    *passBufferPtr++ = static_cast<float>( hemisphereDir.z );
+                    *passBufferPtr++ = 1.0f;
+                }
+
+                if( mIrradianceVolume )
+                {
+                    const Vector3 irradianceCellSize = mIrradianceVolume->getIrradianceCellSize();
+                    const Vector3 irradianceVolumeOrigin = mIrradianceVolume->getIrradianceOrigin() /
+                                                           irradianceCellSize;
+                    const float fTexWidth = static_cast<float>(
+                                mIrradianceVolume->getIrradianceVolumeTexture()->getWidth() );
+                    const float fTexDepth = static_cast<float>(
+                                mIrradianceVolume->getIrradianceVolumeTexture()->getDepth() );
+
+                    *passBufferPtr++ = static_cast<float>( irradianceVolumeOrigin.x ) / fTexWidth;
+                    *passBufferPtr++ = static_cast<float>( irradianceVolumeOrigin.y );
+                    *passBufferPtr++ = static_cast<float>( irradianceVolumeOrigin.z ) / fTexDepth;
+                    *passBufferPtr++ = mIrradianceVolume->getIrradianceMaxPower() *
+                                       mIrradianceVolume->getPowerScale();
+
+                    const float fTexHeight = static_cast<float>(
+                                mIrradianceVolume->getIrradianceVolumeTexture()->getHeight() );
+
+                    *passBufferPtr++ = 1.0f / (fTexWidth * irradianceCellSize.x);
+                    *passBufferPtr++ = 1.0f / irradianceCellSize.y;
+                    *passBufferPtr++ = 1.0f / (fTexDepth * irradianceCellSize.z);
+                    *passBufferPtr++ = 1.0f / fTexHeight;
+
+                    //mat4 invView;
+                    Matrix4 invViewMatrix = viewMatrix.inverse();
+                    for( size_t i=0; i<16; ++i )
+                        *passBufferPtr++ = (float)invViewMatrix[0][i];
+                }
+
+                //float pssmSplitPoints
+                for( int32 i=0; i<numPssmSplits; ++i )
+                    *passBufferPtr++ = (*shadowNode->getPssmSplits(0))[i+1];
+
+                passBufferPtr += alignToNextMultiple( numPssmSplits, 4 ) - numPssmSplits;
+
+                passBufferPtr = writeLights( mPassLights.begin(), mPassLightIndices.begin(),
+                                             mPassLights.size(), shadowNode != 0,
+                                             viewMatrix, passBufferPtr );
+
+                ForwardPlusBase *forwardPlus = sceneManager->_getActivePassForwardPlus();
+                if( forwardPlus )
+                {
+                    forwardPlus->fillConstBufferData( renderTarget, passBufferPtr );
+                    passBufferPtr += forwardPlus->getConstBufferSize() >> 2u;
+                }
+
+                if( mParallaxCorrectedCubemap )
+                {
+                    mParallaxCorrectedCubemap->fillConstBufferData( viewMatrix, passBufferPtr );
+                    passBufferPtr += mParallaxCorrectedCubemap->getConstBufferSize() >> 2u;
+                }
+            }
+            else
+            {
+                //vec2 depthRange;
+                Real fNear, fFar;
+                shadowNode->getMinMaxDepthRange( camera, fNear, fFar );
+                const Real depthRange = fFar - fNear;
+                *passBufferPtr++ = fNear;
+                *passBufferPtr++ = 1.0f / depthRange;
+                passBufferPtr += 2;
+            }
+
+            passBufferPtr = mListener->preparePassBuffer( shadowNode, casterPass, dualParaboloid,
+                                                          sceneManager, passBufferPtr );
+
+            assert( (size_t)(passBufferPtr - startupPtr) * 4u == mapSize );
+
+            passBuffer->unmap( UO_KEEP_PERSISTENT );
+
+            PassBufferBlock &passBlock = mPassBufferBlocks[mActivePassBuffer];
+            passBlock.buffer    = static_cast<ConstBufferPacked*>( passBuffer );
+            passBlock.offset    = static_cast<uint32>( blockOffset );
+            passBlock.sizeBytes = static_cast<uint32>( blockSize );
+            passBlock.hash      = inputsHash;
+            passBlock.shareable = shareable;
+            passBlock.inputs.swap( mPassInputsScratch );
+
+            mCurrentPassStats.passBufferBytes += blockSize;
+            ++mCurrentFrameStats.numPassBuffersAllocated;
+        }
+
+
+        //mTexBuffers must hold at least one buffer to prevent out of bound exceptions.
+        if( mTexBuffers.empty() )
+        {
+            size_t bufferSize = std::min<size_t>( mTextureBufferDefaultSize,
+                                                  mVaoManager->getTexBufferMaxSize() );
+            TexBufferPacked *newBuffer = mVaoManager->createTexBuffer( PF_FLOAT32_RGBA, bufferSize,
+                                                                       BT_DYNAMIC_PERSISTENT, 0, false );
+            mTexBuffers.push_back( newBuffer );
         }
+
+        mLastTextureHash = 0;
+
+        mLastBoundPool = 0;
+
+        if( mShadowmapSamplerblock && !getProperty( HlmsBaseProp::ShadowUsesDepthTexture ) )
+            mCurrentShadowmapSamplerblock = mShadowmapSamplerblock;
         else
+            mCurrentShadowmapSamplerblock = mShadowmapCmpSamplerblock;
+
+        mTexUnitSlotStart = mPreparedPass.shadowMaps.size() + 1;
+        if( mGridBuffer )
+            mTexUnitSlotStart += 2;
+        if( mIrradianceVolume )
+            mTexUnitSlotStart += 1;
+        if( mParallaxCorrectedCubemap )
+            mTexUnitSlotStart += 1;
+
+        uploadDirtyDatablocks();
+
+        //Remember the pass so its permutations can be warmed up later.
+        HlmsPassCacheVec::const_iterator itPass = mPreparedPassCaches.begin();
+        HlmsPassCacheVec::const_iterator enPass = mPreparedPassCaches.end();
+        while( itPass != enPass && itPass->hash != retVal.hash )
+            ++itPass;
+        if( itPass == enPass )
+            mPreparedPassCaches.push_back( retVal );
+
+        return retVal;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::PassStats::accumulate( const PassStats &other )
+    {
+        passBufferBytes         += other.passBufferBytes;
+        constBufferBytes        += other.constBufferBytes;
+        texBufferBytes          += other.texBufferBytes;
+        numConstBufferMaps      += other.numConstBufferMaps;
+        numTexBufferMaps        += other.numTexBufferMaps;
+        numTextureRebinds       += other.numTextureRebinds;
+        numPoolRebinds          += other.numPoolRebinds;
+        numElidedBindings       += other.numElidedBindings;
+        numRenderables          += other.numRenderables;
+        numSkinnedRenderables   += other.numSkinnedRenderables;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::closePassStats(void)
+    {
+        if( mPassStatsOpen )
+        {
+            mCurrentFrameStats.totals.accumulate( mCurrentPassStats );
+            mCurrentFrameStats.passes.push_back( mCurrentPassStats );
+            mPassStatsOpen = false;
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::invalidateBindings(void)
+    {
+        for( size_t i=0; i<NumShaderTypes; ++i )
+        {
+            for( size_t j=0; j<NumTrackedSlots; ++j )
+            {
+                mBoundConstBuffers[i][j].known  = false;
+                mBoundResources[i][j].known     = false;
+            }
+        }
+
+        mUntrackedResourcesClean = false;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::applyCommandToBindings( const CbBase *cmd )
+    {
+        const uint16 commandType = cmd->commandType;
+
+        if( commandType < CB_SET_CONSTANT_BUFFER_VS )
+        {
+            //Draws, VAOs & indirect buffers don't affect shader bindings.
+            return;
+        }
+
+        if( commandType < CB_SET_CONSTANT_BUFFER_INVALID )
+        {
+            const CbShaderBuffer *shaderBufferCmd = static_cast<const CbShaderBuffer*>( cmd );
+            const size_t stage = commandType - CB_SET_CONSTANT_BUFFER_VS;
+            if( stage >= NumShaderTypes )
+            {
+                //i.e. compute. Not a stage we track.
+                invalidateBindings();
+            }
+            else if( shaderBufferCmd->slot < NumTrackedSlots )
+            {
+                BoundSlot &boundSlot = mBoundConstBuffers[stage][shaderBufferCmd->slot];
+                boundSlot.object        = shaderBufferCmd->bufferPacked;
+                boundSlot.samplerblock  = 0;
+                boundSlot.offset        = shaderBufferCmd->bindOffset;
+                boundSlot.sizeBytes     = shaderBufferCmd->bindSizeBytes;
+                boundSlot.known         = true;
+            }
+        }
+        else if( commandType > CB_SET_CONSTANT_BUFFER_INVALID &&
+                 commandType < CB_SET_TEXTURE_BUFFER_INVALID )
+        {
+            const CbShaderBuffer *shaderBufferCmd = static_cast<const CbShaderBuffer*>( cmd );
+            const size_t stage = commandType - CB_SET_TEXTURE_BUFFER_VS;
+            if( stage >= NumShaderTypes )
+            {
+                invalidateBindings();
+            }
+            else if( shaderBufferCmd->slot >= NumTrackedSlots )
+            {
+                mUntrackedResourcesClean = false;
+            }
+            else
+            {
+                //Some APIs share texture units between stages.
+                for( size_t i=0; i<NumShaderTypes; ++i )
+                    mBoundResources[i][shaderBufferCmd->slot].known = false;
+
+                BoundSlot &boundSlot = mBoundResources[stage][shaderBufferCmd->slot];
+                boundSlot.object        = shaderBufferCmd->bufferPacked;
+                boundSlot.samplerblock  = 0;
+                boundSlot.offset        = shaderBufferCmd->bindOffset;
+                boundSlot.sizeBytes     = shaderBufferCmd->bindSizeBytes;
+                boundSlot.known         = true;
+            }
+        }
+        else if( commandType == CB_SET_TEXTURE )
+        {
+            const CbTexture *textureCmd = static_cast<const CbTexture*>( cmd );
+            if( textureCmd->texUnit >= NumTrackedSlots )
+            {
+                if( textureCmd->bEnabled )
+                    mUntrackedResourcesClean = false;
+            }
+            else
+            {
+                for( size_t i=0; i<NumShaderTypes; ++i )
+                    mBoundResources[i][textureCmd->texUnit].known = false;
+
+                BoundSlot &boundSlot = mBoundResources[PixelShader][textureCmd->texUnit];
+                boundSlot.object        = textureCmd->bEnabled ? textureCmd->texture : 0;
+                boundSlot.samplerblock  = textureCmd->bEnabled ? textureCmd->samplerBlock : 0;
+                boundSlot.offset        = 0;
+                boundSlot.sizeBytes     = 0;
+                boundSlot.known         = true;
+            }
+        }
+        else if( commandType == CB_TEXTURE_DISABLE_FROM )
+        {
+            const CbTextureDisableFrom *disableCmd = static_cast<const CbTextureDisableFrom*>( cmd );
+            for( size_t i=0; i<NumShaderTypes; ++i )
+            {
+                for( size_t j=disableCmd->fromSlot; j<NumTrackedSlots; ++j )
+                {
+                    BoundSlot &boundSlot = mBoundResources[i][j];
+                    boundSlot.object        = 0;
+                    boundSlot.samplerblock  = 0;
+                    boundSlot.offset        = 0;
+                    boundSlot.sizeBytes     = 0;
+                    boundSlot.known         = i == PixelShader;
+                }
+            }
+
+            if( disableCmd->fromSlot <= NumTrackedSlots )
+                mUntrackedResourcesClean = true;
+        }
+        else if( commandType != CB_SET_PSO &&
+                 commandType != CB_START_V1_LEGACY_RENDERING &&
+                 commandType != CB_SET_V1_RENDER_OP &&
+                 commandType != CB_DRAW_V1_INDEXED &&
+                 commandType != CB_DRAW_V1_STRIP )
+        {
+            //Low level materials (and anything we don't know about)
+            //may leave the GPU in any state.
+            invalidateBindings();
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::syncBindingsWithCommandBuffer( CommandBuffer *commandBuffer, CbBase *lastCmd )
+    {
+        const size_t lastOffset = commandBuffer->getCommandOffset( lastCmd );
+
+        if( mTrackedCommandBuffer != commandBuffer || mTrackedCommandOffset > lastOffset )
+        {
+            //Whatever ran before this command buffer is unknown to us.
+            invalidateBindings();
+            mTrackedCommandBuffer = commandBuffer;
+            mTrackedCommandOffset = 0;
+        }
+
+        for( size_t offset=mTrackedCommandOffset; offset<=lastOffset; offset += COMMAND_FIXED_SIZE )
+            applyCommandToBindings( commandBuffer->getCommandFromOffset( offset ) );
+
+        mTrackedCommandOffset = lastOffset + COMMAND_FIXED_SIZE;
+    }
+    //-----------------------------------------------------------------------------------
+    bool HlmsInk::isBound( const BoundSlot &boundSlot, const void *object,
+                           const HlmsSamplerblock *samplerblock, uint32 offset, uint32 sizeBytes )
+    {
+        return boundSlot.known && boundSlot.object == object &&
+               boundSlot.samplerblock == samplerblock &&
+               boundSlot.offset == offset && boundSlot.sizeBytes == sizeBytes;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::bindConstBuffer( CommandBuffer *commandBuffer, ShaderType shaderType, uint16 slot,
+                                   ConstBufferPacked *buffer, uint32 offset, uint32 sizeBytes )
+    {
+        if( slot < NumTrackedSlots &&
+            isBound( mBoundConstBuffers[shaderType][slot], buffer, 0, offset, sizeBytes ) )
+        {
+            ++mNumElidedBindings;
+            ++mCurrentPassStats.numElidedBindings;
+            return;
+        }
+
+        CbShaderBuffer *shaderBufferCmd = commandBuffer->addCommand<CbShaderBuffer>();
+        *shaderBufferCmd = CbShaderBuffer( shaderType, slot, buffer, offset, sizeBytes );
+        applyCommandToBindings( shaderBufferCmd );
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::bindTexBuffer( CommandBuffer *commandBuffer, ShaderType shaderType, uint16 slot,
+                                 TexBufferPacked *buffer, uint32 offset, uint32 sizeBytes )
+    {
+        if( slot < NumTrackedSlots &&
+            isBound( mBoundResources[shaderType][slot], buffer, 0, offset, sizeBytes ) )
+        {
+            ++mNumElidedBindings;
+            ++mCurrentPassStats.numElidedBindings;
+            return;
+        }
+
+        CbShaderBuffer *shaderBufferCmd = commandBuffer->addCommand<CbShaderBuffer>();
+        *shaderBufferCmd = CbShaderBuffer( shaderType, slot, buffer, offset, sizeBytes );
+        applyCommandToBindings( shaderBufferCmd );
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::bindTexture( CommandBuffer *commandBuffer, uint16 texUnit, Texture *texture,
+                               const HlmsSamplerblock *samplerblock )
+    {
+        if( texUnit < NumTrackedSlots &&
+            isBound( mBoundResources[PixelShader][texUnit], texture, samplerblock, 0, 0 ) )
+        {
+            ++mNumElidedBindings;
+            ++mCurrentPassStats.numElidedBindings;
+            return;
+        }
+
+        CbTexture *textureCmd = commandBuffer->addCommand<CbTexture>();
+        *textureCmd = CbTexture( texUnit, true, texture, samplerblock );
+        applyCommandToBindings( textureCmd );
+        ++mCurrentPassStats.numTextureRebinds;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::disableTexturesFrom( CommandBuffer *commandBuffer, uint16 texUnit )
+    {
+        //Units past the tracked ones must be known to be disabled too.
+        bool alreadyDisabled = texUnit < NumTrackedSlots && mUntrackedResourcesClean;
+        for( size_t i=texUnit; i<NumTrackedSlots && alreadyDisabled; ++i )
+            alreadyDisabled = isBound( mBoundResources[PixelShader][i], 0, 0, 0, 0 );
+
+        if( alreadyDisabled )
+        {
+            ++mNumElidedBindings;
+            ++mCurrentPassStats.numElidedBindings;
+            return;
+        }
+
+        CbTextureDisableFrom *disableCmd = commandBuffer->addCommand<CbTextureDisableFrom>();
+        *disableCmd = CbTextureDisableFrom( texUnit );
+        applyCommandToBindings( disableCmd );
+        ++mCurrentPassStats.numTextureRebinds;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::validateBonePaletteCache(void)
+    {
+        if( mBonePaletteCacheTexStart != mStartMappedTexBuffer ||
+            mBonePaletteCacheTexBuffer != mCurrentTexBuffer )
+        {
+            mBonePaletteCache.clear();
+            mBonePaletteCacheTexStart   = mStartMappedTexBuffer;
+            mBonePaletteCacheTexBuffer  = mCurrentTexBuffer;
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    const HlmsInk::BonePalette* HlmsInk::findBonePalette( const void *owner, const void *indexMap,
+                                                          bool isV1, uint32 numBones ) const
+    {
+        BonePaletteCache::const_iterator itOwner = mBonePaletteCache.find( owner );
+
+        if( itOwner == mBonePaletteCache.end() )
+            return 0;
+
+        BonePaletteVec::const_iterator itor = itOwner->second.begin();
+        BonePaletteVec::const_iterator end  = itOwner->second.end();
+
+        while( itor != end )
+        {
+            if( itor->numBones == numBones )
+            {
+                if( itor->indexMap == indexMap )
+                    return &(*itor);
+
+                if( !isV1 )
+                {
+                    //Submeshes usually have their own IndexMap, but with the same contents.
+                    const RenderableAnimated::IndexMap *cachedMap =
+                            static_cast<const RenderableAnimated::IndexMap*>( itor->indexMap );
+                    const RenderableAnimated::IndexMap *newMap =
+                            static_cast<const RenderableAnimated::IndexMap*>( indexMap );
+
+                    if( !memcmp( cachedMap->begin(), newMap->begin(),
+                                 numBones * sizeof( RenderableAnimated::IndexMap::value_type ) ) )
+                    {
+                        return &(*itor);
+                    }
+                }
+            }
+
+            ++itor;
+        }
+
+        return 0;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::addBonePalette( const void *owner, const void *indexMap,
+                                  uint32 numBones, uint32 distToWorldMatStart )
+    {
+        BonePalette palette;
+        palette.indexMap            = indexMap;
+        palette.numBones            = numBones;
+        palette.distToWorldMatStart = distToWorldMatStart;
+
+        mBonePaletteCache[owner].push_back( palette );
+    }
+    //-----------------------------------------------------------------------------------
+    const HlmsInk::LightPacket& HlmsInk::getLightPacket( const Light *light, uint32 globalIndex )
+    {
+        assert( globalIndex < mLightPackets.size() );
+        LightPacket &packet = mLightPackets[globalIndex];
+
+        //Lights can't change in the middle of a frame, thus once checked they're up to date.
+        //Ids are never reused, so a light created where a destroyed one was won't match.
+        const IdType lightId = light->getId();
+        if( packet.lightId == lightId && packet.lastFrameChecked == mLightPacketsFrame )
+            return packet;
+
+        packet.lastFrameChecked = mLightPacketsFrame;
+
+        const Real powerScale = light->getPowerScale();
+        const ColourValue &diffuseColour  = light->getDiffuseColour();
+        const ColourValue &specularColour = light->getSpecularColour();
+        const Radian innerAngle = light->getSpotlightInnerAngle();
+        const Radian outerAngle = light->getSpotlightOuterAngle();
+
+        const float source[13] =
+        {
+            diffuseColour.r, diffuseColour.g, diffuseColour.b,
+            specularColour.r, specularColour.g, specularColour.b,
+            static_cast<float>( powerScale ),
+            static_cast<float>( light->getAttenuationRange() ),
+            static_cast<float>( light->getAttenuationLinear() ),
+            static_cast<float>( light->getAttenuationQuadric() ),
+            static_cast<float>( innerAngle.valueRadians() ),
+            static_cast<float>( outerAngle.valueRadians() ),
+            static_cast<float>( light->getSpotlightFalloff() )
+        };
+
+        if( packet.lightId == lightId && !memcmp( packet.source, source, sizeof( source ) ) )
+            return packet;
+
+        packet.lightId = lightId;
+        memcpy( packet.source, source, sizeof( source ) );
+
+        //vec3 lights[numLights].diffuse
+        const ColourValue diffuse = diffuseColour * powerScale;
+        packet.gpuData[0] = diffuse.r;
+        packet.gpuData[1] = diffuse.g;
+        packet.gpuData[2] = diffuse.b;
+        packet.gpuData[3] = 0.0f;
+
+        //vec3 lights[numLights].specular
+        const ColourValue specular = specularColour * powerScale;
+        packet.gpuData[4] = specular.r;
+        packet.gpuData[5] = specular.g;
+        packet.gpuData[6] = specular.b;
+        packet.gpuData[7] = 0.0f;
+
+        //vec3 lights[numLights].attenuation;
+        packet.gpuData[8]  = light->getAttenuationRange();
+        packet.gpuData[9]  = light->getAttenuationLinear();
+        packet.gpuData[10] = light->getAttenuationQuadric();
+        packet.gpuData[11] = 0.0f;
+
+        //vec3 lights[numLights].spotParams;
+        const float cosInner = Math::Cos( innerAngle * 0.5f );
+        const float cosOuter = Math::Cos( outerAngle * 0.5f );
+        packet.gpuData[12] = 1.0f / ( cosInner - cosOuter );
+        packet.gpuData[13] = cosOuter;
+        packet.gpuData[14] = light->getSpotlightFalloff();
+        packet.gpuData[15] = 0.0f;
+
+        return packet;
+    }
+    //-----------------------------------------------------------------------------------
+    float* HlmsInk::writeLights( Light const * const *lights, const uint32 *globalIndices,
+                                 size_t numLights, bool fullPacket,
+                                 const Matrix4 &viewMatrix, float *lightsPtr )
+    {
+        //Positions & directions are rotated by the view matrix in SoA form
+        //ARRAY_PACKED_REALS at a time. The translation is added while scattering,
+        //since it doesn't apply to directional lights.
+        Matrix3 viewMatrix3;
+        viewMatrix.extract3x3Matrix( viewMatrix3 );
+        const Vector3 viewTranslation = viewMatrix.getTrans();
+
+        OGRE_ALIGNED_DECL( Matrix4, aosViewRotation[ARRAY_PACKED_REALS], OGRE_SIMD_ALIGNMENT );
+        for( size_t j=0; j<ARRAY_PACKED_REALS; ++j )
+            aosViewRotation[j] = Matrix4( viewMatrix3 );
+
+        ArrayMatrixAf4x3 arrayViewRotation;
+        arrayViewRotation.loadFromAoS( aosViewRotation );
+
+        for( size_t i=0; i<numLights; i += ARRAY_PACKED_REALS )
+        {
+            const size_t numInBlock = std::min<size_t>( ARRAY_PACKED_REALS, numLights - i );
+
+            ArrayVector3 positions( ArrayVector3::ZERO );
+            ArrayVector3 directions( ArrayVector3::ZERO );
+            LightPacket const *packets[ARRAY_PACKED_REALS];
+
+            for( size_t j=0; j<numInBlock; ++j )
+            {
+                const Light *light = lights[i + j];
+                packets[j] = &getLightPacket( light, globalIndices[i + j] );
+
+                const Vector4 lightPos4 = light->getAs4DVector();
+                positions.setFromVector3( Vector3( lightPos4.x, lightPos4.y, lightPos4.z ), j );
+                if( fullPacket )
+                    directions.setFromVector3( light->getDerivedDirection(), j );
+            }
+
+            positions   = arrayViewRotation * positions;
+            directions  = arrayViewRotation * directions;
+
+            for( size_t j=0; j<numInBlock; ++j )
+            {
+                const Light *light = lights[i + j];
+
+                //vec3 lights[numLights].position
+                Vector3 lightPos;
+                positions.getAsVector3( lightPos, j );
+                if( light->getType() != Light::LT_DIRECTIONAL )
+                    lightPos += viewTranslation;
+
+                *lightsPtr++ = lightPos.x;
+                *lightsPtr++ = lightPos.y;
+                *lightsPtr++ = lightPos.z;
+                ++lightsPtr;
+
+                //vec3 lights[numLights].diffuse
+                //vec3 lights[numLights].specular
+                if( !fullPacket )
+                {
+                    memcpy( lightsPtr, packets[j]->gpuData, 4 * 2 * sizeof(float) );
+                    lightsPtr += 4 * 2;
+                    continue;
+                }
+
+                //vec3 lights[numLights].attenuation;
+                memcpy( lightsPtr, packets[j]->gpuData, 4 * 3 * sizeof(float) );
+                lightsPtr += 4 * 3;
+
+                //vec3 lights[numLights].spotDirection;
+                Vector3 spotDir;
+                directions.getAsVector3( spotDir, j );
+                *lightsPtr++ = spotDir.x;
+                *lightsPtr++ = spotDir.y;
+                *lightsPtr++ = spotDir.z;
+                ++lightsPtr;
+
+                //vec3 lights[numLights].spotParams;
+                memcpy( lightsPtr, packets[j]->gpuData + 12, 4 * sizeof(float) );
+                lightsPtr += 4;
+            }
+        }
+
+        return lightsPtr;
+    }
+    //-----------------------------------------------------------------------------------
+    uint32 HlmsInk::findPassBufferWithInputs( uint32 inputsHash ) const
+    {
+        const size_t numInputs = mPassInputsScratch.size();
+
+        for( uint32 i=0; i<mCurrentPassBuffer; ++i )
+        {
+            const PassBufferBlock &passBlock = mPassBufferBlocks[i];
+            if( passBlock.shareable && passBlock.hash == inputsHash &&
+                passBlock.inputs.size() == numInputs &&
+                !memcmp( passBlock.inputs.begin(), mPassInputsScratch.begin(),
+                         numInputs * sizeof(uint32) ) )
+            {
+                return i;
+            }
+        }
+
+        return mCurrentPassBuffer;
+    }
+    //-----------------------------------------------------------------------------------
+    void* HlmsInk::mapFromRing( BufferRing &ring, size_t sizeBytes, bool isTexBuffer,
+                                BufferPacked **outBuffer, size_t *outOffset )
+    {
+        const size_t alignment = isTexBuffer ? mVaoManager->getTexBufferAlignment() :
+                                               mVaoManager->getConstBufferAlignment();
+
+        size_t offset = alignToNextMultiple( ring.currentOffset, alignment );
+
+        while( ring.currentBuffer < ring.buffers.size() &&
+               offset + sizeBytes > ring.buffers[ring.currentBuffer]->getTotalSizeBytes() )
+        {
+            ++ring.currentBuffer;
+            offset = 0;
+        }
+
+        if( ring.currentBuffer == ring.buffers.size() )
         {
-            //vec2 depthRange;
-            Real fNear, fFar;
-            shadowNode->getMinMaxDepthRange( camera, fNear, fFar );
-            const Real depthRange = fFar - fNear;
-            *passBufferPtr++ = fNear;
-            *passBufferPtr++ = 1.0f / depthRange;
-            passBufferPtr += 2;
-        }
+            const size_t bufferSize = std::max( mPassBufferRingSize, sizeBytes );
 
-        passBufferPtr = mListener->preparePassBuffer( shadowNode, casterPass, dualParaboloid,
-                                                      sceneManager, passBufferPtr );
+            BufferPacked *newBuffer = 0;
+            if( isTexBuffer )
+            {
+                newBuffer = mVaoManager->createTexBuffer( PF_FLOAT32_RGBA, bufferSize,
+                                                          BT_DYNAMIC_PERSISTENT, 0, false );
+            }
+            else
+            {
+                newBuffer = mVaoManager->createConstBuffer( bufferSize, BT_DYNAMIC_PERSISTENT,
+                                                            0, false );
+            }
 
-        assert( (size_t)(passBufferPtr - startupPtr) * 4u == mapSize );
+            ring.buffers.push_back( newBuffer );
+            offset = 0;
+        }
 
-        passBuffer->unmap( UO_KEEP_PERSISTENT );
+        BufferPacked *buffer = ring.buffers[ring.currentBuffer];
 
-        //mTexBuffers must hold at least one buffer to prevent out of bound exceptions.
-        if( mTexBuffers.empty() )
-        {
-            size_t bufferSize = std::min<size_t>( mTextureBufferDefaultSize,
-                                                  mVaoManager->getTexBufferMaxSize() );
-            TexBufferPacked *newBuffer = mVaoManager->createTexBuffer( PF_FLOAT32_RGBA, bufferSize,
-                                                                       BT_DYNAMIC_PERSISTENT, 0, false );
-            mTexBuffers.push_back( newBuffer );
-        }
+        //Written to the next frame's region. It becomes the one
+        //the GPU reads when advanceRing gets called.
+        void *retVal = buffer->map( offset, sizeBytes, false );
 
-        mLastTextureHash = 0;
+        ring.currentOffset = offset + sizeBytes;
 
-        mLastBoundPool = 0;
+        *outBuffer = buffer;
+        *outOffset = offset;
 
-        if( mShadowmapSamplerblock && !getProperty( HlmsBaseProp::ShadowUsesDepthTexture ) )
-            mCurrentShadowmapSamplerblock = mShadowmapSamplerblock;
-        else
-            mCurrentShadowmapSamplerblock = mShadowmapCmpSamplerblock;
+        return retVal;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::advanceRing( BufferRing &ring )
+    {
+        const size_t numUsed = std::min( ring.currentBuffer + (ring.currentOffset ? 1u : 0u),
+                                         ring.buffers.size() );
+
+        //Advancing twice in the same frame would show the GPU the wrong region.
+        for( size_t i=ring.numAdvanced; i<numUsed; ++i )
+            ring.buffers[i]->advanceFrame();
+
+        //Whatever is left in the last buffer can't be mapped again
+        //this frame (it would map the region after the one just advanced).
+        ring.currentBuffer  = numUsed;
+        ring.currentOffset  = 0;
+        ring.numAdvanced    = numUsed;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::destroyRing( BufferRing &ring, bool isTexBuffer )
+    {
+        BufferRing::BufferPackedVec::const_iterator itor = ring.buffers.begin();
+        BufferRing::BufferPackedVec::const_iterator end  = ring.buffers.end();
 
-        mTexUnitSlotStart = mPreparedPass.shadowMaps.size() + 1;
-        if( mGridBuffer )
-            mTexUnitSlotStart += 2;
-        if( mIrradianceVolume )
-            mTexUnitSlotStart += 1;
-        if( mParallaxCorrectedCubemap )
-            mTexUnitSlotStart += 1;
+        while( itor != end )
+        {
+            if( (*itor)->getMappingState() != MS_UNMAPPED )
+                (*itor)->unmap( UO_UNMAP_ALL );
 
-        uploadDirtyDatablocks();
+            if( isTexBuffer )
+                mVaoManager->destroyTexBuffer( static_cast<TexBufferPacked*>( *itor ) );
+            else
+                mVaoManager->destroyConstBuffer( static_cast<ConstBufferPacked*>( *itor ) );
+            ++itor;
+        }
 
-        return retVal;
+        ring.buffers.clear();
+        ring.currentBuffer = 0;
+        ring.currentOffset = 0;
+        ring.numAdvanced   = 0;
     }
     //-----------------------------------------------------------------------------------
     uint32 HlmsInk::fillBuffersFor( const HlmsCache *cache, const QueuedRenderable &queuedRenderable,
@@ -1259,22 +3410,26 @@ namespace Ogre
         const HlmsInkDatablock *datablock = static_cast<const HlmsInkDatablock*>(
                                                 queuedRenderable.renderable->getDatablock() );
 
+        const PassBufferBlock &passBlock = mPassBufferBlocks[mActivePassBuffer];
+
         if( OGRE_EXTRACT_HLMS_TYPE_FROM_CACHE_HASH( lastCacheHash ) != HLMS_USER0 )
         {
             //layout(binding = 0) uniform PassBuffer {} pass
-            ConstBufferPacked *passBuffer = mPassBuffers[mCurrentPassBuffer-1];
-            *commandBuffer->addCommand<CbShaderBuffer>() = CbShaderBuffer( VertexShader,
-                                                                           0, passBuffer, 0,
-                                                                           passBuffer->
-                                                                           getTotalSizeBytes() );
-			*commandBuffer->addCommand<CbShaderBuffer>() = CbShaderBuffer(GeometryShader,
-																		  0, passBuffer, 0,
-																		  passBuffer->
-																		  getTotalSizeBytes());
-            *commandBuffer->addCommand<CbShaderBuffer>() = CbShaderBuffer( PixelShader,
-                                                                           0, passBuffer, 0,
-                                                                           passBuffer->
-                                                                           getTotalSizeBytes() );
+            //Every Hlms binds its own pass buffer, so the VS one is always rebound.
+            //That command also marks the end of what other Hlms have added.
+            CbShaderBuffer *passBufferCmd = commandBuffer->addCommand<CbShaderBuffer>();
+            *passBufferCmd = CbShaderBuffer( VertexShader, 0, passBlock.buffer,
+                                             passBlock.offset, passBlock.sizeBytes );
+            syncBindingsWithCommandBuffer( commandBuffer, passBufferCmd );
+
+            //The GS one is bound lazily when a PSO actually has a geometry shader.
+            if( !cache->pso.geometryShader.isNull() )
+            {
+                bindConstBuffer( commandBuffer, GeometryShader, 0, passBlock.buffer,
+                                 passBlock.offset, passBlock.sizeBytes );
+            }
+            bindConstBuffer( commandBuffer, PixelShader, 0, passBlock.buffer,
+                             passBlock.offset, passBlock.sizeBytes );
 
             if( !casterPass )
             {
@@ -1283,10 +3438,8 @@ namespace Ogre
                 if( mGridBuffer )
                 {
                     texUnit = 3;
-                    *commandBuffer->addCommand<CbShaderBuffer>() =
-                            CbShaderBuffer( PixelShader, 1, mGridBuffer, 0, 0 );
-                    *commandBuffer->addCommand<CbShaderBuffer>() =
-                            CbShaderBuffer( PixelShader, 2, mGlobalLightListBuffer, 0, 0 );
+                    bindTexBuffer( commandBuffer, PixelShader, 1, mGridBuffer, 0, 0 );
+                    bindTexBuffer( commandBuffer, PixelShader, 2, mGlobalLightListBuffer, 0, 0 );
                 }
 
                 if( mIrradianceVolume )
@@ -1294,9 +3447,7 @@ namespace Ogre
                     const TexturePtr &irradianceTex = mIrradianceVolume->getIrradianceVolumeTexture();
                     const HlmsSamplerblock *samplerblock = mIrradianceVolume->getIrradSamplerblock();
 
-                    *commandBuffer->addCommand<CbTexture>() = CbTexture( texUnit, true,
-                                                                         irradianceTex.get(),
-                                                                         samplerblock );
+                    bindTexture( commandBuffer, texUnit, irradianceTex.get(), samplerblock );
                     ++texUnit;
                 }
 
@@ -1305,8 +3456,7 @@ namespace Ogre
                 FastArray<TexturePtr>::const_iterator end  = mPreparedPass.shadowMaps.end();
                 while( itor != end )
                 {
-                    *commandBuffer->addCommand<CbTexture>() = CbTexture( texUnit, true, itor->get(),
-                                                                         mCurrentShadowmapSamplerblock );
+                    bindTexture( commandBuffer, texUnit, itor->get(), mCurrentShadowmapSamplerblock );
                     ++texUnit;
                     ++itor;
                 }
@@ -1316,14 +3466,13 @@ namespace Ogre
                     Texture *pccTexture = mParallaxCorrectedCubemap->getBlendCubemap().get();
                     const HlmsSamplerblock *samplerblock =
                             mParallaxCorrectedCubemap->getBlendCubemapTrilinearSamplerblock();
-                    *commandBuffer->addCommand<CbTexture>() = CbTexture( texUnit, true, pccTexture,
-                                                                         samplerblock );
+                    bindTexture( commandBuffer, texUnit, pccTexture, samplerblock );
                     ++texUnit;
                 }
             }
             else
             {
-                *commandBuffer->addCommand<CbTextureDisableFrom>() = CbTextureDisableFrom( 1 );
+                disableTexturesFrom( commandBuffer, 1 );
             }
 
             mLastTextureHash = 0;
@@ -1334,15 +3483,35 @@ namespace Ogre
                 (size_t)((mCurrentMappedConstBuffer - mStartMappedConstBuffer) + 4) <=
                     mCurrentConstBufferSize )
             {
-                *commandBuffer->addCommand<CbShaderBuffer>() =
-                        CbShaderBuffer( VertexShader, 2, mConstBuffers[mCurrentConstBuffer], 0, 0 );
-                *commandBuffer->addCommand<CbShaderBuffer>() =
-                        CbShaderBuffer( PixelShader, 2, mConstBuffers[mCurrentConstBuffer], 0, 0 );
+                bindConstBuffer( commandBuffer, VertexShader, 2,
+                                 mConstBuffers[mCurrentConstBuffer], 0, 0 );
+                bindConstBuffer( commandBuffer, PixelShader, 2,
+                                 mConstBuffers[mCurrentConstBuffer], 0, 0 );
             }
 
             rebindTexBuffer( commandBuffer );
 
             mListener->hlmsTypeChanged( casterPass, commandBuffer, datablock );
+
+            //We can't see what the listener bound until the next sync. Note that
+            //rebindTexBuffer & mapNextConstBuffer bind slots we never elide.
+            invalidateBindings();
+        }
+        else if( cache->hash != lastCacheHash && !cache->pso.geometryShader.isNull() )
+        {
+            bindConstBuffer( commandBuffer, GeometryShader, 0, passBlock.buffer,
+                             passBlock.offset, passBlock.sizeBytes );
+        }
+
+        if( mTrackCoOccurrence && !casterPass && mLastDrawnDatablock != datablock )
+        {
+            if( mLastDrawnDatablock )
+            {
+                const DatablockPair key( std::min( mLastDrawnDatablock, datablock ),
+                                         std::max( mLastDrawnDatablock, datablock ) );
+                ++mCoOccurrence[key];
+            }
+            mLastDrawnDatablock = datablock;
         }
 
         //Don't bind the material buffer on caster passes (important to keep
@@ -1352,19 +3521,16 @@ namespace Ogre
         {
             //layout(binding = 1) uniform MaterialBuf {} materialArray
             const ConstBufferPool::BufferPool *newPool = datablock->getAssignedPool();
-            *commandBuffer->addCommand<CbShaderBuffer>() = CbShaderBuffer( PixelShader,
-                                                                           1, newPool->materialBuffer, 0,
-                                                                           newPool->materialBuffer->
-                                                                           getTotalSizeBytes() );
+            bindConstBuffer( commandBuffer, PixelShader, 1, newPool->materialBuffer, 0,
+                             newPool->materialBuffer->getTotalSizeBytes() );
             CubemapProbe *manualProbe = datablock->getCubemapProbe();
             if( manualProbe )
             {
                 ConstBufferPacked *probeConstBuf = manualProbe->getConstBufferForManualProbes();
-                *commandBuffer->addCommand<CbShaderBuffer>() = CbShaderBuffer( PixelShader,
-                                                                               3, probeConstBuf,
-                                                                               0, 0 );
+                bindConstBuffer( commandBuffer, PixelShader, 3, probeConstBuf, 0, 0 );
             }
             mLastBoundPool = newPool;
+            ++mCurrentPassStats.numPoolRebinds;
         }
 
         uint32 * RESTRICT_ALIAS currentMappedConstBuffer    = mCurrentMappedConstBuffer;
@@ -1395,11 +3561,18 @@ namespace Ogre
             if( exceedsConstBuffer || exceedsTexBuffer )
             {
                 currentMappedConstBuffer = mapNextConstBuffer( commandBuffer );
+                ++mCurrentPassStats.numConstBufferMaps;
 
                 if( exceedsTexBuffer )
+                {
+                    flushRecordingJobs();
                     mapNextTexBuffer( commandBuffer, minimumTexBufferSize * sizeof(float) );
+                    ++mCurrentPassStats.numTexBufferMaps;
+                }
                 else
+                {
                     rebindTexBuffer( commandBuffer, true, minimumTexBufferSize * sizeof(float) );
+                }
 
                 currentMappedTexBuffer = mCurrentMappedTexBuffer;
             }
@@ -1407,121 +3580,112 @@ namespace Ogre
             //uint worldMaterialIdx[]
             *currentMappedConstBuffer = datablock->getAssignedSlot() & 0x1FF;
 
-            //mat4x3 world
-#if !OGRE_DOUBLE_PRECISION
-            memcpy( currentMappedTexBuffer, &worldMat, 4 * 3 * sizeof( float ) );
-            currentMappedTexBuffer += 16;
-#else
-            for( int y = 0; y < 3; ++y )
+            //mat4x3 world & mat4 worldView. When recording in parallel they're deferred
+            //so the workers can compute them in batches of ARRAY_PACKED_REALS.
+            if( mParallelRecording )
             {
-                for( int x = 0; x < 4; ++x )
-                {
-                    *currentMappedTexBuffer++ = worldMat[ y ][ x ];
-                }
+                InstanceWriteJob job;
+                job.worldMat        = &worldMat;
+                job.texBufferPtr    = currentMappedTexBuffer;
+                job.casterPass      = casterPass;
+                mInstanceWriteJobs.push_back( job );
             }
-            currentMappedTexBuffer += 4;
-#endif
-
-            //mat4 worldView
-            Matrix4 tmp = mPreparedPass.viewMatrix.concatenateAffine( worldMat );
-    #ifdef OGRE_GLES2_WORKAROUND_1
-            tmp = tmp.transpose();
-#endif
-#if !OGRE_DOUBLE_PRECISION
-            memcpy( currentMappedTexBuffer, &tmp, sizeof( Matrix4 ) * !casterPass );
-            currentMappedTexBuffer += 16 * !casterPass;
-#else
-            if( !casterPass )
+            else
             {
-                for( int y = 0; y < 4; ++y )
-                {
-                    for( int x = 0; x < 4; ++x )
-                    {
-                        *currentMappedTexBuffer++ = tmp[ y ][ x ];
-                    }
-                }
+                writeInstanceMatrices( worldMat, mPreparedPass.viewMatrix,
+                                       currentMappedTexBuffer, casterPass );
             }
-#endif
+
+            currentMappedTexBuffer += 16 + 16 * !casterPass;
+
+            ++mCurrentPassStats.numRenderables;
+            mCurrentPassStats.texBufferBytes += (16 + 16 * !casterPass) * sizeof(float);
         }
         else
         {
             bool exceedsConstBuffer = (size_t)((currentMappedConstBuffer - mStartMappedConstBuffer) + 4)
                                         > mCurrentConstBufferSize;
 
-            if( isV1 )
-            {
-                uint16 numWorldTransforms = queuedRenderable.renderable->getNumWorldTransforms();
-                assert( numWorldTransforms <= 256u );
-
-                const size_t minimumTexBufferSize = 12 * numWorldTransforms;
-                bool exceedsTexBuffer = (currentMappedTexBuffer - mStartMappedTexBuffer) +
-                        minimumTexBufferSize >= mCurrentTexBufferSize;
-
-                if( exceedsConstBuffer || exceedsTexBuffer )
-                {
-                    currentMappedConstBuffer = mapNextConstBuffer( commandBuffer );
-
-                    if( exceedsTexBuffer )
-                        mapNextTexBuffer( commandBuffer, minimumTexBufferSize * sizeof(float) );
-                    else
-                        rebindTexBuffer( commandBuffer, true, minimumTexBufferSize * sizeof(float) );
-
-                    currentMappedTexBuffer = mCurrentMappedTexBuffer;
-                }
+            validateBonePaletteCache();
 
-                //uint worldMaterialIdx[]
-                size_t distToWorldMatStart = mCurrentMappedTexBuffer - mStartMappedTexBuffer;
-                distToWorldMatStart >>= 2;
-                *currentMappedConstBuffer = (distToWorldMatStart << 9 ) |
-                        (datablock->getAssignedSlot() & 0x1FF);
+            void const *paletteOwner = 0;
+            void const *paletteIndexMap = 0;
+            uint32 numBones = 0;
+            SkeletonInstance *skeleton = 0;
+            const RenderableAnimated *renderableAnimated = 0;
 
-                //vec4 worldMat[][3]
-                //TODO: Don't rely on a virtual function + make a direct 4x3 copy
-                Matrix4 tmp[256];
-                queuedRenderable.renderable->getWorldTransforms( tmp );
-                for( size_t i=0; i<numWorldTransforms; ++i )
-                {
-#if !OGRE_DOUBLE_PRECISION
-                    memcpy( currentMappedTexBuffer, &tmp[ i ], 12 * sizeof( float ) );
-                    currentMappedTexBuffer += 12;
-#else
-                    for( int y = 0; y < 3; ++y )
-                    {
-                        for( int x = 0; x < 4; ++x )
-                        {
-                            *currentMappedTexBuffer++ = tmp[ i ][ y ][ x ];
-                        }
-                    }
+            if( isV1 )
+            {
+#if OGRE_DEBUG_MODE
+                assert( dynamic_cast<const v1::SubEntity*>( queuedRenderable.renderable ) );
 #endif
-                }
+
+                //SubEntities of the same Entity reading the bones through the same
+                //index map end up with the same palette.
+                const v1::SubEntity *subEntity =
+                        static_cast<const v1::SubEntity*>( queuedRenderable.renderable );
+                const v1::SubMesh *subMesh = subEntity->getSubMesh();
+
+                paletteOwner    = queuedRenderable.movableObject;
+                paletteIndexMap = subMesh->useSharedVertices ?
+                                      &subMesh->parent->sharedBlendIndexToBoneIndexMap :
+                                      &subMesh->blendIndexToBoneIndexMap;
+                numBones        = queuedRenderable.renderable->getNumWorldTransforms();
+                assert( numBones <= 256u );
             }
             else
             {
-                SkeletonInstance *skeleton = queuedRenderable.movableObject->getSkeletonInstance();
+                skeleton = queuedRenderable.movableObject->getSkeletonInstance();
 
 #if OGRE_DEBUG_MODE
                 assert( dynamic_cast<const RenderableAnimated*>( queuedRenderable.renderable ) );
 #endif
 
-                const RenderableAnimated *renderableAnimated = static_cast<const RenderableAnimated*>(
-                                                                        queuedRenderable.renderable );
+                renderableAnimated = static_cast<const RenderableAnimated*>( queuedRenderable.renderable );
+
+                const RenderableAnimated::IndexMap *indexMap =
+                        renderableAnimated->getBlendIndexToBoneIndexMap();
+
+                paletteOwner    = skeleton;
+                paletteIndexMap = indexMap;
+                numBones        = static_cast<uint32>( indexMap->size() );
+            }
 
-                const RenderableAnimated::IndexMap *indexMap = renderableAnimated->getBlendIndexToBoneIndexMap();
+            //Mapping a new const buffer rebinds the tex buffer, which would invalidate the palette.
+            const BonePalette *cachedPalette = 0;
+            if( !exceedsConstBuffer )
+                cachedPalette = findBonePalette( paletteOwner, paletteIndexMap, isV1, numBones );
 
-                const size_t minimumTexBufferSize = 12 * indexMap->size();
+            if( cachedPalette )
+            {
+                //uint worldMaterialIdx[]
+                *currentMappedConstBuffer = (cachedPalette->distToWorldMatStart << 9 ) |
+                        (datablock->getAssignedSlot() & 0x1FF);
+            }
+            else
+            {
+                const size_t minimumTexBufferSize = 12 * numBones;
                 bool exceedsTexBuffer = (currentMappedTexBuffer - mStartMappedTexBuffer) +
                                             minimumTexBufferSize >= mCurrentTexBufferSize;
 
                 if( exceedsConstBuffer || exceedsTexBuffer )
                 {
                     currentMappedConstBuffer = mapNextConstBuffer( commandBuffer );
+                    ++mCurrentPassStats.numConstBufferMaps;
 
                     if( exceedsTexBuffer )
+                    {
+                        flushRecordingJobs();
                         mapNextTexBuffer( commandBuffer, minimumTexBufferSize * sizeof(float) );
+                        ++mCurrentPassStats.numTexBufferMaps;
+                    }
                     else
+                    {
                         rebindTexBuffer( commandBuffer, true, minimumTexBufferSize * sizeof(float) );
+                    }
 
                     currentMappedTexBuffer = mCurrentMappedTexBuffer;
+                    validateBonePaletteCache();
                 }
 
                 //uint worldMaterialIdx[]
@@ -1530,19 +3694,53 @@ namespace Ogre
                 *currentMappedConstBuffer = (distToWorldMatStart << 9 ) |
                         (datablock->getAssignedSlot() & 0x1FF);
 
-                RenderableAnimated::IndexMap::const_iterator itBone = indexMap->begin();
-                RenderableAnimated::IndexMap::const_iterator enBone = indexMap->end();
-
-                while( itBone != enBone )
+                //vec4 worldMat[][3]
+                if( isV1 )
                 {
-                    const SimpleMatrixAf4x3 &mat4x3 = skeleton->_getBoneFullTransform( *itBone );
-                    mat4x3.streamTo4x3( currentMappedTexBuffer );
-                    currentMappedTexBuffer += 12;
+                    //getWorldTransforms is the only public access to v1 bone matrices.
+                    Matrix4 tmp[256];
+                    queuedRenderable.renderable->getWorldTransforms( tmp );
 
-                    ++itBone;
+                    float * RESTRICT_ALIAS texBufferPtr = currentMappedTexBuffer;
+                    for( size_t i=0; i<numBones; ++i )
+                    {
+#if !OGRE_DOUBLE_PRECISION
+                        memcpy( texBufferPtr, &tmp[ i ], 12 * sizeof( float ) );
+                        texBufferPtr += 12;
+#else
+                        for( int y = 0; y < 3; ++y )
+                        {
+                            for( int x = 0; x < 4; ++x )
+                            {
+                                *texBufferPtr++ = tmp[ i ][ y ][ x ];
+                            }
+                        }
+#endif
+                    }
+                }
+                else if( mParallelRecording )
+                {
+                    BonePaletteWriteJob job;
+                    job.skeleton            = skeleton;
+                    job.renderableAnimated  = renderableAnimated;
+                    job.texBufferPtr        = currentMappedTexBuffer;
+                    mBonePaletteWriteJobs.push_back( job );
+                }
+                else
+                {
+                    writeBonePalette( skeleton, renderableAnimated, currentMappedTexBuffer );
                 }
+
+                addBonePalette( paletteOwner, paletteIndexMap, numBones,
+                                static_cast<uint32>( distToWorldMatStart ) );
+
+                currentMappedTexBuffer += 12 * numBones;
+
+                mCurrentPassStats.texBufferBytes += 12 * numBones * sizeof(float);
             }
 
+            ++mCurrentPassStats.numSkinnedRenderables;
+
             //If the next entity will not be skeletally animated, we'll need
             //currentMappedTexBuffer to be 16/32-byte aligned.
             //Non-skeletally animated objects are far more common than skeletal ones,
@@ -1555,7 +3753,33 @@ namespace Ogre
 
         *reinterpret_cast<float * RESTRICT_ALIAS>( currentMappedConstBuffer+1 ) = datablock->
                                                                                     mShadowConstantBias;
+
+        if( !casterPass )
+        {
+            //Ink params (half2 dryness & density) and RGBA8 tint.
+            uint32 inkParams = datablock->mInkParamsHalf2;
+            uint32 inkTint = 0xFFFFFFFF;
+
+            //Overrides are rare; don't search every renderable's custom parameters.
+            const Renderable *renderable = queuedRenderable.renderable;
+            if( msNumInstanceInkOverrides &&
+                renderable->hasCustomParameter( CustomParamInkParams ) )
+            {
+                //setInstanceInkParameters always sets both.
+                const Vector4 &params = renderable->getCustomParameter( CustomParamInkParams );
+                inkParams = Bitwise::floatToHalf( params.x ) |
+                            (static_cast<uint32>( Bitwise::floatToHalf( params.y ) ) << 16u);
+
+                const Vector4 &tint = renderable->getCustomParameter( CustomParamInkTint );
+                inkTint = ColourValue( tint.x, tint.y, tint.z, tint.w ).getAsABGR();
+            }
+
+            currentMappedConstBuffer[2] = inkParams;
+            currentMappedConstBuffer[3] = inkTint;
+        }
+
         currentMappedConstBuffer += 4;
+        mCurrentPassStats.constBufferBytes += 4 * sizeof(uint32);
 
         //---------------------------------------------------------------------------
         //                          ---- PIXEL SHADER ----
@@ -1565,7 +3789,8 @@ namespace Ogre
         {
             if( datablock->mTextureHash != mLastTextureHash )
             {
-                //Rebind textures
+                //Rebind textures. Only the slots that hold something different get a
+                //command; materials sharing texture arrays often differ in a few slots.
                 size_t texUnit = mTexUnitSlotStart;
 
                 InkBakedTextureArray::const_iterator itor = datablock->mBakedTextures.begin();
@@ -1575,13 +3800,13 @@ namespace Ogre
                 {
                     if( itor->texture != mTargetEnvMap )
                     {
-                        *commandBuffer->addCommand<CbTexture>() =
-                                CbTexture( texUnit++, true, itor->texture.get(), itor->samplerBlock );
+                        bindTexture( commandBuffer, texUnit++, itor->texture.get(),
+                                     itor->samplerBlock );
                     }
                     ++itor;
                 }
 
-                *commandBuffer->addCommand<CbTextureDisableFrom>() = CbTextureDisableFrom( texUnit );
+                disableTexturesFrom( commandBuffer, texUnit );
 
                 mLastTextureHash = datablock->mTextureHash;
             }
@@ -1593,32 +3818,235 @@ namespace Ogre
         return ((mCurrentMappedConstBuffer - mStartMappedConstBuffer) >> 2) - 1;
     }
     //-----------------------------------------------------------------------------------
-    void HlmsInk::destroyAllBuffers(void)
+    void HlmsInk::writeInstanceMatrices( const Matrix4 &worldMat, const Matrix4 &viewMatrix,
+                                         float * RESTRICT_ALIAS texBufferPtr, bool casterPass )
     {
-        HlmsBufferManager::destroyAllBuffers();
+        //mat4x3 world
+#if !OGRE_DOUBLE_PRECISION
+        memcpy( texBufferPtr, &worldMat, 4 * 3 * sizeof( float ) );
+        texBufferPtr += 16;
+#else
+        for( int y = 0; y < 3; ++y )
+        {
+            for( int x = 0; x < 4; ++x )
+            {
+                *texBufferPtr++ = worldMat[ y ][ x ];
+            }
+        }
+        texBufferPtr += 4;
+#endif
 
-        mCurrentPassBuffer  = 0;
+        if( casterPass )
+            return;
 
+        //mat4 worldView
+        Matrix4 tmp = viewMatrix.concatenateAffine( worldMat );
+#ifdef OGRE_GLES2_WORKAROUND_1
+        tmp = tmp.transpose();
+#endif
+#if !OGRE_DOUBLE_PRECISION
+        memcpy( texBufferPtr, &tmp, sizeof( Matrix4 ) );
+#else
+        for( int y = 0; y < 4; ++y )
         {
-            ConstBufferPackedVec::const_iterator itor = mPassBuffers.begin();
-            ConstBufferPackedVec::const_iterator end  = mPassBuffers.end();
+            for( int x = 0; x < 4; ++x )
+            {
+                *texBufferPtr++ = tmp[ y ][ x ];
+            }
+        }
+#endif
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::writeInstanceMatricesBatched( const InstanceWriteJob *jobStart,
+                                                const InstanceWriteJob *jobEnd,
+                                                const Matrix4 &viewMatrix )
+    {
+        const InstanceWriteJob *itor = jobStart;
 
-            while( itor != end )
+#if !OGRE_DOUBLE_PRECISION && !defined( OGRE_GLES2_WORKAROUND_1 )
+        OGRE_ALIGNED_DECL( Matrix4, aosMatrices[ARRAY_PACKED_REALS], OGRE_SIMD_ALIGNMENT );
+
+        for( size_t j=0; j<ARRAY_PACKED_REALS; ++j )
+            aosMatrices[j] = viewMatrix;
+
+        ArrayMatrixAf4x3 arrayViewMatrix;
+        arrayViewMatrix.loadFromAoS( aosMatrices );
+
+        while( jobEnd - itor >= ARRAY_PACKED_REALS )
+        {
+            for( size_t j=0; j<ARRAY_PACKED_REALS; ++j )
             {
-                if( (*itor)->getMappingState() != MS_UNMAPPED )
-                    (*itor)->unmap( UO_UNMAP_ALL );
-                mVaoManager->destroyConstBuffer( *itor );
-                ++itor;
+                const InstanceWriteJob &job = itor[j];
+                aosMatrices[j] = *job.worldMat;
+
+                //mat4x3 world
+                memcpy( job.texBufferPtr, job.worldMat, 4 * 3 * sizeof( float ) );
+            }
+
+            ArrayMatrixAf4x3 arrayWorldMatrix;
+            arrayWorldMatrix.loadFromAoS( aosMatrices );
+            const ArrayMatrixAf4x3 arrayWorldView = arrayViewMatrix * arrayWorldMatrix;
+            arrayWorldView.storeToAoS( aosMatrices );
+
+            //mat4 worldView
+            for( size_t j=0; j<ARRAY_PACKED_REALS; ++j )
+            {
+                const InstanceWriteJob &job = itor[j];
+                if( !job.casterPass )
+                    memcpy( job.texBufferPtr + 16, &aosMatrices[j], sizeof( Matrix4 ) );
+            }
+
+            itor += ARRAY_PACKED_REALS;
+        }
+#endif
+
+        //Remainder (or the whole range when there's no SIMD friendly layout)
+        while( itor != jobEnd )
+        {
+            writeInstanceMatrices( *itor->worldMat, viewMatrix, itor->texBufferPtr, itor->casterPass );
+            ++itor;
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::writeBonePalette( const SkeletonInstance *skeleton,
+                                    const RenderableAnimated *renderableAnimated,
+                                    float * RESTRICT_ALIAS texBufferPtr )
+    {
+        const RenderableAnimated::IndexMap *indexMap = renderableAnimated->getBlendIndexToBoneIndexMap();
+
+        RenderableAnimated::IndexMap::const_iterator itBone = indexMap->begin();
+        RenderableAnimated::IndexMap::const_iterator enBone = indexMap->end();
+
+        while( itBone != enBone )
+        {
+            const SimpleMatrixAf4x3 &mat4x3 = skeleton->_getBoneFullTransform( *itBone );
+            mat4x3.streamTo4x3( texBufferPtr );
+            texBufferPtr += 12;
+
+            ++itBone;
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::execute( size_t threadId, size_t numThreads )
+    {
+        //Each worker gets a contiguous slice of the jobs, which also means
+        //a contiguous region of the mapped tex buffer.
+        {
+            const size_t numJobs    = mInstanceWriteJobs.size();
+            const size_t jobStart   = (numJobs * threadId) / numThreads;
+            const size_t jobEnd     = (numJobs * (threadId + 1u)) / numThreads;
+
+            writeInstanceMatricesBatched( mInstanceWriteJobs.begin() + jobStart,
+                                          mInstanceWriteJobs.begin() + jobEnd,
+                                          mPreparedPass.viewMatrix );
+        }
+
+        {
+            const size_t numJobs    = mBonePaletteWriteJobs.size();
+            const size_t jobStart   = (numJobs * threadId) / numThreads;
+            const size_t jobEnd     = (numJobs * (threadId + 1u)) / numThreads;
+
+            for( size_t i=jobStart; i<jobEnd; ++i )
+            {
+                const BonePaletteWriteJob &job = mBonePaletteWriteJobs[i];
+                writeBonePalette( job.skeleton, job.renderableAnimated, job.texBufferPtr );
             }
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::flushRecordingJobs(void)
+    {
+        const size_t numJobs = mInstanceWriteJobs.size() + mBonePaletteWriteJobs.size();
+
+        if( !numJobs )
+            return;
 
-            mPassBuffers.clear();
+        if( mParallelRecording && mRecordingSceneManager &&
+            numJobs >= mParallelRecordingThreshold &&
+            mRecordingSceneManager->getNumWorkerThreads() > 1u )
+        {
+            mRecordingSceneManager->executeUserScalableTask( this, true );
+        }
+        else
+        {
+            execute( 0, 1 );
         }
+
+        mInstanceWriteJobs.clear();
+        mBonePaletteWriteJobs.clear();
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::setParallelRecording( bool enable, size_t minJobsPerDispatch )
+    {
+        flushRecordingJobs();
+        mParallelRecording          = enable;
+        mParallelRecordingThreshold = std::max<size_t>( minJobsPerDispatch, 1u );
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::preCommandBufferExecution( CommandBuffer *commandBuffer )
+    {
+        flushRecordingJobs();
+        HlmsBufferManager::preCommandBufferExecution( commandBuffer );
+
+        //The commands about to be executed reference the pass buffers written so far.
+        advanceRing( mPassBufferRing );
+
+        //The commands are about to be executed & cleared.
+        invalidateBindings();
+        mTrackedCommandBuffer = 0;
+        mTrackedCommandOffset = 0;
+
+        //The tex buffer gets unmapped; palettes can't be shared with the next mapping.
+        mBonePaletteCache.clear();
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::destroyAllBuffers(void)
+    {
+        mInstanceWriteJobs.clear();
+        mBonePaletteWriteJobs.clear();
+        mBonePaletteCache.clear();
+
+        HlmsBufferManager::destroyAllBuffers();
+
+        mCurrentPassBuffer  = 0;
+
+        destroyRing( mPassBufferRing, false );
+        mPassBufferBlocks.clear();
+
+        mActivePassBuffer = 0;
     }
     //-----------------------------------------------------------------------------------
     void HlmsInk::frameEnded(void)
     {
+        flushRecordingJobs();
         HlmsBufferManager::frameEnded();
+
+        compilePendingShaders();
+
+        closePassStats();
+        mLastFrameStats.totals = mCurrentFrameStats.totals;
+        mLastFrameStats.passes.swap( mCurrentFrameStats.passes );
+        mLastFrameStats.numPassBuffersAllocated = mCurrentFrameStats.numPassBuffersAllocated;
+        mLastFrameStats.numShaderCacheHits      = mCurrentFrameStats.numShaderCacheHits;
+        mLastFrameStats.numShaderCacheMisses    = mCurrentFrameStats.numShaderCacheMisses;
+        //Reset while keeping the passes' capacity.
+        mCurrentFrameStats.totals = PassStats();
+        mCurrentFrameStats.passes.clear();
+        mCurrentFrameStats.numPassBuffersAllocated  = 0;
+        mCurrentFrameStats.numShaderCacheHits       = 0;
+        mCurrentFrameStats.numShaderCacheMisses     = 0;
         mCurrentPassBuffer  = 0;
+
+        //In case some pass buffer was written but never executed.
+        advanceRing( mPassBufferRing );
+        mPassBufferRing.currentBuffer = 0;
+        mPassBufferRing.currentOffset = 0;
+        mPassBufferRing.numAdvanced   = 0;
+
+        mBonePaletteCache.clear();
+
+        //Packets get checked against their light again on their first use next frame.
+        ++mLightPacketsFrame;
     }
     //-----------------------------------------------------------------------------------
     void HlmsInk::setShadowSettings( ShadowFilter filter )
@@ -1650,6 +4078,35 @@ namespace Ogre
     {
         HlmsJsonInk::collectSamplerblocks( datablock, outSamplerblocks );
     }
+    //-----------------------------------------------------------------------------------
+    void HlmsInk::saveMaterials( String &outString )
+    {
+        //HlmsJson saves whatever is in mDatablocks; hide the LOD variants meanwhile.
+        HlmsDatablockMap lodVariants;
+
+        HlmsDatablockMap::iterator itor = mDatablocks.begin();
+        HlmsDatablockMap::iterator end  = mDatablocks.end();
+
+        while( itor != end )
+        {
+            const HlmsInkDatablock *datablock =
+                    static_cast<const HlmsInkDatablock*>( itor->second.datablock );
+            if( datablock->mLodParent )
+            {
+                lodVariants.insert( *itor );
+                mDatablocks.erase( itor++ );
+            }
+            else
+            {
+                ++itor;
+            }
+        }
+
+        HlmsJson hlmsJson( mHlmsManager );
+        hlmsJson.saveMaterials( this, outString );
+
+        mDatablocks.insert( lodVariants.begin(), lodVariants.end() );
+    }
 #endif
     //-----------------------------------------------------------------------------------
     HlmsDatablock* HlmsInk::createDatablockImpl( IdString datablockName,
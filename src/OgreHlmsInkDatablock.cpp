@@ -35,6 +35,7 @@ THE SOFTWARE.
 #include "OgreTexture.h"
 #include "OgreTextureManager.h"
 #include "OgreLogManager.h"
+#include "OgreBitwise.h"
 #include "Cubemaps/OgreCubemapProbe.h"
 
 namespace Ogre
@@ -51,6 +52,10 @@ namespace Ogre
     const size_t HlmsInkDatablock::MaterialSizeInGpuAligned   = alignToNextMultiple(
                                                                     HlmsInkDatablock::MaterialSizeInGpu,
                                                                     4 * 4 );
+    const size_t HlmsInkDatablock::MaterialSizeInGpuCompact   = alignToNextMultiple(
+                                                                    14 * 4 * 2 + 2 +
+                                                                    NUM_INK_TEXTURE_TYPES,
+                                                                    4 * 4 );
 
     //-----------------------------------------------------------------------------------
     HlmsInkDatablock::HlmsInkDatablock( IdString name, HlmsInk *creator,
@@ -72,7 +77,10 @@ namespace Ogre
         mTransparencyValue( 1.0f ),
         mNormalMapWeight( 1.0f ),
         mCubemapProbe( 0 ),
-        mBrdf( InkBrdf::Default )
+        mBrdf( InkBrdf::Default ),
+        mUpdateDepth( 0 ),
+        mPendingUpdates( 0 ),
+        mLodParent( 0 )
     {
         memset( mUvSource, 0, sizeof( mUvSource ) );
         memset( mBlendModes, 0, sizeof( mBlendModes ) );
@@ -107,6 +115,8 @@ namespace Ogre
 			density = StringConverter::parseReal(paramVal);
 		}
 
+        setDryness( dryness );
+
         if( Hlms::findParamInVec( params, "diffuse", paramVal ) )
         {
             Vector3 val = StringConverter::parseVector3( paramVal, Vector3::UNIT_SCALE );
@@ -298,6 +308,24 @@ namespace Ogre
     //-----------------------------------------------------------------------------------
     HlmsInkDatablock::~HlmsInkDatablock()
     {
+        //Unlink from the LOD chain.
+        if( mLodParent )
+        {
+            FastArray<HlmsInkDatablock*>::iterator itor = std::find( mLodParent->mLodVariants.begin(),
+                                                                     mLodParent->mLodVariants.end(),
+                                                                     this );
+            if( itor != mLodParent->mLodVariants.end() )
+            {
+                const size_t idx = itor - mLodParent->mLodVariants.begin();
+                mLodParent->mLodVariants.erase( itor );
+                mLodParent->mLodSquaredDistances.erase( mLodParent->mLodSquaredDistances.begin() +
+                                                        idx );
+            }
+        }
+
+        for( size_t i=0; i<mLodVariants.size(); ++i )
+            mLodVariants[i]->mLodParent = 0;
+
         if( mAssignedPool )
             static_cast<HlmsInk*>(mCreator)->releaseSlot( this );
 
@@ -351,45 +379,128 @@ namespace Ogre
         }
     }
     //-----------------------------------------------------------------------------------
+    void HlmsInkDatablock::requestCalculateHash(void)
+    {
+        if( mUpdateDepth )
+            mPendingUpdates |= PendingCalculateHash;
+        else
+            calculateHash();
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInkDatablock::requestFlushRenderables(void)
+    {
+        if( mUpdateDepth )
+            mPendingUpdates |= PendingFlush;
+        else
+            flushRenderables();
+    }
+    //-----------------------------------------------------------------------------------
     void HlmsInkDatablock::scheduleConstBufferUpdate(void)
     {
-        static_cast<HlmsInk*>(mCreator)->scheduleForUpdate( this );
+        if( mUpdateDepth )
+        {
+            mPendingUpdates |= PendingConstBuffer;
+        }
+        else
+        {
+            static_cast<HlmsInk*>(mCreator)->scheduleForUpdate( this );
+            if( !mLodVariants.empty() )
+                syncLodVariantsConstBuffer();
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInkDatablock::syncLodVariantsConstBuffer(void)
+    {
+        //Everything that goes to the GPU except the texture indices, which belong to
+        //each variant's own (possibly fewer) textures.
+        const size_t valuesSize = reinterpret_cast<const char*>( mTexIndices ) -
+                                  reinterpret_cast<const char*>( mBgDiffuse );
+
+        for( size_t i=0; i<mLodVariants.size(); ++i )
+        {
+            HlmsInkDatablock *variant = mLodVariants[i];
+            memcpy( variant->mBgDiffuse, mBgDiffuse, valuesSize );
+            variant->mNormalMapWeight       = mNormalMapWeight;
+            variant->mAlphaTestThreshold    = mAlphaTestThreshold;
+            variant->scheduleConstBufferUpdate();
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInkDatablock::beginUpdate(void)
+    {
+        ++mUpdateDepth;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInkDatablock::endUpdate(void)
+    {
+        assert( mUpdateDepth > 0 && "endUpdate called without a matching beginUpdate" );
+
+        if( --mUpdateDepth == 0 )
+        {
+            const uint8 pendingUpdates = mPendingUpdates;
+            mPendingUpdates = 0;
+
+            if( pendingUpdates & PendingCalculateHash )
+                calculateHash();
+            if( pendingUpdates & PendingFlush )
+                flushRenderables();
+            if( pendingUpdates & PendingConstBuffer )
+                scheduleConstBufferUpdate();
+        }
     }
     //-----------------------------------------------------------------------------------
     void HlmsInkDatablock::uploadToConstBuffer( char *dstPtr )
     {
-        _padding0 = mAlphaTestThreshold;
-        float oldFresnelR = mFresnelR;
-        float oldFresnelG = mFresnelG;
-        float oldFresnelB = mFresnelB;
+        if( static_cast<HlmsInk*>(mCreator)->getCompactMaterials() )
+            writeCompactConstBuffer( reinterpret_cast<uint8*>( dstPtr ) );
+        else
+            writeConstBuffer( reinterpret_cast<float*>( dstPtr ) );
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInkDatablock::writeConstBuffer( float * RESTRICT_ALIAS dstPtr ) const
+    {
+        memcpy( dstPtr, &mBgDiffuse[0], MaterialSizeInGpu );
 
-        float oldkDr = mkDr;
-        float oldkDg = mkDg;
-        float oldkDb = mkDb;
+        //Patch the copy rather than the source fields.
+        const float *base = &mBgDiffuse[0];
+        dstPtr[&_padding0 - base] = mAlphaTestThreshold;
 
         if( mTransparencyMode == Transparent )
         {
             //Precompute the transparency CPU-side.
             if( mWorkflow != MetallicWorkflow )
             {
-                mFresnelR *= mTransparencyValue;
-                mFresnelG *= mTransparencyValue;
-                mFresnelB *= mTransparencyValue;
+                dstPtr[&mFresnelR - base] = mFresnelR * mTransparencyValue;
+                dstPtr[&mFresnelG - base] = mFresnelG * mTransparencyValue;
+                dstPtr[&mFresnelB - base] = mFresnelB * mTransparencyValue;
             }
-            mkDr *= mTransparencyValue * mTransparencyValue;
-            mkDg *= mTransparencyValue * mTransparencyValue;
-            mkDb *= mTransparencyValue * mTransparencyValue;
+
+            const float kDScale = mTransparencyValue * mTransparencyValue;
+            dstPtr[&mkDr - base] = mkDr * kDScale;
+            dstPtr[&mkDg - base] = mkDg * kDScale;
+            dstPtr[&mkDb - base] = mkDb * kDScale;
         }
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInkDatablock::writeCompactConstBuffer( uint8 * RESTRICT_ALIAS dstPtr ) const
+    {
+        //Same values writeConstBuffer produces, as half floats.
+        float material[64];
+        assert( MaterialSizeInGpu <= sizeof(material) );
+        writeConstBuffer( material );
 
-        memcpy( dstPtr, &mBgDiffuse[0], MaterialSizeInGpu );
+        uint16 * RESTRICT_ALIAS dstHalf = reinterpret_cast<uint16*>( dstPtr );
+        for( size_t i=0; i<56; ++i )
+            dstHalf[i] = Bitwise::floatToHalf( material[i] );
 
-        mkDr = oldkDr;
-        mkDg = oldkDg;
-        mkDb = oldkDb;
+        dstHalf[56] = Bitwise::floatToHalf( mNormalMapWeight );
 
-        mFresnelR = oldFresnelR;
-        mFresnelG = oldFresnelG;
-        mFresnelB = oldFresnelB;
+        uint8 * RESTRICT_ALIAS dstTexIndices = dstPtr + 57 * sizeof(uint16);
+        for( size_t i=0; i<NUM_INK_TEXTURE_TYPES; ++i )
+        {
+            assert( mTexIndices[i] < 256u && "Compact materials need texture array slices < 256" );
+            dstTexIndices[i] = static_cast<uint8>( std::min<uint16>( mTexIndices[i], 255u ) );
+        }
     }
     //-----------------------------------------------------------------------------------
     void HlmsInkDatablock::notifyOptimizationStrategyChanged(void)
@@ -408,6 +519,12 @@ namespace Ogre
             {
                 outTextures[i] = InkBakedTexture( mBakedTextures[idx].texture, mSamplerblocks[i] );
             }
+            else if( i >= INK_DETAIL_WEIGHT && i <= INK_DETAIL3_NM )
+            {
+                //Dead detail maps are still assigned; bakeTextures will reevaluate them.
+                outTextures[i] = InkBakedTexture( mDeadDetailTextures[i - INK_DETAIL_WEIGHT],
+                                                  mSamplerblocks[i] );
+            }
             else
             {
                 //The texture may be null, but the samplerblock information may still be there.
@@ -425,7 +542,18 @@ namespace Ogre
 
         for( size_t i=0; i<NUM_INK_TEXTURE_TYPES; ++i )
         {
-            if( !textures[i].texture.isNull() )
+            const bool isDetailSlot = i >= INK_DETAIL_WEIGHT && i <= INK_DETAIL3_NM;
+            if( isDetailSlot )
+                mDeadDetailTextures[i - INK_DETAIL_WEIGHT].setNull();
+
+            if( isDetailSlot && !textures[i].texture.isNull() &&
+                isDetailMapDead( static_cast<InkTextureTypes>( i ), textures ) )
+            {
+                //Keep it assigned, but don't sample it.
+                mDeadDetailTextures[i - INK_DETAIL_WEIGHT] = textures[i].texture;
+                mTexToBakedTextureIdx[i] = NUM_INK_TEXTURE_TYPES;
+            }
+            else if( !textures[i].texture.isNull() )
             {
                 InkBakedTextureArray::const_iterator itor = std::find( mBakedTextures.begin(),
                                                                        mBakedTextures.end(),
@@ -447,11 +575,46 @@ namespace Ogre
             }
         }
 
-        calculateHash();
-        flushRenderables();
+        requestCalculateHash();
+        requestFlushRenderables();
         scheduleConstBufferUpdate();
     }
     //-----------------------------------------------------------------------------------
+    bool HlmsInkDatablock::isDetailMapDead( InkTextureTypes texType,
+                                            const InkBakedTexture textures[NUM_INK_TEXTURE_TYPES] ) const
+    {
+        if( texType >= INK_DETAIL0 && texType <= INK_DETAIL3 )
+            return mDetailWeight[texType - INK_DETAIL0] == 0.0f;
+
+        if( texType >= INK_DETAIL0_NM && texType <= INK_DETAIL3_NM )
+            return mDetailNormalWeight[texType - INK_DETAIL0_NM] == 0.0f;
+
+        if( texType == INK_DETAIL_WEIGHT )
+        {
+            for( size_t i=INK_DETAIL0; i<=INK_DETAIL3_NM; ++i )
+            {
+                if( !textures[i].texture.isNull() &&
+                    !isDetailMapDead( static_cast<InkTextureTypes>( i ), textures ) )
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInkDatablock::rebakeIfDetailDeadnessChanged( InkTextureTypes texType, bool wasDead )
+    {
+        InkBakedTexture textures[NUM_INK_TEXTURE_TYPES];
+        decompileBakedTextures( textures );
+
+        if( !textures[texType].texture.isNull() && wasDead != isDetailMapDead( texType, textures ) )
+            bakeTextures( textures );
+    }
+    //-----------------------------------------------------------------------------------
     TexturePtr HlmsInkDatablock::setTexture( const String &name,
                                              InkTextureTypes textureType )
     {
@@ -475,9 +638,9 @@ namespace Ogre
 
         HlmsManager *hlmsManager = mCreator->getHlmsManager();
         HlmsTextureManager *hlmsTextureManager = hlmsManager->getTextureManager();
-        HlmsTextureManager::TextureLocation texLocation = hlmsTextureManager->
-                                                    createOrRetrieveTexture( name,
-                                                                             texMapTypes[textureType] );
+        HlmsTextureManager::TextureLocation texLocation = static_cast<HlmsInk*>(mCreator)->
+                                                    _createOrRetrieveTexture( name,
+                                                                              texMapTypes[textureType] );
 
         assert( texLocation.texture->isTextureTypeArray() || textureType == INK_REFLECTION );
 
@@ -564,7 +727,7 @@ namespace Ogre
         if( mWorkflow != workflow )
         {
             mWorkflow = static_cast<uint8>( workflow );
-            flushRenderables();
+            requestFlushRenderables();
         }
     }
     //-----------------------------------------------------------------------------------
@@ -611,7 +774,7 @@ namespace Ogre
         if( fresnelBytes != mFresnelTypeSizeBytes )
         {
             mFresnelTypeSizeBytes = fresnelBytes;
-            flushRenderables();
+            requestFlushRenderables();
         }
 
         scheduleConstBufferUpdate();
@@ -719,6 +882,8 @@ namespace Ogre
 
         if( mTexToBakedTextureIdx[texType] < mBakedTextures.size() )
             retVal = mBakedTextures[mTexToBakedTextureIdx[texType]].texture;
+        else if( texType >= INK_DETAIL_WEIGHT && texType <= INK_DETAIL3_NM )
+            retVal = mDeadDetailTextures[texType - INK_DETAIL_WEIGHT];
 
         return retVal;
     }
@@ -767,7 +932,7 @@ namespace Ogre
         if( mUvSource[sourceType] != uvSet )
         {
             mUvSource[sourceType] = uvSet;
-            flushRenderables();
+            requestFlushRenderables();
         }
     }
     //-----------------------------------------------------------------------------------
@@ -784,7 +949,7 @@ namespace Ogre
         if( mBlendModes[detailMapIdx] != blendMode )
         {
             mBlendModes[detailMapIdx] = blendMode;
-            flushRenderables();
+            requestFlushRenderables();
         }
     }
     //-----------------------------------------------------------------------------------
@@ -799,13 +964,20 @@ namespace Ogre
         assert( detailNormalMapIdx < 4 );
 
         bool wasOne = mDetailNormalWeight[detailNormalMapIdx] == 1.0f;
+        bool wasZero = mDetailNormalWeight[detailNormalMapIdx] == 0.0f;
         mDetailNormalWeight[detailNormalMapIdx] = weight;
 
         if( wasOne != (mDetailNormalWeight[detailNormalMapIdx] == 1.0f) )
         {
-            flushRenderables();
+            requestFlushRenderables();
             scheduleConstBufferUpdate();
         }
+
+        if( wasZero != (weight == 0.0f) )
+        {
+            rebakeIfDetailDeadnessChanged(
+                        static_cast<InkTextureTypes>( INK_DETAIL0_NM + detailNormalMapIdx ), wasZero );
+        }
     }
     //-----------------------------------------------------------------------------------
     Real HlmsInkDatablock::getDetailNormalWeight( uint8 detailNormalMapIdx ) const
@@ -821,7 +993,7 @@ namespace Ogre
 
         if( wasDisabled != (mNormalMapWeight == 1.0f) )
         {
-            flushRenderables();
+            requestFlushRenderables();
             scheduleConstBufferUpdate();
         }
     }
@@ -831,17 +1003,47 @@ namespace Ogre
         return mNormalMapWeight;
     }
     //-----------------------------------------------------------------------------------
+    void HlmsInkDatablock::setDryness( Real _dryness )
+    {
+        dryness = _dryness;
+        mInkParamsHalf2 = Bitwise::floatToHalf( dryness ) |
+                          (static_cast<uint32>( Bitwise::floatToHalf( density ) ) << 16u);
+    }
+    //-----------------------------------------------------------------------------------
+    Real HlmsInkDatablock::getDryness(void) const
+    {
+        return dryness;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInkDatablock::setDensity( Real _density )
+    {
+        density = _density;
+        setDryness( dryness );
+    }
+    //-----------------------------------------------------------------------------------
+    Real HlmsInkDatablock::getDensity(void) const
+    {
+        return density;
+    }
+    //-----------------------------------------------------------------------------------
     void HlmsInkDatablock::setDetailMapWeight( uint8 detailMap, Real weight )
     {
         assert( detailMap < 4 );
         bool wasDisabled = mDetailWeight[detailMap] == 1.0f;
+        bool wasZero = mDetailWeight[detailMap] == 0.0f;
 
         mDetailWeight[detailMap] = weight;
 
         if( wasDisabled != (mDetailWeight[detailMap] == 1.0f) )
-            flushRenderables();
+            requestFlushRenderables();
 
         scheduleConstBufferUpdate();
+
+        if( wasZero != (weight == 0.0f) )
+        {
+            rebakeIfDetailDeadnessChanged(
+                        static_cast<InkTextureTypes>( INK_DETAIL0 + detailMap ), wasZero );
+        }
     }
     //-----------------------------------------------------------------------------------
     Real HlmsInkDatablock::getDetailMapWeight( uint8 detailMap ) const
@@ -859,7 +1061,7 @@ namespace Ogre
 
         if( wasDisabled != (mDetailsOffsetScale[detailMap] == Vector4( 0, 0, 1, 1 )) )
         {
-            flushRenderables();
+            requestFlushRenderables();
         }
 
         scheduleConstBufferUpdate();
@@ -894,7 +1096,7 @@ namespace Ogre
             }
         }
 
-        flushRenderables();
+        requestFlushRenderables();
     }
     //-----------------------------------------------------------------------------------
     bool HlmsInkDatablock::getTwoSidedLighting(void) const
@@ -979,7 +1181,7 @@ namespace Ogre
 
         scheduleConstBufferUpdate();
         if( mustFlush )
-            flushRenderables();
+            requestFlushRenderables();
     }
     //-----------------------------------------------------------------------------------
     void HlmsInkDatablock::setCubemapProbe( CubemapProbe *probe )
@@ -1013,7 +1215,7 @@ namespace Ogre
         if( mBrdf != brdf )
         {
             mBrdf = brdf;
-            flushRenderables();
+            requestFlushRenderables();
         }
     }
     //-----------------------------------------------------------------------------------
@@ -0,0 +1,260 @@
+/*
+-----------------------------------------------------------------------------
+This source file is part of OGRE
+    (Object-oriented Graphics Rendering Engine)
+For the latest info, see http://www.ogre3d.org/
+
+Copyright (c) 2000-2014 Torus Knot Software Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+-----------------------------------------------------------------------------
+*/
+
+#include "OgreStableHeaders.h"
+
+#include "OgreHlmsInkDiskCache.h"
+#include "OgreHlmsInk.h"
+#include "OgreGpuProgramManager.h"
+#include "OgreArchive.h"
+#include "OgreDataStream.h"
+#include "OgreLogManager.h"
+#include "OgreStringConverter.h"
+
+namespace Ogre
+{
+    static const uint32 c_diskCacheMagic    = 0x434B4E49; //'INKC'
+    static const uint32 c_diskCacheVersion  = 1u;
+
+    HlmsInkDiskCache::HlmsInkDiskCache( HlmsInk *hlmsInk ) :
+        mTemplateHash( 0 ),
+        mDirty( false )
+    {
+        const String &shaderProfile = hlmsInk->getShaderProfile();
+        uint32 hash = FastHash( shaderProfile.c_str(), static_cast<int>( shaderProfile.size() ) );
+
+        hash = hashArchive( hlmsInk->getDataFolder(), hash );
+
+        const ArchiveVec libraries = hlmsInk->getPiecesLibraryAsArchiveVec();
+        ArchiveVec::const_iterator itor = libraries.begin();
+        ArchiveVec::const_iterator end  = libraries.end();
+        while( itor != end )
+        {
+            hash = hashArchive( *itor, hash );
+            ++itor;
+        }
+
+        mTemplateHash = hash;
+    }
+    //-----------------------------------------------------------------------------------
+    uint32 HlmsInkDiskCache::hashArchive( Archive *archive, uint32 hashSoFar )
+    {
+        if( !archive )
+            return hashSoFar;
+
+        StringVectorPtr files = archive->list( false, false );
+        //Listing order is not guaranteed to be stable.
+        std::sort( files->begin(), files->end() );
+
+        String contents;
+        StringVector::const_iterator itor = files->begin();
+        StringVector::const_iterator end  = files->end();
+
+        while( itor != end )
+        {
+            hashSoFar = FastHash( itor->c_str(), static_cast<int>( itor->size() ), hashSoFar );
+
+            DataStreamPtr stream = archive->open( *itor );
+            contents.resize( stream->size() );
+            if( !contents.empty() )
+            {
+                stream->read( &contents[0], contents.size() );
+                hashSoFar = FastHash( contents.c_str(), static_cast<int>( contents.size() ),
+                                      hashSoFar );
+            }
+
+            ++itor;
+        }
+
+        return hashSoFar;
+    }
+    //-----------------------------------------------------------------------------------
+    const HlmsInkDiskCache::Entry* HlmsInkDiskCache::findEntry( uint32 key ) const
+    {
+        EntryMap::const_iterator itor = mEntries.find( key );
+        return itor != mEntries.end() ? &itor->second : 0;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInkDiskCache::addEntry( uint32 key, const Entry &entry )
+    {
+        mEntries[key] = entry;
+        mDirty = true;
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInkDiskCache::clear(void)
+    {
+        mDirty = !mEntries.empty();
+        mEntries.clear();
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsInkDiskCache::save( DataStreamPtr &stream, bool includeMicrocode )
+    {
+        const uint32 header[4] =
+        {
+            c_diskCacheMagic,
+            c_diskCacheVersion,
+            mTemplateHash,
+            static_cast<uint32>( mEntries.size() )
+        };
+        stream->write( header, sizeof( header ) );
+
+        EntryMap::const_iterator itor = mEntries.begin();
+        EntryMap::const_iterator end  = mEntries.end();
+
+        while( itor != end )
+        {
+            const Entry &entry = itor->second;
+
+            const uint32 entryHeader[2] =
+            {
+                itor->first,
+                static_cast<uint32>( entry.setProperties.size() )
+            };
+            stream->write( entryHeader, sizeof( entryHeader ) );
+
+            HlmsPropertyVec::const_iterator itProp = entry.setProperties.begin();
+            HlmsPropertyVec::const_iterator enProp = entry.setProperties.end();
+            while( itProp != enProp )
+            {
+                const uint32 keyHash = itProp->keyName.mHash;
+                const int32 value = itProp->value;
+                stream->write( &keyHash, sizeof( keyHash ) );
+                stream->write( &value, sizeof( value ) );
+                ++itProp;
+            }
+
+            for( size_t i=0; i<NumShaderTypes; ++i )
+            {
+                const uint32 sourceSize = static_cast<uint32>( entry.sources[i].size() );
+                stream->write( &sourceSize, sizeof( sourceSize ) );
+                if( sourceSize )
+                    stream->write( entry.sources[i].c_str(), sourceSize );
+            }
+
+            ++itor;
+        }
+
+        const uint8 hasMicrocode = includeMicrocode;
+        stream->write( &hasMicrocode, sizeof( hasMicrocode ) );
+        if( includeMicrocode )
+            GpuProgramManager::getSingleton().saveMicrocodeCache( stream );
+
+        mDirty = false;
+    }
+    //-----------------------------------------------------------------------------------
+    bool HlmsInkDiskCache::readEntry( DataStreamPtr &stream, Entry &outEntry )
+    {
+        uint32 numProperties = 0;
+        if( stream->read( &numProperties, sizeof( numProperties ) ) != sizeof( numProperties ) )
+            return false;
+
+        //A corrupt count must not make us allocate gigabytes. Streams of unknown size
+        //report 0, in which case the reads below catch the truncation.
+        const size_t streamSize = stream->size();
+        const size_t remaining  = streamSize ? streamSize - stream->tell() : 0;
+        if( streamSize && numProperties > remaining / (sizeof( uint32 ) + sizeof( int32 )) )
+            return false;
+
+        outEntry.setProperties.resize( numProperties, HlmsProperty( IdString(), 0 ) );
+
+        HlmsPropertyVec::iterator itProp = outEntry.setProperties.begin();
+        HlmsPropertyVec::iterator enProp = outEntry.setProperties.end();
+        while( itProp != enProp )
+        {
+            if( stream->read( &itProp->keyName.mHash, sizeof( uint32 ) ) != sizeof( uint32 ) ||
+                stream->read( &itProp->value, sizeof( int32 ) ) != sizeof( int32 ) )
+            {
+                return false;
+            }
+            ++itProp;
+        }
+
+        for( size_t i=0; i<NumShaderTypes; ++i )
+        {
+            uint32 sourceSize = 0;
+            if( stream->read( &sourceSize, sizeof( sourceSize ) ) != sizeof( sourceSize ) )
+                return false;
+
+            if( streamSize && sourceSize > streamSize - stream->tell() )
+                return false;
+
+            outEntry.sources[i].resize( sourceSize );
+            if( sourceSize && stream->read( &outEntry.sources[i][0], sourceSize ) != sourceSize )
+                return false;
+        }
+
+        return true;
+    }
+    //-----------------------------------------------------------------------------------
+    bool HlmsInkDiskCache::load( DataStreamPtr &stream )
+    {
+        mEntries.clear();
+        mDirty = false;
+
+        uint32 header[4];
+        if( stream->read( header, sizeof( header ) ) != sizeof( header ) ||
+            header[0] != c_diskCacheMagic || header[1] != c_diskCacheVersion ||
+            header[2] != mTemplateHash )
+        {
+            return false;
+        }
+
+        const uint32 numEntries = header[3];
+        for( uint32 i=0; i<numEntries; ++i )
+        {
+            uint32 key = 0;
+            Entry entry;
+            if( stream->read( &key, sizeof( key ) ) != sizeof( key ) ||
+                !readEntry( stream, entry ) )
+            {
+                //Truncated or corrupt. Keep what was read in full; the rest of the
+                //permutations get compiled again and the file rewritten on save.
+                LogManager::getSingleton().logMessage(
+                            "HlmsInkDiskCache: cache file is truncated after " +
+                            StringConverter::toString( i ) + " of " +
+                            StringConverter::toString( numEntries ) + " entries." );
+                mDirty = true;
+                return true;
+            }
+
+            Entry &dstEntry = mEntries[key];
+            dstEntry.setProperties.swap( entry.setProperties );
+            for( size_t j=0; j<NumShaderTypes; ++j )
+                dstEntry.sources[j].swap( entry.sources[j] );
+        }
+
+        uint8 hasMicrocode = 0;
+        if( stream->read( &hasMicrocode, sizeof( hasMicrocode ) ) == sizeof( hasMicrocode ) &&
+            hasMicrocode )
+        {
+            GpuProgramManager::getSingleton().loadMicrocodeCache( stream );
+        }
+
+        return true;
+    }
+}
@@ -31,6 +31,7 @@ THE SOFTWARE.
 #if !OGRE_NO_JSON
 
 #include "OgreHlmsJsonInk.h"
+#include "OgreHlmsInk.h"
 #include "OgreHlmsManager.h"
 #include "OgreHlmsTextureManager.h"
 #include "OgreTextureManager.h"
@@ -184,9 +185,9 @@ namespace Ogre
             const char *textureName = itor->value.GetString();
 
             HlmsTextureManager *hlmsTextureManager = mHlmsManager->getTextureManager();
-            HlmsTextureManager::TextureLocation texLocation = hlmsTextureManager->
-                createOrRetrieveTexture(textureName,
-                texMapTypes[textureType]);
+            HlmsTextureManager::TextureLocation texLocation =
+                static_cast<HlmsInk*>( datablock->getCreator() )->_createOrRetrieveTexture(
+                    textureName, texMapTypes[textureType] );
 
             assert(texLocation.texture->isTextureTypeArray() || textureType == INK_REFLECTION);
 
@@ -266,6 +267,9 @@ namespace Ogre
         assert( dynamic_cast<HlmsInkDatablock*>(datablock) );
         HlmsInkDatablock *pbsDatablock = static_cast<HlmsInkDatablock*>(datablock);
 
+        //Rehash, flush and upload once, after every setting has been applied.
+        pbsDatablock->beginUpdate();
+
         rapidjson::Value::ConstMemberIterator itor = json.FindMember("workflow");
         if( itor != json.MemberEnd() && itor->value.IsString() )
             pbsDatablock->setWorkflow( parseWorkflow( itor->value.GetString() ) );
@@ -473,6 +477,8 @@ namespace Ogre
         }
 
         pbsDatablock->_setTextures( packedTextures );
+
+        pbsDatablock->endUpdate();
     }
     //-----------------------------------------------------------------------------------
     void HlmsJsonInk::toQuotedStr( HlmsInkDatablock::Workflows value, String &outString )
@@ -0,0 +1,457 @@
+/*
+-----------------------------------------------------------------------------
+This source file is part of OGRE
+    (Object-oriented Graphics Rendering Engine)
+For the latest info, see http://www.ogre3d.org/
+
+Copyright (c) 2000-2014 Torus Knot Software Ltd
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+-----------------------------------------------------------------------------
+*/
+
+#include "OgreStableHeaders.h"
+
+#if !OGRE_NO_JSON
+
+#include "OgreHlmsJsonInkStream.h"
+#include "OgreHlmsManager.h"
+#include "OgreHlms.h"
+#include "OgreLwString.h"
+#include "OgreStringConverter.h"
+
+#include "rapidjson/document.h"
+#include "rapidjson/reader.h"
+
+namespace Ogre
+{
+    /// Read-only rapidjson stream that pulls a DataStream in fixed size chunks.
+    class JsonDataStreamReader
+    {
+        DataStream          *mStream;
+        vector<char>::type  mBuffer;
+        const char          *mCurrent;
+        const char          *mEnd;
+        /// Bytes consumed before the current chunk.
+        size_t              mChunkOffset;
+
+        void nextChunk(void)
+        {
+            mChunkOffset += mEnd - &mBuffer[0];
+            const size_t bytesRead = mStream->read( &mBuffer[0], mBuffer.size() );
+            mCurrent    = &mBuffer[0];
+            mEnd        = mCurrent + bytesRead;
+        }
+
+    public:
+        typedef char Ch;
+
+        JsonDataStreamReader( DataStream *stream, size_t chunkSize=64 * 1024 ) :
+            mStream( stream ),
+            mBuffer( chunkSize ),
+            mCurrent( &mBuffer[0] ),
+            mEnd( &mBuffer[0] ),
+            mChunkOffset( 0 )
+        {
+            nextChunk();
+        }
+
+        Ch Peek(void) const     { return mCurrent != mEnd ? *mCurrent : '\0'; }
+        Ch Take(void)
+        {
+            if( mCurrent == mEnd )
+                return '\0';
+
+            const Ch c = *mCurrent++;
+            if( mCurrent == mEnd )
+                nextChunk();
+            return c;
+        }
+        size_t Tell(void) const { return mChunkOffset + (mCurrent - &mBuffer[0]); }
+
+        //Only needed for in-situ parsing, which we don't do.
+        Ch* PutBegin(void)      { assert( false ); return 0; }
+        void Put( Ch )          { assert( false ); }
+        void Flush(void)        { assert( false ); }
+        size_t PutEnd( Ch* )    { assert( false ); return 0; }
+    };
+
+    /** Receives the SAX events. Objects from the named block sections and each material
+        entry are captured into a rapidjson::Value; everything else is skipped.
+    @remarks
+        The handler concept requires a method called String, hence Ogre::String below.
+    */
+    class HlmsJsonInkStreamHandler :
+            public rapidjson::BaseReaderHandler< rapidjson::UTF8<>, HlmsJsonInkStreamHandler >
+    {
+        enum Section
+        {
+            SectionNone,
+            SectionSamplers,
+            SectionMacroblocks,
+            SectionBlendblocks,
+            SectionDatablocks,
+            SectionSkip
+        };
+
+        typedef rapidjson::MemoryPoolAllocator<> Allocator;
+
+        HlmsJsonInkStream   *mLoader;
+        HlmsManager         *mHlmsManager;
+        Ogre::String const  &mFilename;
+        Ogre::String const  &mResourceGroup;
+
+        HlmsJson::NamedBlocks   mBlocks;
+        Allocator           mBlocksAllocator;
+        /// Keeps alive the strings the keys of mBlocks point to.
+        rapidjson::Value    mBlockSections[SectionBlendblocks - SectionSamplers + 1];
+        bool                mDatablocksLoaded;
+
+        size_t              mDepth;
+        Section             mSection;
+        Hlms                *mHlms;
+        Ogre::String        mDatablockName;
+
+        /// Most material entries fit here, thus clearing the allocator between
+        /// entries doesn't go back to the heap.
+        uint64              mEntryBuffer[2048];
+        Allocator           mEntryAllocator;
+
+        Allocator           *mCaptureAllocator;
+        rapidjson::Value    mCaptured;
+        rapidjson::Value    mPendingKey;
+        vector<rapidjson::Value*>::type mCaptureStack;
+
+        bool isCapturing(void) const        { return !mCaptureStack.empty(); }
+
+        void addCapturedValue( rapidjson::Value &value )
+        {
+            rapidjson::Value *parent = mCaptureStack.back();
+            if( parent->IsObject() )
+                parent->AddMember( mPendingKey, value, *mCaptureAllocator );
+            else
+                parent->PushBack( value, *mCaptureAllocator );
+        }
+
+        bool addScalar( rapidjson::Value &value )
+        {
+            if( isCapturing() )
+                addCapturedValue( value );
+            return true;
+        }
+
+        void beginCapture( Allocator *allocator )
+        {
+            mCaptureAllocator = allocator;
+            mCaptured.SetObject();
+            mCaptureStack.push_back( &mCaptured );
+        }
+
+        void pushCapturedContainer( rapidjson::Type type )
+        {
+            rapidjson::Value container( type );
+            addCapturedValue( container );
+
+            //Only the innermost container grows, so this pointer stays valid until popped.
+            rapidjson::Value *parent = mCaptureStack.back();
+            if( parent->IsObject() )
+                mCaptureStack.push_back( &(parent->MemberEnd() - 1)->value );
+            else
+                mCaptureStack.push_back( &(*parent)[parent->Size() - 1u] );
+        }
+
+        bool endContainer(void)
+        {
+            --mDepth;
+
+            if( isCapturing() )
+            {
+                mCaptureStack.pop_back();
+                if( !isCapturing() )
+                    endCapture();
+            }
+
+            return true;
+        }
+
+        void endCapture(void)
+        {
+            mLoader->mPeakValueBytes = std::max( mLoader->mPeakValueBytes,
+                                                 mBlocksAllocator.Size() + mEntryAllocator.Size() );
+
+            if( mSection == SectionDatablocks )
+            {
+                loadDatablock();
+                mCaptured.SetNull();
+                mEntryAllocator.Clear();
+            }
+            else
+            {
+                loadNamedBlocks();
+            }
+        }
+
+        void beginSection( const char *name, rapidjson::SizeType length )
+        {
+            const Ogre::String sectionName( name, length );
+
+            mSection = SectionSkip;
+            mHlms = 0;
+
+            if( sectionName == "samplers" )
+                mSection = SectionSamplers;
+            else if( sectionName == "macroblocks" )
+                mSection = SectionMacroblocks;
+            else if( sectionName == "blendblocks" )
+                mSection = SectionBlendblocks;
+
+            if( mSection != SectionSkip && mDatablocksLoaded )
+            {
+                OGRE_EXCEPT( Exception::ERR_INVALIDPARAMS,
+                             "Section '" + sectionName + "' found after the materials in " +
+                             mFilename + ". Streamed material files must declare their "
+                             "samplers, macroblocks & blendblocks first.",
+                             "HlmsJsonInkStream::loadMaterials" );
+            }
+
+            for( int i=0; i<HLMS_MAX && mSection == SectionSkip; ++i )
+            {
+                Hlms *hlms = mHlmsManager->getHlms( static_cast<HlmsTypes>( i ) );
+                if( hlms && hlms->getTypeNameStr() == sectionName )
+                {
+                    mSection = SectionDatablocks;
+                    mHlms = hlms;
+                }
+            }
+        }
+
+        void loadNamedBlocks(void)
+        {
+            rapidjson::Value &json = mBlockSections[mSection - SectionSamplers];
+
+            //Like FindMember, only the first section with a given name counts.
+            if( !json.IsNull() )
+                return;
+
+            json = mCaptured; //Moves
+
+            rapidjson::Value::ConstMemberIterator itor = json.MemberBegin();
+            rapidjson::Value::ConstMemberIterator end  = json.MemberEnd();
+
+            while( itor != end )
+            {
+                if( itor->value.IsObject() )
+                {
+                    LwConstString keyName( LwConstString::FromUnsafeCStr( itor->name.GetString() ) );
+
+                    if( mSection == SectionSamplers )
+                    {
+                        HlmsSamplerblock samplerblock;
+                        mLoader->loadSampler( itor->value, samplerblock );
+                        const HlmsSamplerblock *block = mHlmsManager->getSamplerblock( samplerblock );
+                        if( mBlocks.samplerblocks.find( keyName ) != mBlocks.samplerblocks.end() )
+                            mHlmsManager->destroySamplerblock( mBlocks.samplerblocks[keyName] );
+                        mBlocks.samplerblocks[keyName] = block;
+                    }
+                    else if( mSection == SectionMacroblocks )
+                    {
+                        HlmsMacroblock macroblock;
+                        mLoader->loadMacroblock( itor->value, macroblock );
+                        const HlmsMacroblock *block = mHlmsManager->getMacroblock( macroblock );
+                        if( mBlocks.macroblocks.find( keyName ) != mBlocks.macroblocks.end() )
+                            mHlmsManager->destroyMacroblock( mBlocks.macroblocks[keyName] );
+                        mBlocks.macroblocks[keyName] = block;
+                    }
+                    else
+                    {
+                        HlmsBlendblock blendblock;
+                        mLoader->loadBlendblock( itor->value, blendblock );
+                        const HlmsBlendblock *block = mHlmsManager->getBlendblock( blendblock );
+                        if( mBlocks.blendblocks.find( keyName ) != mBlocks.blendblocks.end() )
+                            mHlmsManager->destroyBlendblock( mBlocks.blendblocks[keyName] );
+                        mBlocks.blendblocks[keyName] = block;
+                    }
+                }
+
+                ++itor;
+            }
+        }
+
+        void loadDatablock(void)
+        {
+            HlmsDatablock *datablock = mHlms->createDatablock( mDatablockName, mDatablockName,
+                                                               HlmsMacroblock(), HlmsBlendblock(),
+                                                               HlmsParamVec(), true,
+                                                               mFilename, mResourceGroup );
+            mDatablocksLoaded = true;
+
+            mLoader->loadDatablockCommon( mCaptured, mBlocks, datablock );
+            mHlms->_loadJson( mCaptured, mBlocks, datablock );
+        }
+
+    public:
+        HlmsJsonInkStreamHandler( HlmsJsonInkStream *loader, HlmsManager *hlmsManager,
+                                  const Ogre::String &filename, const Ogre::String &resourceGroup ) :
+            mLoader( loader ),
+            mHlmsManager( hlmsManager ),
+            mFilename( filename ),
+            mResourceGroup( resourceGroup ),
+            mDatablocksLoaded( false ),
+            mDepth( 0 ),
+            mSection( SectionNone ),
+            mHlms( 0 ),
+            mEntryAllocator( mEntryBuffer, sizeof( mEntryBuffer ) ),
+            mCaptureAllocator( 0 )
+        {
+        }
+
+        ~HlmsJsonInkStreamHandler()
+        {
+            //Remove the references we hold, like HlmsJson::loadMaterials does.
+            {
+                map<LwConstString, const HlmsMacroblock*>::type::const_iterator itor =
+                        mBlocks.macroblocks.begin();
+                map<LwConstString, const HlmsMacroblock*>::type::const_iterator end  =
+                        mBlocks.macroblocks.end();
+                while( itor != end )
+                    mHlmsManager->destroyMacroblock( (itor++)->second );
+            }
+            {
+                map<LwConstString, const HlmsBlendblock*>::type::const_iterator itor =
+                        mBlocks.blendblocks.begin();
+                map<LwConstString, const HlmsBlendblock*>::type::const_iterator end  =
+                        mBlocks.blendblocks.end();
+                while( itor != end )
+                    mHlmsManager->destroyBlendblock( (itor++)->second );
+            }
+            {
+                map<LwConstString, const HlmsSamplerblock*>::type::const_iterator itor =
+                        mBlocks.samplerblocks.begin();
+                map<LwConstString, const HlmsSamplerblock*>::type::const_iterator end  =
+                        mBlocks.samplerblocks.end();
+                while( itor != end )
+                    mHlmsManager->destroySamplerblock( (itor++)->second );
+            }
+        }
+
+        bool Null(void)                 { rapidjson::Value v; return addScalar( v ); }
+        bool Bool( bool b )             { rapidjson::Value v( b ); return addScalar( v ); }
+        bool Int( int i )               { rapidjson::Value v( i ); return addScalar( v ); }
+        bool Uint( unsigned u )         { rapidjson::Value v( u ); return addScalar( v ); }
+        bool Int64( int64_t i )         { rapidjson::Value v( i ); return addScalar( v ); }
+        bool Uint64( uint64_t u )       { rapidjson::Value v( u ); return addScalar( v ); }
+        bool Double( double d )         { rapidjson::Value v( d ); return addScalar( v ); }
+
+        bool String( const char *str, rapidjson::SizeType length, bool copy )
+        {
+            if( isCapturing() )
+            {
+                rapidjson::Value v( str, length, *mCaptureAllocator );
+                addCapturedValue( v );
+            }
+            return true;
+        }
+
+        bool Key( const char *str, rapidjson::SizeType length, bool copy )
+        {
+            if( isCapturing() )
+                mPendingKey.SetString( str, length, *mCaptureAllocator );
+            else if( mDepth == 1u )
+                beginSection( str, length );
+            else if( mDepth == 2u && mSection == SectionDatablocks )
+                mDatablockName.assign( str, length );
+            return true;
+        }
+
+        bool StartObject(void)
+        {
+            if( isCapturing() )
+                pushCapturedContainer( rapidjson::kObjectType );
+            else if( mDepth == 1u && mSection >= SectionSamplers && mSection <= SectionBlendblocks )
+                beginCapture( &mBlocksAllocator );
+            else if( mDepth == 2u && mSection == SectionDatablocks )
+                beginCapture( &mEntryAllocator );
+
+            ++mDepth;
+            return true;
+        }
+
+        bool StartArray(void)
+        {
+            if( isCapturing() )
+                pushCapturedContainer( rapidjson::kArrayType );
+            else if( mDepth == 1u )
+                mSection = SectionSkip; //Sections must be objects.
+
+            ++mDepth;
+            return true;
+        }
+
+        bool EndObject( rapidjson::SizeType memberCount )   { return endContainer(); }
+        bool EndArray( rapidjson::SizeType elementCount )   { return endContainer(); }
+    };
+    //-----------------------------------------------------------------------------------
+    template <typename InputStream>
+    static void parseJsonInkStream( InputStream &inputStream, HlmsJsonInkStreamHandler &handler,
+                                    const String &filename )
+    {
+        rapidjson::Reader reader;
+        reader.Parse( inputStream, handler );
+
+        if( reader.HasParseError() )
+        {
+            OGRE_EXCEPT( Exception::ERR_INVALIDPARAMS,
+                         "Invalid JSON string in file " + filename + " at offset " +
+                         StringConverter::toString( reader.GetErrorOffset() ),
+                         "HlmsJsonInkStream::loadMaterials" );
+        }
+    }
+    //-----------------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------------
+    //-----------------------------------------------------------------------------------
+    HlmsJsonInkStream::HlmsJsonInkStream( HlmsManager *hlmsManager ) :
+        HlmsJson( hlmsManager ),
+        mPeakValueBytes( 0 )
+    {
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsJsonInkStream::loadMaterials( const String &filename, const String &resourceGroup,
+                                           const char *jsonString )
+    {
+        mPeakValueBytes = 0;
+
+        HlmsJsonInkStreamHandler handler( this, mHlmsManager, filename, resourceGroup );
+        rapidjson::StringStream inputStream( jsonString );
+        parseJsonInkStream( inputStream, handler, filename );
+    }
+    //-----------------------------------------------------------------------------------
+    void HlmsJsonInkStream::loadMaterials( const DataStreamPtr &stream, const String &resourceGroup,
+                                           const String &filename )
+    {
+        mPeakValueBytes = 0;
+
+        const String &name = filename.empty() ? stream->getName() : filename;
+
+        HlmsJsonInkStreamHandler handler( this, mHlmsManager, name, resourceGroup );
+        JsonDataStreamReader inputStream( stream.get() );
+        parseJsonInkStream( inputStream, handler, name );
+    }
+}
+
+#endif